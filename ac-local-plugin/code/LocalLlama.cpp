@@ -7,6 +7,7 @@
 #include <ac/llama/Init.hpp>
 #include <ac/llama/Model.hpp>
 #include <ac/llama/AntipromptManager.hpp>
+#include <ac/llama/IncrementalDetokenizer.hpp>
 #include <ac/llama/ControlVector.hpp>
 #include <ac/llama/LogitComparer.hpp>
 #include <ac/llama/ResourceCache.hpp>
@@ -46,6 +47,57 @@ namespace {
 namespace sc = schema::llama;
 using namespace ac::frameio;
 
+// apply the sampling parameters of a request (which are the same for all request types) to the instance ones
+// returns false if the request doesn't set any
+template <typename RequestParams>
+bool SamplerParams_applyRequest(llama::Sampler::Params& sparams, const RequestParams& rparams) {
+    bool set = false;
+    auto apply = [&](auto& field, auto& target) {
+        if (field.hasValue()) {
+            target = field.value();
+            set = true;
+        }
+    };
+    apply(rparams.temperature, sparams.temp);
+    apply(rparams.topK, sparams.topK);
+    apply(rparams.topP, sparams.topP);
+    apply(rparams.minP, sparams.minP);
+    apply(rparams.typicalP, sparams.typicalP);
+    apply(rparams.repeatPenalty, sparams.repetitionPenalty.repeat);
+    apply(rparams.frequencyPenalty, sparams.repetitionPenalty.freq);
+    apply(rparams.presencePenalty, sparams.repetitionPenalty.present);
+    apply(rparams.repeatLastN, sparams.repetitionPenalty.numTokens);
+    apply(rparams.seed, sparams.rngSeed);
+    if (rparams.banTokenClasses.hasValue()) {
+        for (auto& name : rparams.banTokenClasses.value()) {
+            sparams.bannedClasses |= llama::TokenClasses::fromName(name);
+            set = true;
+        }
+    }
+    return set;
+}
+
+sc::OpGetSamplerMetrics::Return SamplerMetrics_toSchema(const llama::Sampler::Metrics& metrics) {
+    auto toMs = [](uint64_t ns) { return double(ns) / 1'000'000; };
+
+    std::vector<sc::SamplerStageMetrics> stages;
+    for (auto& s : metrics.stages) {
+        stages.push_back({
+            .name = s.name,
+            .calls = s.calls,
+            .timeMs = toMs(s.timeNs),
+            .candidatesIn = s.candidatesIn,
+            .candidatesOut = s.candidatesOut,
+        });
+    }
+
+    return {
+        .samples = metrics.samples,
+        .timeMs = toMs(metrics.timeNs),
+        .stages = std::move(stages),
+    };
+}
+
 class ChatSession {
     llama::Session& m_session;
     const llama::Vocab& m_vocab;
@@ -60,6 +112,10 @@ class ChatSession {
     size_t m_submittedMessages = 0;
 
     ac::llama::AntipromptManager m_antiprompt;
+    ac::llama::IncrementalDetokenizer m_detokenizer;
+
+    llama::Sampler::Params m_samplerParams; // instance sampling params
+    bool m_requestSampler = false; // whether the sampler is configured for the last response
 
 public:
     using Schema = sc::StateChatInstance;
@@ -84,6 +140,10 @@ public:
             m_chatFormat = std::make_unique<llama::ChatFormat>(std::move(modelChatParams));
         }
 
+        m_samplerParams.grammar = params.grammar.value();
+        m_samplerParams.jsonSchema = params.jsonSchema.value();
+        m_samplerParams.collectMetrics = params.samplerMetrics.valueOr(false);
+
         auto promptTokens = instance.model().vocab().tokenize(params.setup.value(), true, true);
         m_session.setInitialPrompt(promptTokens);
 
@@ -157,16 +217,27 @@ public:
             maxTokens = 1000;
         }
 
+        // reconfiguring the sampler resets its state (penalties) for this response, which is why we only do it
+        // when the response params require it
+        auto sparams = m_samplerParams;
+        const bool custom = SamplerParams_applyRequest(sparams, params);
+        if (custom || m_requestSampler) {
+            m_instance.resetSampler(sparams);
+            m_requestSampler = custom;
+        }
+
         if (m_submittedMessages != m_chatMessages.size()) {
             submitPendingMessages();
             m_submittedMessages = m_chatMessages.size();
         }
 
         m_antiprompt.reset();
+        m_detokenizer.reset();
 
         std::string fullResponse;
         Schema::OpGetChatResponse::Return ret;
         auto& result = ret.response.materialize();
+        bool antiprompted = false;
 
         for (int i = 0; i < maxTokens; ++i) {
             auto t = m_session.getToken();
@@ -175,25 +246,33 @@ public:
                 break;
             }
 
-            auto tokenStr = m_vocab.tokenToString(t);
-            result += tokenStr;
+            auto tokenStr = m_vocab.tokenPiece(t);
             fullResponse += tokenStr;
 
+            // incomplete characters are held back, so that only valid UTF-8 is streamed
+            result += m_detokenizer.feed(tokenStr);
+
             auto matchedAntiPrompt = m_antiprompt.feedGeneratedText(tokenStr);
             if (!matchedAntiPrompt.empty()) {
                 // and also hide it from the return value
                 // note that we assume that m_userPrefix is always the final piece of text in the response
                 // TODO: update to better match the cutoff when issue #131 is done
                 result.erase(result.size() - matchedAntiPrompt.size());
+                antiprompted = true;
                 break;
             }
 
-            if (isStreaming && !m_antiprompt.hasRunningAntiprompts()) {
+            if (isStreaming && !result.empty() && !m_antiprompt.hasRunningAntiprompts()) {
                 co_await m_io.push(Frame_from(sc::StreamToken{}, result));
                 result = {};
             }
         }
 
+        // the generation ended within a character: pass on its bytes as they are, so that nothing is lost
+        if (!antiprompted) {
+            result += m_detokenizer.pending();
+        }
+
         // remove leading space if any
         // we could add the space to the assistant prefix, but most models have a much easier time generating tokens
         // with a leading space, so instead of burdening them with "unorthodox" tokens, we'll clear it here
@@ -277,7 +356,7 @@ public:
                 break;
             }
 
-            auto tokenStr = instance.model().vocab().tokenToString(t);
+            auto tokenStr = instance.model().vocab().tokenPiece(t);
             auto matchedAntiPrompt = antiprompt.feedGeneratedText(tokenStr);
             result += tokenStr;
             if (!matchedAntiPrompt.empty()) {
@@ -316,20 +395,32 @@ public:
             antiprompt.addAntiprompt(ap);
         }
 
+        ac::llama::IncrementalDetokenizer detokenizer;
+        bool antiprompted = false;
+
         for (unsigned int i = 0; i < maxTokens; ++i) {
             auto t = session.getToken();
             if (t == ac::llama::Token_Invalid) {
                 break;
             }
 
-            auto tokenStr = instance.model().vocab().tokenToString(t);
+            auto tokenStr = instance.model().vocab().tokenPiece(t);
             auto matchedAntiPrompt = antiprompt.feedGeneratedText(tokenStr);
-            co_await io.push(Frame_from(sc::StreamToken{}, tokenStr));
+            auto text = detokenizer.feed(tokenStr);
+            if (!text.empty()) {
+                co_await io.push(Frame_from(sc::StreamToken{}, std::string(text)));
+            }
             if (!matchedAntiPrompt.empty()) {
+                antiprompted = true;
                 break;
             }
         }
 
+        // the generation ended within a character: pass on its bytes as they are, so that nothing is lost
+        if (!antiprompted && !detokenizer.pending().empty()) {
+            co_await io.push(Frame_from(sc::StreamToken{}, std::string(detokenizer.pending())));
+        }
+
         instance.stopSession();
 
         co_await io.push(Frame_from(schema::SimpleOpReturn<sc::StateGeneralInstance::OpStream>{}, {}));
@@ -389,23 +480,54 @@ public:
         }));
     }
 
-    xec::coro<void> runGeneralInstance(IoEndpoint& io, llama::Instance& instance) {
+    xec::coro<void> runGeneralInstance(IoEndpoint& io, llama::Instance& instance, const llama::Instance::InitParams& initParams) {
         using Schema = sc::StateGeneralInstance;
         co_await io.push(Frame_from(schema::StateChange{}, Schema::id));
 
+        // requests with their own sampling params or constraints reconfigure the sampler for them, the next requests
+        // without get the instance one back
+        // the sampler is reconfigured in place and parsed grammars are cached by the model, so this is cheap
+        bool requestSampler = false;
+        auto updateSampler = [&](const Schema::InferenceParams& iparams) {
+            llama::Sampler::Params sparams;
+            sparams.grammar = initParams.grammar;
+            sparams.jsonSchema = initParams.jsonSchema;
+            sparams.collectMetrics = initParams.samplerMetrics;
+
+            bool custom = SamplerParams_applyRequest(sparams, iparams);
+
+            auto& grammar = iparams.grammar.value();
+            auto& jsonSchema = iparams.jsonSchema.value();
+            if (!grammar.empty() || !jsonSchema.empty()) {
+                sparams.grammar = grammar;
+                sparams.jsonSchema = jsonSchema;
+                custom = true;
+            }
+
+            if (custom || requestSampler) {
+                instance.resetSampler(sparams);
+                requestSampler = custom;
+            }
+        };
+
         while(true) {
             auto f = co_await io.poll();
             Frame err;
 
             try {
                 if (auto iparams = Frame_optTo(schema::OpParams<Schema::OpRun>{}, *f)) {
+                    updateSampler(*iparams);
                     co_await io.push(Frame_from(Schema::OpRun{}, opRun(instance, *iparams)));
                 } else if (auto iparams = Frame_optTo(schema::OpParams<Schema::OpStream>{}, *f)) {
+                    updateSampler(*iparams);
                     co_await opStream(instance, io, *iparams);
                 } else if (auto iparams = Frame_optTo(schema::OpParams<Schema::OpGetTokenData>{}, *f)) {
                     co_await opGetTokenData(instance, io, *iparams);
                 } else if (auto iparams = Frame_optTo(schema::OpParams<Schema::OpCompareTokenData>{}, *f)) {
                     co_await opCompareTokenData(instance, io, *iparams);
+                } else if (Frame_optTo(schema::OpParams<sc::OpGetSamplerMetrics>{}, *f)) {
+                    auto metrics = SamplerMetrics_toSchema(instance.sampler().metrics());
+                    co_await io.push(Frame_from(sc::OpGetSamplerMetrics{}, std::move(metrics)));
                 } else {
                     err = unknownOpError(*f);
                 }
@@ -471,6 +593,9 @@ public:
                     co_await chatSession.getResponse(*iparams, true);
                 } else if (auto iparams = Frame_optTo(schema::OpParams<Schema::OpAddChatMessages>{}, *f)) {
                     co_await chatSession.addMessages(*iparams);
+                } else if (Frame_optTo(schema::OpParams<sc::OpGetSamplerMetrics>{}, *f)) {
+                    auto metrics = SamplerMetrics_toSchema(instance.sampler().metrics());
+                    co_await io.push(Frame_from(sc::OpGetSamplerMetrics{}, std::move(metrics)));
                 } else {
                     err = unknownOpError(*f);
                 }
@@ -493,6 +618,7 @@ public:
         lparams.gpu = lmParams.useGpu.valueOr(true);
         lparams.vocabOnly = lmParams.vocabOnly.valueOr(false);
         lparams.prefixInputsWithBos = lmParams.prefixInputsWithBos.valueOr(false);
+        lparams.tokenizeCacheSize = size_t(lmParams.tokenizeCacheSize.valueOr(1024 * 1024));
 
         auto model = m_resourceCache.getModel({.gguf = gguf, .params = lparams});
 
@@ -512,7 +638,11 @@ public:
             try {
                 if (auto iparams = Frame_optTo(schema::OpParams<Schema::OpStartInstance>{}, *f)) {
                     if (iparams->instanceType == "general" || iparams->instanceType == "chat") {
-                        llama::Instance instance(*model, InstanceParams_fromSchema<llama::Instance::InitParams>(*iparams));
+                        auto initParams = InstanceParams_fromSchema<llama::Instance::InitParams>(*iparams);
+                        initParams.grammar = iparams->grammar.value();
+                        initParams.jsonSchema = iparams->jsonSchema.value();
+                        initParams.samplerMetrics = iparams->samplerMetrics.valueOr(false);
+                        llama::Instance instance(*model, initParams);
                         for (auto& lora : loras) {
                             instance.addLora(*lora, 1.f);
                         }
@@ -529,7 +659,7 @@ public:
                             co_await runChatInstance(io, instance, *iparams);
                         }
                         else {
-                            co_await runGeneralInstance(io, instance);
+                            co_await runGeneralInstance(io, instance, initParams);
                         }
                     }
                     else if (iparams->instanceType == "embedding") {
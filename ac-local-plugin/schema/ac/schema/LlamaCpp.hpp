@@ -33,6 +33,47 @@ struct Message {
     }
 };
 
+struct SamplerStageMetrics {
+    static constexpr auto id = "sampler-stage-metrics";
+    static constexpr auto desc = "Metrics of a stage of sampling";
+
+    Field<std::string> name;
+    Field<uint64_t> calls;
+    Field<double> timeMs;
+    Field<uint64_t> candidatesIn;
+    Field<uint64_t> candidatesOut;
+
+    template <typename Visitor>
+    void visitFields(Visitor& v) {
+        v(name, "name", "Name of the stage");
+        v(calls, "calls", "Number of times the stage was applied");
+        v(timeMs, "time_ms", "Total time spent in the stage in milliseconds");
+        v(candidatesIn, "candidates_in", "Total number of candidate tokens before the stage");
+        v(candidatesOut, "candidates_out", "Total number of candidate tokens after the stage");
+    }
+};
+
+struct OpGetSamplerMetrics {
+    static inline constexpr std::string_view id = "get-sampler-metrics";
+    static inline constexpr std::string_view desc = "Get the per stage metrics of the sampler (if enabled for the instance)";
+
+    using Params = nullptr_t;
+    struct Return {
+        Field<uint64_t> samples;
+        Field<double> timeMs;
+        Field<std::vector<SamplerStageMetrics>> stages;
+
+        template <typename Visitor>
+        void visitFields(Visitor& v) {
+            v(samples, "samples", "Number of sampled tokens");
+            v(timeMs, "time_ms", "Total time spent in sampling in milliseconds");
+            v(stages, "stages", "Metrics of the stages in order of first use. Empty if not enabled");
+        }
+    };
+
+    using Type = Return;
+};
+
 struct StateLlama {
     static constexpr auto id = "llama.cpp";
     static constexpr auto desc = "Initial state";
@@ -47,6 +88,7 @@ struct StateLlama {
             Field<bool> useGpu = Default(true);
             Field<bool> vocabOnly = Default(false);
             Field<bool> prefixInputsWithBos = Default(false);
+            Field<uint64_t> tokenizeCacheSize = Default(1024 * 1024);
 
             template <typename Visitor>
             void visitFields(Visitor& v) {
@@ -55,6 +97,7 @@ struct StateLlama {
                 v(useGpu, "useGpu", "Try to load data on gpu.");
                 v(vocabOnly, "vocabOnly", "Load only model vocabulary");
                 v(prefixInputsWithBos, "prefixInputsWithBos", "Add bos token to interactive inputs.");
+                v(tokenizeCacheSize, "tokenizeCacheSize", "Budget in bytes of the cache of tokenized texts (0 disables it).");
 
             }
         };
@@ -88,6 +131,11 @@ struct StateModelLoaded {
         Field<std::string> roleUser = Default("User");
         Field<std::string> roleAssistant = Default("Assistant");
 
+        Field<std::string> grammar = Default();
+        Field<std::string> jsonSchema = Default();
+
+        Field<bool> samplerMetrics = Default(false);
+
         template <typename Visitor>
         void visitFields(Visitor& v) {
             v(instanceType, "instance_type", "Type of the instance to start");
@@ -101,6 +149,9 @@ struct StateModelLoaded {
             v(eosOverride, "eos_override", "EOS token to use with the custom template. If empty will use the model default");
             v(roleUser, "role_user", "Role name for the user");
             v(roleAssistant, "role_assistant", "Role name for the assistant");
+            v(grammar, "grammar", "GBNF grammar to constrain the output");
+            v(jsonSchema, "json_schema", "JSON schema to constrain the output to. Ignored if grammar is set");
+            v(samplerMetrics, "sampler_metrics", "Collect per stage metrics of the sampler (see get-sampler-metrics)");
         }
     };
 
@@ -124,6 +175,21 @@ struct StateGeneralInstance {
         Field<std::string> suffix = Default();
         Field<std::vector<std::string>> antiprompts = Default();
         Field<uint32_t> maxTokens = Default(0);
+        Field<std::string> grammar = Default();
+        Field<std::string> jsonSchema = Default();
+
+        // sampling parameters for this request (the defaults are used for the unset ones)
+        Field<float> temperature = Default();
+        Field<int32_t> topK = Default();
+        Field<float> topP = Default();
+        Field<float> minP = Default();
+        Field<float> typicalP = Default();
+        Field<float> repeatPenalty = Default();
+        Field<float> frequencyPenalty = Default();
+        Field<float> presencePenalty = Default();
+        Field<int32_t> repeatLastN = Default();
+        Field<uint32_t> seed = Default();
+        Field<std::vector<std::string>> banTokenClasses = Default();
 
         template <typename Visitor>
         void visitFields(Visitor& v) {
@@ -131,6 +197,20 @@ struct StateGeneralInstance {
             v(suffix, "suffix", "Suffix of the prompt. Used for infill (code generation for example");
             v(antiprompts, "antiprompts", "Antiprompts to trigger stop");
             v(maxTokens, "max_tokens", "Maximum number of tokens to generate. 0 for unlimited");
+            v(grammar, "grammar", "GBNF grammar to constrain the output. Overrides the instance one for this request");
+            v(jsonSchema, "json_schema", "JSON schema to constrain the output to. Overrides the instance one for this request");
+            v(temperature, "temperature", "Sampling temperature. 0 for greedy sampling");
+            v(topK, "top_k", "Sample from the k most likely tokens. 0 for the entire vocabulary");
+            v(topP, "top_p", "Nucleus sampling probability. 1 to disable");
+            v(minP, "min_p", "Minimum probability relative to the most likely token. 0 to disable");
+            v(typicalP, "typical_p", "Locally typical sampling probability. 1 to disable");
+            v(repeatPenalty, "repeat_penalty", "Penalty for repeated tokens. 1 to disable");
+            v(frequencyPenalty, "frequency_penalty", "Penalty proportional to the number of repetitions. 0 to disable");
+            v(presencePenalty, "presence_penalty", "Penalty for tokens which appear among the recent ones. 0 to disable");
+            v(repeatLastN, "repeat_last_n", "Number of recent tokens to check for repetitions");
+            v(seed, "seed", "Seed for the random number generator");
+            v(banTokenClasses, "ban_token_classes", "Never generate tokens with characters of these classes: "
+                "newline, space, digit, letter, punct, non_ascii, control, special");
         }
     };
 
@@ -210,7 +290,7 @@ struct StateGeneralInstance {
         using Type = Return;
     };
 
-    using Ops = std::tuple<OpRun, OpGetTokenData, OpCompareTokenData>;
+    using Ops = std::tuple<OpRun, OpGetTokenData, OpCompareTokenData, OpGetSamplerMetrics>;
     using Ins = std::tuple<>;
     using Outs = std::tuple<>;
 };
@@ -238,9 +318,34 @@ struct StateChatInstance {
     struct ChatResponseParams {
         Field<uint32_t> maxTokens = Default(0);
 
+        // sampling parameters for this response (the defaults are used for the unset ones)
+        Field<float> temperature = Default();
+        Field<int32_t> topK = Default();
+        Field<float> topP = Default();
+        Field<float> minP = Default();
+        Field<float> typicalP = Default();
+        Field<float> repeatPenalty = Default();
+        Field<float> frequencyPenalty = Default();
+        Field<float> presencePenalty = Default();
+        Field<int32_t> repeatLastN = Default();
+        Field<uint32_t> seed = Default();
+        Field<std::vector<std::string>> banTokenClasses = Default();
+
         template <typename Visitor>
         void visitFields(Visitor& v) {
             v(maxTokens, "max_tokens", "Maximum number of tokens to generate. 0 for unlimited");
+            v(temperature, "temperature", "Sampling temperature. 0 for greedy sampling");
+            v(topK, "top_k", "Sample from the k most likely tokens. 0 for the entire vocabulary");
+            v(topP, "top_p", "Nucleus sampling probability. 1 to disable");
+            v(minP, "min_p", "Minimum probability relative to the most likely token. 0 to disable");
+            v(typicalP, "typical_p", "Locally typical sampling probability. 1 to disable");
+            v(repeatPenalty, "repeat_penalty", "Penalty for repeated tokens. 1 to disable");
+            v(frequencyPenalty, "frequency_penalty", "Penalty proportional to the number of repetitions. 0 to disable");
+            v(presencePenalty, "presence_penalty", "Penalty for tokens which appear among the recent ones. 0 to disable");
+            v(repeatLastN, "repeat_last_n", "Number of recent tokens to check for repetitions");
+            v(seed, "seed", "Seed for the random number generator");
+            v(banTokenClasses, "ban_token_classes", "Never generate tokens with characters of these classes: "
+                "newline, space, digit, letter, punct, non_ascii, control, special");
         }
     };
 
@@ -0,0 +1,242 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+
+// micro-benchmarks of tokenization and detokenization
+//
+// usage: bench-ac-llama-tokenizer [model.gguf...]
+// models are loaded in vocab-only mode (the test data models by default)
+// prints one JSON object per line and benchmark, so that results can be collected and compared across builds:
+// {"model": "gpt2-117m-q6_k", "vocab_size": 50257, "bench": "tokenize/long", "iterations": 48, "bytes": 101600,
+//  "tokens": 22403, "ns_median": ..., "ns_min": ..., "mb_per_s": ..., "tokens_per_s": ...}
+// bytes and tokens are per iteration, the rates are based on the median
+
+// llama
+#include <ac/llama/Init.hpp>
+#include <ac/llama/Model.hpp>
+#include <ac/llama/StreamingTokenizer.hpp>
+
+// model source directory
+#include "ac-test-data-llama-dir.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// each benchmark runs at least this long and this many times
+constexpr auto MinTime = std::chrono::milliseconds(200);
+constexpr size_t MinIterations = 5;
+
+struct Work {
+    size_t bytes = 0;
+    size_t tokens = 0;
+};
+
+// the work of each iteration ends up here, so that it can't be optimized away
+volatile size_t g_sink;
+
+std::string jsonEscape(std::string_view str) {
+    std::string ret;
+    for (auto c : str) {
+        if (c == '"' || c == '\\') ret += '\\';
+        ret += c;
+    }
+    return ret;
+}
+
+std::string modelName(std::string_view path) {
+    auto name = path.substr(path.find_last_of("/\\") + 1);
+    if (name.ends_with(".gguf")) name.remove_suffix(5);
+    return std::string(name);
+}
+
+// run f (which returns the work it did) until MinTime and MinIterations are reached and report the results
+template <typename F>
+void bench(const ac::llama::Model& model, const std::string& name, std::string_view benchName, F&& f) {
+    const auto work = f(); // warmup
+
+    std::vector<double> times;
+    const auto start = Clock::now();
+    while (times.size() < MinIterations || Clock::now() - start < MinTime) {
+        const auto iterStart = Clock::now();
+        const auto w = f();
+        times.push_back(std::chrono::duration<double, std::nano>(Clock::now() - iterStart).count());
+        g_sink = g_sink + w.bytes + w.tokens;
+    }
+
+    std::sort(times.begin(), times.end());
+    const double median = times[times.size() / 2];
+
+    char rates[128];
+    snprintf(rates, sizeof(rates), "\"ns_median\": %.0f, \"ns_min\": %.0f, \"mb_per_s\": %.2f, \"tokens_per_s\": %.0f",
+        median, times.front(), double(work.bytes) * 1e3 / median, double(work.tokens) * 1e9 / median);
+
+    std::cout << "{\"model\": \"" << jsonEscape(name) << "\""
+        << ", \"vocab_size\": " << model.vocab().nTokens()
+        << ", \"bench\": \"" << benchName << "\""
+        << ", \"iterations\": " << times.size()
+        << ", \"bytes\": " << work.bytes
+        << ", \"tokens\": " << work.tokens
+        << ", " << rates << "}" << std::endl;
+}
+
+std::string repeat(std::string_view str, size_t minSize) {
+    std::string ret;
+    while (ret.size() < minSize) {
+        ret += str;
+    }
+    return ret;
+}
+
+const std::string_view Text_Short = "The quick brown fox jumps over the lazy dog.";
+
+const std::string_view Text_English =
+    "It was the best of times, it was the worst of times, it was the age of wisdom, it was the age of "
+    "foolishness, it was the epoch of belief, it was the epoch of incredulity, it was the season of Light, "
+    "it was the season of Darkness, it was the spring of hope, it was the winter of despair.\n\n";
+
+const std::string_view Text_Multilingual =
+    "\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82, \xd0\xbc\xd0\xb8\xd1\x80! " // Russian
+    "\xe4\xbd\xa0\xe5\xa5\xbd\xef\xbc\x8c\xe4\xb8\x96\xe7\x95\x8c\xe3\x80\x82 " // Chinese
+    "\xe3\x81\x93\xe3\x82\x93\xe3\x81\xab\xe3\x81\xa1\xe3\x81\xaf\xe4\xb8\x96\xe7\x95\x8c " // Japanese
+    "\xd9\x85\xd8\xb1\xd8\xad\xd8\xa8\xd8\xa7 \xd8\xa8\xd8\xa7\xd9\x84\xd8\xb9\xd8\xa7\xd9\x84\xd9\x85 " // Arabic
+    "\xce\x93\xce\xb5\xce\xb9\xce\xb1 \xcf\x83\xce\xbf\xcf\x85 \xce\xba\xcf\x8c\xcf\x83\xce\xbc\xce\xb5 " // Greek
+    "Gr\xc3\xbc\xc3\x9f Gott, \xc3\xa7" "a va? \xf0\x9f\x98\x80\xf0\x9f\x9a\x80\n"; // German, French, emoji
+
+const std::string_view Text_Code = R"(template <typename T>
+static inline size_t countIf(const std::vector<T>& values, bool (*pred)(const T&)) {
+    size_t ret = 0;
+    for (auto& v : values) {
+        if (pred(v)) ++ret; // count matches
+    }
+    return ret;
+}
+
+)";
+
+constexpr size_t LongSize = 100 * 1024;
+
+void benchModel(const std::string& gguf) {
+    ac::llama::Model model(gguf, {.vocabOnly = true});
+    auto& vocab = model.vocab();
+    const auto name = modelName(gguf);
+
+    auto tokenize = [&](std::string_view text, bool parseSpecial) {
+        return [&vocab, text, parseSpecial] {
+            return Work{text.size(), vocab.tokenize(text, true, parseSpecial).size()};
+        };
+    };
+
+    const auto english = repeat(Text_English, LongSize);
+    const auto multilingual = repeat(Text_Multilingual, LongSize);
+    const auto code = repeat(Text_Code, LongSize);
+
+    bench(model, name, "tokenize/short", tokenize(Text_Short, false));
+    bench(model, name, "tokenize/long", tokenize(english, false));
+    bench(model, name, "tokenize/multilingual", tokenize(multilingual, false));
+    bench(model, name, "tokenize/code", tokenize(code, false));
+
+    // special tokens in the text (the pieces of the control tokens of the vocabulary, if any)
+    std::string chat;
+    {
+        std::string specials;
+        for (ac::llama::Token t = 0; t < vocab.nTokens(); ++t) {
+            if (vocab.isControl(t) || vocab.isEog(t)) {
+                specials += vocab.tokenPiece(t);
+                if (specials.size() > 64) break;
+            }
+        }
+        chat = repeat(specials + std::string(Text_Short) + "\n", LongSize);
+    }
+    bench(model, name, "tokenize/special-parse", tokenize(chat, true));
+    bench(model, name, "tokenize/special-no-parse", tokenize(chat, false));
+
+    // many short documents
+    std::vector<std::string> docs;
+    for (size_t i = 0; i < 2000; ++i) {
+        docs.push_back(std::string(Text_English.substr(0, 64 + i % 200)));
+    }
+    std::vector<std::string_view> docViews(docs.begin(), docs.end());
+    size_t docBytes = 0;
+    for (auto& d : docs) docBytes += d.size();
+
+    bench(model, name, "tokenize/docs-serial", [&] {
+        Work w{docBytes, 0};
+        for (auto& d : docs) {
+            w.tokens += vocab.tokenize(d, true, false).size();
+        }
+        return w;
+    });
+    bench(model, name, "tokenize/docs-batch", [&] {
+        return Work{docBytes, vocab.tokenizeBatch(docViews, true, false).tokens.size()};
+    });
+
+    bench(model, name, "tokenize/streaming", [&] {
+        Work w{english.size(), 0};
+        ac::llama::StreamingTokenizer st(vocab, {.chunkSize = 16 * 1024}, [&](std::span<const ac::llama::Token> t) {
+            w.tokens += t.size();
+        });
+        for (size_t i = 0; i < english.size(); i += 4096) {
+            st.feed(std::string_view(english).substr(i, 4096));
+        }
+        st.finish();
+        return w;
+    });
+
+    // detokenization
+    const auto tokens = vocab.tokenize(english, false, false);
+
+    bench(model, name, "detokenize/token-to-string", [&] {
+        Work w{0, tokens.size()};
+        for (auto t : tokens) {
+            w.bytes += vocab.tokenToString(t).size();
+        }
+        return w;
+    });
+    bench(model, name, "detokenize/token-piece", [&] {
+        Work w{0, tokens.size()};
+        for (auto t : tokens) {
+            w.bytes += vocab.tokenPiece(t).size();
+        }
+        return w;
+    });
+    std::string out;
+    bench(model, name, "detokenize/bulk", [&] {
+        out.clear();
+        vocab.detokenize(tokens, out);
+        return Work{out.size(), tokens.size()};
+    });
+}
+} // namespace
+
+int main(int argc, char* argv[]) try {
+    ac::llama::initLibrary();
+
+    std::vector<std::string> ggufs;
+    for (int i = 1; i < argc; ++i) {
+        ggufs.push_back(argv[i]);
+    }
+    if (ggufs.empty()) {
+        ggufs = {
+            AC_TEST_DATA_LLAMA_DIR "/gpt2-117m-q6_k.gguf",
+            AC_TEST_DATA_LLAMA_DIR "/bge-small-en-v1.5-f16.gguf",
+        };
+    }
+
+    for (auto& gguf : ggufs) {
+        benchModel(gguf);
+    }
+
+    return 0;
+}
+catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+}
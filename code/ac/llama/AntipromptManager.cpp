@@ -7,47 +7,105 @@ namespace ac::llama {
 
 void AntipromptManager::addAntiprompt(std::string_view antiprompt) {
     m_antiprompts.push_back(std::string(antiprompt));
+    m_dirty = true;
 }
 
-std::string AntipromptManager::feedGeneratedText(std::string_view text) {
-    std::vector<std::pair<std::string, size_t>> matchedAntiprompts;
+void AntipromptManager::build() {
+    m_dirty = false;
+    m_state = 0;
+
+    m_byteClass.fill(0);
+    m_numClasses = 1;
     for (auto& ap : m_antiprompts) {
-        int found = ap.feedText(text);
-        if (found > 0) {
-            auto res = found == 0 ?
-                ap.getString():
-                ap.getString() + std::string(text.substr(found, text.length()));
-            matchedAntiprompts.push_back({res, found});
+        for (auto c : ap) {
+            auto& cls = m_byteClass[uint8_t(c)];
+            if (cls == 0) {
+                cls = uint16_t(m_numClasses++);
+            }
         }
     }
-    if (!matchedAntiprompts.empty()) {
-        reset();
-        std::sort(matchedAntiprompts.begin(), matchedAntiprompts.end());
-        auto& [res, found] = matchedAntiprompts.front();
-        return res;
+
+    // trie of the antiprompts
+    const auto nc = m_numClasses;
+    m_next.assign(nc, -1);
+    m_match.assign(1, -1);
+    for (size_t i = 0; i < m_antiprompts.size(); ++i) {
+        auto& ap = m_antiprompts[i];
+        if (ap.empty()) continue;
+
+        int32_t node = 0;
+        for (auto c : ap) {
+            const auto t = size_t(node) * nc + m_byteClass[uint8_t(c)];
+            if (m_next[t] < 0) {
+                m_next[t] = int32_t(m_match.size());
+                m_match.push_back(-1);
+                m_next.resize(m_next.size() + nc, -1);
+            }
+            node = m_next[t];
+        }
+
+        if (m_match[size_t(node)] < 0) {
+            // duplicates match as the first one
+            m_match[size_t(node)] = int32_t(i);
+        }
     }
 
-    return {};
-}
+    // failure links in breadth-first order, turning the trie into a full transition table
+    // a node's own antiprompt is longer than any which ends at its failure nodes
+    std::vector<int32_t> fail(m_match.size(), 0);
+    std::vector<int32_t> queue;
+    queue.reserve(m_match.size());
+    queue.push_back(0);
+    for (size_t q = 0; q < queue.size(); ++q) {
+        const auto u = queue[q];
+        for (uint32_t c = 0; c < nc; ++c) {
+            auto& v = m_next[size_t(u) * nc + c];
+            const int32_t failNext = u == 0 ? 0 : m_next[size_t(fail[size_t(u)]) * nc + c];
+            if (v < 0) {
+                v = failNext;
+                continue;
+            }
 
-void AntipromptManager::reset() {
-    for (auto& ap : m_antiprompts) {
-        ap.reset();
+            fail[size_t(v)] = failNext;
+            if (m_match[size_t(v)] < 0) {
+                m_match[size_t(v)] = m_match[size_t(failNext)];
+            }
+            queue.push_back(v);
+        }
     }
 }
 
-void AntipromptManager::clear() {
-    m_antiprompts.clear();
-}
+AntipromptManager::Match AntipromptManager::feed(std::string_view text) {
+    if (m_dirty) {
+        build();
+    }
 
-bool AntipromptManager::hasRunningAntiprompts() {
-    for (auto& ap : m_antiprompts) {
-        if (ap.getCurrentPos() > 0) {
-            return true;
+    const auto nc = m_numClasses;
+    for (size_t i = 0; i < text.size(); ++i) {
+        m_state = m_next[size_t(m_state) * nc + m_byteClass[uint8_t(text[i])]];
+        const auto match = m_match[size_t(m_state)];
+        if (match >= 0) {
+            m_state = 0;
+            return {match, i + 1};
         }
     }
 
-    return false;
+    return {};
+}
+
+std::string AntipromptManager::feedGeneratedText(std::string_view text) {
+    auto match = feed(text);
+    if (!match) return {};
+    return m_antiprompts[size_t(match.antiprompt)] + std::string(text.substr(match.endPos));
+}
+
+void AntipromptManager::reset() {
+    m_state = 0;
+}
+
+void AntipromptManager::clear() {
+    m_antiprompts.clear();
+    m_dirty = true;
 }
 
 } // namespace ac::llama
@@ -5,12 +5,19 @@
 #include "export.h"
 #include "IncrementalStringFinder.hpp"
 
+#include <array>
+#include <cstdint>
 #include <vector>
-#include <queue>
 #include <string>
 #include <string_view>
 
 namespace ac::llama {
+
+// Incremental search for any of a set of antiprompts (stop strings) in generated text
+//
+// All antiprompts are matched together by an Aho-Corasick automaton, so the text is scanned once regardless of
+// their count, overlapping occurrences are found ("aab" in "aaab"), and feeding doesn't allocate.
+// The automaton is built on the first feed after the antiprompts change.
 class AC_LLAMA_EXPORT AntipromptManager {
 public:
     AntipromptManager() = default;
@@ -18,9 +25,25 @@ public:
     // adds new antiprompt to check
     void addAntiprompt(std::string_view antiprompt);
 
+    struct Match {
+        int32_t antiprompt = -1; // index of the matched antiprompt (in order of addition), -1 if there's no match
+        size_t endPos = 0; // position in the fed text right after the match
+
+        explicit operator bool() const noexcept { return antiprompt >= 0; }
+    };
+
+    // feed the text and stop at the first match (which can start in a previous feed)
+    // if several antiprompts end at the same position, the longest one is matched
+    // the state is reset after a match
+    Match feed(std::string_view text);
+
     // feed each antiprompt with the text
+    // returns the matched antiprompt followed by the rest of the text after it or an empty string if none matched
     std::string feedGeneratedText(std::string_view text);
 
+    // antiprompt by index
+    const std::string& antiprompt(size_t index) const { return m_antiprompts[index]; }
+
     // reset the state of all antiprompts
     void reset();
 
@@ -28,8 +51,19 @@ public:
     void clear();
 
     // check if there are any antiprompts that are in intermidiate state
-    bool hasRunningAntiprompts();
+    bool hasRunningAntiprompts() const noexcept { return m_state != 0; }
 private:
-    std::vector<IncrementalStringFinder> m_antiprompts;
+    void build();
+
+    std::vector<std::string> m_antiprompts;
+
+    // automaton over the bytes of the antiprompts
+    // the bytes which appear in antiprompts have their own classes, the rest share class 0
+    bool m_dirty = true;
+    std::array<uint16_t, 256> m_byteClass = {};
+    uint32_t m_numClasses = 1;
+    std::vector<int32_t> m_next; // transitions: node * m_numClasses + class -> node
+    std::vector<int32_t> m_match; // longest antiprompt which ends at the node (-1 if none)
+    int32_t m_state = 0;
 };
 } // namespace ac::llama
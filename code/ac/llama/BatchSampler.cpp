@@ -0,0 +1,63 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include "BatchSampler.hpp"
+#include "Sampler.hpp"
+#include "WorkerPool.hpp"
+#include <llama.h>
+#include <astl/throw_stdex.hpp>
+#include <algorithm>
+#include <thread>
+
+namespace ac::llama {
+
+BatchSampler::BatchSampler(Params params)
+    : m_numThreads(params.numThreads ? params.numThreads : std::max(1u, std::thread::hardware_concurrency()))
+    , m_minRowsPerThread(std::max(1u, params.minRowsPerThread))
+{
+    if (m_numThreads > 1) {
+        m_pool = std::make_unique<WorkerPool>(m_numThreads - 1);
+    }
+}
+
+BatchSampler::~BatchSampler() = default;
+
+std::span<const Token> BatchSampler::sample(
+    llama_context* lctx,
+    std::span<Sampler* const> samplers,
+    std::span<const int32_t> idxs,
+    bool grammarFirst
+) {
+    if (samplers.size() != idxs.size()) {
+        throw_ex{} << "BatchSampler: " << samplers.size() << " samplers for " << idxs.size() << " outputs";
+    }
+
+    m_result.resize(samplers.size());
+
+    // getting the logits synchronizes the context and updates its state, so it's done here and the workers
+    // only get the rows
+    m_logits.resize(samplers.size());
+    for (size_t i = 0; i < idxs.size(); ++i) {
+        m_logits[i] = llama_get_logits_ith(lctx, idxs[i]);
+    }
+
+    auto task = [&](size_t i) {
+        m_result[i] = samplers[i]->sample(m_logits[i], grammarFirst);
+    };
+
+    const size_t numRows = samplers.size();
+    const size_t numThreads = std::min(size_t(m_numThreads), (numRows + m_minRowsPerThread - 1) / m_minRowsPerThread);
+
+    if (!m_pool || numThreads <= 1) {
+        for (size_t i = 0; i < numRows; ++i) {
+            task(i);
+        }
+    }
+    else {
+        m_pool->run(numRows, uint32_t(numThreads - 1), task);
+    }
+
+    return m_result;
+}
+
+} // namespace ac::llama
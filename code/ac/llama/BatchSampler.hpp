@@ -0,0 +1,66 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "export.h"
+#include "Token.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+struct llama_context;
+
+namespace ac::llama {
+
+class Sampler;
+class WorkerPool;
+
+// Sampling for several sequences decoded in the same batch (parallel generation, n-best, beams)
+//
+// Each sequence has its own Sampler with its own state (penalties, grammar, rng) and samples from its own row of
+// logits. The rows are independent and each is a pass over the entire vocabulary, so they are sampled in parallel
+// on a pool of worker threads which persists between calls (spawning threads on every step would cost about as
+// much as sampling a row). The calling thread takes part in the work.
+//
+// The samplers must be distinct and must not be used elsewhere during a call.
+class AC_LLAMA_EXPORT BatchSampler {
+public:
+    struct Params {
+        uint32_t numThreads = 0; // threads including the calling one (0 = hardware concurrency)
+        uint32_t minRowsPerThread = 1; // don't wake more threads than rows / minRowsPerThread
+    };
+
+    explicit BatchSampler(Params params);
+    ~BatchSampler();
+
+    BatchSampler(const BatchSampler&) = delete;
+    BatchSampler& operator=(const BatchSampler&) = delete;
+
+    // sample a token for each sequence, where samplers[i] samples from the logits of the output idxs[i] of the
+    // last decoded batch (see Sampler::sample)
+    // the tokens are not accepted, so the caller can decide what to do with each of them
+    // the returned span is valid until the next call
+    // rethrows the first exception from a sampler (after all rows are done)
+    std::span<const Token> sample(
+        llama_context* lctx,
+        std::span<Sampler* const> samplers,
+        std::span<const int32_t> idxs,
+        bool grammarFirst = false
+    );
+
+    uint32_t numThreads() const noexcept { return m_numThreads; }
+
+private:
+    const uint32_t m_numThreads;
+    const uint32_t m_minRowsPerThread;
+
+    // kept as members so as to avoid reallocation on every call
+    std::vector<Token> m_result;
+    std::vector<const float*> m_logits; // rows of the current call
+
+    std::unique_ptr<WorkerPool> m_pool; // null for a single thread
+};
+
+} // namespace ac::llama
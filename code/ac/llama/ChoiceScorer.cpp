@@ -0,0 +1,151 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include "ChoiceScorer.hpp"
+#include "Instance.hpp"
+#include "Model.hpp"
+#include "VecMath.hpp"
+#include "LlamaBatch.hpp"
+
+#include <llama.h>
+
+#include <astl/throw_stdex.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+namespace ac::llama {
+
+ChoiceScorer::ChoiceScorer(Instance& instance)
+    : m_instance(instance)
+{}
+
+ChoiceScorer::~ChoiceScorer() = default;
+
+float ChoiceScorer::logProb(const float* logits, Token token) {
+    const auto nVocab = size_t(m_instance.model().vocab().nTokens());
+    m_scratch.resize(nVocab);
+    const float maxLogit = vec::max(logits, nVocab);
+    const float sum = vec::expShifted(logits, m_scratch.data(), nVocab, maxLogit);
+    return logits[token] - maxLogit - std::log(sum);
+}
+
+std::vector<ChoiceScorer::Score> ChoiceScorer::score(
+    std::span<const Token> prefix,
+    std::span<const std::vector<Token>> candidates
+) {
+    if (m_instance.hasActiveSession()) {
+        throw_ex{} << "ChoiceScorer: instance has an active session";
+    }
+    if (prefix.empty()) {
+        throw_ex{} << "ChoiceScorer: empty prefix";
+    }
+
+    auto lctx = m_instance.lctx();
+    const auto ctxLen = size_t(llama_n_ctx(lctx));
+    const auto seqMax = size_t(llama_n_seq_max(lctx));
+    const auto batchSize = int32_t(llama_n_batch(lctx));
+
+    for (auto& c : candidates) {
+        if (c.empty()) {
+            throw_ex{} << "ChoiceScorer: empty candidate";
+        }
+        if (prefix.size() + c.size() > ctxLen) {
+            throw_ex{} << "ChoiceScorer: prefix and candidate of " << prefix.size() + c.size()
+                << " tokens don't fit in a context of " << ctxLen;
+        }
+    }
+
+    std::vector<Score> ret(candidates.size());
+    if (candidates.empty()) return ret;
+
+    llama_kv_self_clear(lctx);
+
+    LlamaBatch batch(batchSize);
+    auto decode = [&] {
+        if (llama_decode(lctx, batch.batch) != 0) {
+            throw_ex{} << "ChoiceScorer: failed to decode batch";
+        }
+        batch.batch.n_tokens = 0;
+    };
+
+    // prefix in sequence 0 with logits for the last token, which predict the first token of each candidate
+    const auto prefixLen = llama_pos(prefix.size());
+    for (llama_pos pos = 0; pos < prefixLen; ++pos) {
+        batch.add(prefix[size_t(pos)], pos, 0, pos + 1 == prefixLen);
+        if (batch.batch.n_tokens == batchSize) {
+            decode();
+        }
+    }
+    if (batch.batch.n_tokens) {
+        decode();
+    }
+
+    const float* prefixLogits = llama_get_logits_ith(lctx, -1);
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        ret[i].logLikelihood = logProb(prefixLogits, candidates[i].front());
+        ret[i].numTokens = uint32_t(candidates[i].size());
+    }
+
+    // candidate and position of the outputs of the current batch
+    struct Output {
+        size_t candidate;
+        size_t pos; // index in the candidate of the token whose logits these are
+        int32_t batchIdx; // index of the token in the batch
+    };
+    std::vector<Output> outputs;
+
+    size_t next = 0; // first candidate of the current group
+    while (next < candidates.size()) {
+        // as many candidates as there are sequences and cells for
+        size_t end = next;
+        size_t cells = prefix.size();
+        while (end < candidates.size() && end - next < seqMax && cells + candidates[end].size() <= ctxLen) {
+            cells += candidates[end].size();
+            ++end;
+        }
+
+        for (size_t i = next + 1; i < end; ++i) {
+            llama_kv_self_seq_cp(lctx, 0, llama_seq_id(i - next), 0, prefixLen);
+        }
+
+        auto scoreOutputs = [&] {
+            decode();
+            for (auto& out : outputs) {
+                auto& c = candidates[out.candidate];
+                ret[out.candidate].logLikelihood += logProb(llama_get_logits_ith(lctx, out.batchIdx), c[out.pos + 1]);
+            }
+            outputs.clear();
+        };
+
+        // the logits of the last token of a candidate would predict what follows it, so they're not needed
+        for (size_t i = next; i < end; ++i) {
+            auto& c = candidates[i];
+            for (size_t pos = 0; pos < c.size(); ++pos) {
+                const bool logits = pos + 1 < c.size();
+                if (logits) {
+                    outputs.push_back({i, pos, batch.batch.n_tokens});
+                }
+                batch.add(c[pos], prefixLen + llama_pos(pos), llama_seq_id(i - next), logits);
+                if (batch.batch.n_tokens == batchSize) {
+                    scoreOutputs();
+                }
+            }
+        }
+        if (batch.batch.n_tokens) {
+            scoreOutputs();
+        }
+
+        // keep the prefix for the next group
+        llama_kv_self_seq_rm(lctx, 0, prefixLen, -1);
+        for (size_t i = next + 1; i < end; ++i) {
+            llama_kv_self_seq_rm(lctx, llama_seq_id(i - next), -1, -1);
+        }
+
+        next = end;
+    }
+
+    return ret;
+}
+
+} // namespace ac::llama
@@ -0,0 +1,53 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "export.h"
+#include "Token.hpp"
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace ac::llama {
+class Instance;
+
+// Log-likelihoods of candidate continuations of a shared prefix (multiple choice, reranking, classification)
+//
+// The prefix is decoded once. Each candidate then gets its own sequence, which starts as a copy of the prefix
+// one (this shares the KV cells, it doesn't copy data), and the candidates are decoded together in a batch with
+// logits at their positions. Up to Instance::InitParams::maxSequences candidates (and as many as fit in the
+// context) are decoded at once, the rest in subsequent groups which reuse the prefix.
+//
+// The instance must not have an active session while scoring
+class AC_LLAMA_EXPORT ChoiceScorer {
+public:
+    explicit ChoiceScorer(Instance& instance);
+    ~ChoiceScorer();
+
+    ChoiceScorer(const ChoiceScorer&) = delete;
+    ChoiceScorer& operator=(const ChoiceScorer&) = delete;
+
+    struct Score {
+        double logLikelihood = 0; // sum of the log-probabilities of the tokens of the candidate
+        uint32_t numTokens = 0;
+
+        // length normalized log-likelihood (per token), which doesn't favor short candidates
+        double normalized() const noexcept { return numTokens ? logLikelihood / numTokens : 0; }
+    };
+
+    // score the candidates as continuations of the prefix
+    // neither the prefix nor the candidates can be empty
+    std::vector<Score> score(std::span<const Token> prefix, std::span<const std::vector<Token>> candidates);
+
+private:
+    // log-probability of the token according to the logits
+    float logProb(const float* logits, Token token);
+
+    Instance& m_instance;
+
+    // kept as member so as to avoid reallocation on every call
+    std::vector<float> m_scratch;
+};
+
+} // namespace ac::llama
@@ -0,0 +1,135 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include "DryPenalty.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace ac::llama {
+
+namespace {
+// longer repetitions get the same penalty, which is way beyond any logit anyway
+constexpr uint32_t MaxExponent = 64;
+}
+
+DryPenalty::DryPenalty(const Params& params)
+    : m_params(params)
+{
+    reset();
+}
+
+DryPenalty::~DryPenalty() = default;
+
+void DryPenalty::reset() {
+    m_history.clear();
+    m_nextBreaker = -1;
+    m_states.clear();
+    m_states.push_back({0, -1, {}});
+    m_last = 0;
+}
+
+void DryPenalty::accept(Token token, bool sequenceBreaker) {
+    const int32_t symbol = sequenceBreaker ? m_nextBreaker-- : token;
+    m_history.push_back(symbol);
+
+    if (m_params.maxHistory && m_history.size() >= size_t(m_params.maxHistory) * 2) {
+        // rebuilding from the last maxHistory tokens keeps the cost amortized constant
+        m_history.erase(m_history.begin(), m_history.end() - m_params.maxHistory);
+        rebuild();
+        return;
+    }
+
+    extend(symbol);
+}
+
+void DryPenalty::rebuild() {
+    m_states.clear();
+    m_states.push_back({0, -1, {}});
+    m_last = 0;
+    for (auto s : m_history) {
+        extend(s);
+    }
+}
+
+void DryPenalty::extend(int32_t symbol) {
+    const auto cur = uint32_t(m_states.size());
+    m_states.push_back({m_states[m_last].len + 1, 0, {}});
+
+    int32_t p = int32_t(m_last);
+    while (p != -1 && m_states[p].next.find(symbol) == m_states[p].next.end()) {
+        m_states[p].next[symbol] = cur;
+        p = m_states[p].link;
+    }
+
+    if (p != -1) {
+        const auto q = m_states[p].next.find(symbol)->second;
+        if (m_states[p].len + 1 == m_states[q].len) {
+            m_states[cur].link = int32_t(q);
+        }
+        else {
+            const auto clone = uint32_t(m_states.size());
+            State cloned = m_states[q];
+            cloned.len = m_states[p].len + 1;
+            m_states.push_back(std::move(cloned));
+
+            while (p != -1) {
+                auto it = m_states[p].next.find(symbol);
+                if (it == m_states[p].next.end() || it->second != q) break;
+                it->second = clone;
+                p = m_states[p].link;
+            }
+            m_states[q].link = int32_t(clone);
+            m_states[cur].link = int32_t(clone);
+        }
+    }
+
+    m_last = cur;
+}
+
+void DryPenalty::penalties(TokenDataVector& out) const {
+    out.clear();
+    if (m_params.multiplier <= 0) return;
+
+    if (++m_stamp == 0) {
+        // wrapped around, so old stamps could match
+        std::fill(m_stamps.begin(), m_stamps.end(), 0);
+        m_stamp = 1;
+    }
+
+    // the suffix link path goes through shorter and shorter repeated suffixes
+    // a transition from a state means that all of its suffixes have been followed by the token, so the first state
+    // with a transition has the longest repetition (and the largest penalty)
+    // the state of the whole history has no transitions (nothing follows it), so the walk starts with its link
+    uint32_t numSuffixes = 0;
+    for (auto s = m_states[m_last].link; s > 0 && m_states[s].len >= m_params.allowedLength; s = m_states[s].link) {
+        if (m_params.maxSuffixes && numSuffixes++ == m_params.maxSuffixes) break;
+
+        auto& state = m_states[s];
+        const auto exponent = std::min(state.len - m_params.allowedLength, MaxExponent);
+        const float penalty = m_params.multiplier * std::pow(m_params.base, float(exponent));
+        for (auto& [symbol, _] : state.next) {
+            if (symbol < 0) continue; // sequence breaker
+            if (size_t(symbol) >= m_stamps.size()) {
+                m_stamps.resize(size_t(symbol) + 1, 0);
+            }
+            if (m_stamps[symbol] == m_stamp) continue; // a longer repetition has it
+            m_stamps[symbol] = m_stamp;
+            out.push_back({symbol, penalty});
+        }
+    }
+
+    // only the distinct tokens are sorted
+    std::sort(out.begin(), out.end(), [](auto& a, auto& b) { return a.token < b.token; });
+}
+
+uint32_t DryPenalty::repetitionLength(Token token) const {
+    for (auto s = int32_t(m_last); s > 0; s = m_states[s].link) {
+        auto& next = m_states[s].next;
+        if (next.find(token) != next.end()) {
+            return m_states[s].len;
+        }
+    }
+    return 0;
+}
+
+} // namespace ac::llama
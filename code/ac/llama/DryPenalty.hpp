@@ -0,0 +1,77 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "export.h"
+#include "Token.hpp"
+
+#include <astl/flat_map.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace ac::llama {
+
+// DRY ("don't repeat yourself") penalty of tokens which would continue a repetition
+//
+// If the last n tokens of the history also occur earlier followed by a token, generating it now would extend the
+// repetition to n + 1 tokens. For n >= allowedLength its logit is reduced by multiplier * base^(n - allowedLength),
+// so long loops become exponentially unlikely, while short common phrases are unaffected.
+// Sequence breakers (such as new lines) end repetitions: no repetition spans over them.
+//
+// The history is kept in a suffix automaton which is extended online in amortized constant time per token.
+// The states on the suffix link path of the whole history are exactly the repeated suffixes, so the penalties
+// are found by walking this path down to allowedLength. In a loop of period p this path has about history / p
+// states, so the walk is capped at maxSuffixes states (the longest repetitions, which carry the largest
+// penalties) and a step visits at most that many states and their transitions.
+class AC_LLAMA_EXPORT DryPenalty {
+public:
+    struct Params {
+        float multiplier = 0.8f;
+        float base = 1.75f;
+        uint32_t allowedLength = 2; // repetitions up to this length (including the token) are not penalized
+        uint32_t maxHistory = 0; // check at least this many (and at most twice as many) of the last tokens (0 = all)
+        uint32_t maxSuffixes = 32; // longest repeated suffixes to check for penalties (0 = all)
+    };
+
+    explicit DryPenalty(const Params& params);
+    ~DryPenalty();
+
+    // add a token to the history
+    void accept(Token token, bool sequenceBreaker);
+
+    void reset();
+
+    // tokens which would continue a repetition and the penalties to subtract from their logits, ordered by token
+    void penalties(TokenDataVector& out) const;
+
+    // length of the repetition which the token would continue (0 if none)
+    uint32_t repetitionLength(Token token) const;
+
+    size_t historySize() const noexcept { return m_history.size(); }
+
+private:
+    void extend(int32_t symbol);
+    void rebuild();
+
+    Params m_params;
+
+    // tokens, with each sequence breaker replaced by a unique negative symbol so nothing matches across it
+    std::vector<int32_t> m_history;
+    int32_t m_nextBreaker = -1;
+
+    struct State {
+        uint32_t len; // length of the longest string in the state
+        int32_t link; // suffix link (-1 for the root)
+        astl::flat_map<int32_t, uint32_t> next;
+    };
+    std::vector<State> m_states;
+    uint32_t m_last = 0; // state of the entire history
+
+    // for each token the last call of penalties which added it, so each one is added once (with the largest
+    // penalty) without sorting the duplicates; this makes penalties not thread-safe
+    mutable std::vector<uint32_t> m_stamps;
+    mutable uint32_t m_stamp = 0;
+};
+
+} // namespace ac::llama
@@ -0,0 +1,399 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include "Evaluator.hpp"
+#include "Instance.hpp"
+#include "Model.hpp"
+#include "StreamingTokenizer.hpp"
+#include "Logging.hpp"
+#include "VecMath.hpp"
+#include "LlamaBatch.hpp"
+#include "WorkerPool.hpp"
+
+#include <llama.h>
+
+#include <astl/throw_stdex.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <thread>
+#include <cassert>
+
+namespace ac::llama {
+
+namespace {
+// log of the softmax denominator
+// exps receives exp(logits - max), or the probabilities if normalize is set
+float logSumExp(const float* logits, float* exps, int32_t n, bool normalize) {
+    const float maxLogit = vec::max(logits, n);
+    const float sum = vec::expShifted(logits, exps, n, maxLogit);
+    if (normalize) {
+        vec::scale(exps, n, 1.f / sum);
+    }
+    return maxLogit + std::log(sum);
+}
+
+struct Divergence {
+    float kl; // KL(p || q)
+    float jsd;
+};
+
+// divergences of the distributions given by the logits p and q
+// pe and qe are their probabilities
+Divergence divergence(const float* p, float pLse, const float* pe, const float* q, float qLse, const float* qe, int32_t n) {
+    constexpr auto Lanes = vec::Lanes;
+    float klAcc[Lanes] = {};
+    float jsdAcc[Lanes] = {};
+
+    auto terms = [&](int32_t i, float& kl, float& jsd) {
+        const float pp = pe[i];
+        const float qp = qe[i];
+        kl += pp * ((p[i] - pLse) - (q[i] - qLse));
+        const float m = (pp + qp) * 0.5f;
+        jsd += pp > 0.f ? pp * vec::log(pp / m) : 0.f;
+        jsd += qp > 0.f ? qp * vec::log(qp / m) : 0.f;
+    };
+
+    int32_t i = 0;
+    for (; i + int32_t(Lanes) <= n; i += Lanes) {
+        for (size_t l = 0; l < Lanes; ++l) {
+            terms(i + int32_t(l), klAcc[l], jsdAcc[l]);
+        }
+    }
+
+    Divergence ret = {};
+    for (; i < n; ++i) {
+        terms(i, ret.kl, ret.jsd);
+    }
+    ret.kl += vec::sum(klAcc, Lanes);
+    ret.jsd = (ret.jsd + vec::sum(jsdAcc, Lanes)) * 0.5f;
+    ret.kl = std::max(ret.kl, 0.f); // can't be negative, but rounding errors can make it so
+    return ret;
+}
+
+// sets the decoding threads of a context for the lifetime of the object
+class ThreadsOverride {
+public:
+    ThreadsOverride(llama_context* lctx, int32_t n)
+        : m_lctx(n > 0 ? lctx : nullptr)
+    {
+        if (!m_lctx) return;
+        m_threads = llama_n_threads(m_lctx);
+        m_threadsBatch = llama_n_threads_batch(m_lctx);
+        llama_set_n_threads(m_lctx, n, n);
+    }
+    ~ThreadsOverride() {
+        if (!m_lctx) return;
+        llama_set_n_threads(m_lctx, m_threads, m_threadsBatch);
+    }
+    ThreadsOverride(const ThreadsOverride&) = delete;
+    ThreadsOverride& operator=(const ThreadsOverride&) = delete;
+private:
+    llama_context* m_lctx;
+    int32_t m_threads = 0;
+    int32_t m_threadsBatch = 0;
+};
+
+void checkContext(llama_context* lctx, uint32_t windowSize, uint32_t numParallel) {
+    if (windowSize * numParallel > llama_n_ctx(lctx)) {
+        throw_ex{} << "Evaluator: " << numParallel << " windows of " << windowSize
+            << " tokens don't fit in a context of " << llama_n_ctx(lctx);
+    }
+    if (numParallel > llama_n_seq_max(lctx)) {
+        throw_ex{} << "Evaluator: " << numParallel << " parallel windows requested, but the context supports "
+            << llama_n_seq_max(lctx) << " sequences";
+    }
+}
+} // namespace
+
+Evaluator::Evaluator(Instance& target, Params params)
+    : m_target(target)
+    , m_reference(nullptr)
+    , m_params(params)
+{
+    if (m_target.hasActiveSession()) {
+        throw_ex{} << "Evaluator: instance has an active session";
+    }
+
+    auto lctx = m_target.lctx();
+    const auto ctxLen = llama_n_ctx(lctx);
+    const auto seqMax = llama_n_seq_max(lctx);
+
+    m_windowSize = params.windowSize ? params.windowSize : ctxLen / seqMax;
+    if (m_windowSize < 2) {
+        throw_ex{} << "Evaluator: window size must be at least 2";
+    }
+
+    m_stride = params.stride ? params.stride : m_windowSize / 2;
+    if (m_stride >= m_windowSize) {
+        throw_ex{} << "Evaluator: stride " << m_stride << " must be less than the window size " << m_windowSize;
+    }
+
+    m_numParallel = params.numParallel ? params.numParallel : std::min(ctxLen / m_windowSize, seqMax);
+    if (m_numParallel == 0) {
+        throw_ex{} << "Evaluator: window size " << m_windowSize << " is greater than the context size " << ctxLen;
+    }
+
+    checkContext(lctx, m_windowSize, m_numParallel);
+
+    auto& model = m_target.model();
+    if (model.shouldAddBosToken()) {
+        m_bos = llama_vocab_bos(model.vocab().lvocab());
+    }
+
+    m_numThreads = params.numThreads ? params.numThreads : std::max(1u, std::thread::hardware_concurrency());
+    if (m_numThreads > 1) {
+        m_pool = std::make_unique<WorkerPool>(m_numThreads - 1);
+    }
+    m_windows.reserve(m_numParallel);
+}
+
+Evaluator::Evaluator(Instance& target, Instance& reference, Params params)
+    : Evaluator(target, params)
+{
+    if (reference.model().vocab().nTokens() != m_target.model().vocab().nTokens()) {
+        throw_ex{} << "Evaluator: the reference model has a different vocabulary";
+    }
+    if (reference.hasActiveSession()) {
+        throw_ex{} << "Evaluator: reference instance has an active session";
+    }
+    checkContext(reference.lctx(), m_windowSize, m_numParallel);
+    m_reference = &reference;
+}
+
+Evaluator::~Evaluator() = default;
+
+Evaluator::Result Evaluator::evaluate(std::span<const Token> tokens, ProgressCb cb, TokenCb tokenCb) {
+    Callbacks cbs = {cb, tokenCb};
+    ThreadsOverride targetThreads(m_target.lctx(), m_reference ? std::max(1u, m_numThreads / 2) : 0);
+    ThreadsOverride referenceThreads(m_reference ? m_reference->lctx() : nullptr, std::max(1u, m_numThreads / 2));
+
+    Result result;
+    evalWindows(tokens, true, result, cbs);
+    return result;
+}
+
+Evaluator::Result Evaluator::evaluateFile(const std::string& path, ProgressCb cb, TokenCb tokenCb) {
+    Callbacks cbs = {cb, tokenCb};
+    ThreadsOverride targetThreads(m_target.lctx(), m_reference ? std::max(1u, m_numThreads / 2) : 0);
+    ThreadsOverride referenceThreads(m_reference ? m_reference->lctx() : nullptr, std::max(1u, m_numThreads / 2));
+
+    std::ifstream fin(path, std::ios::binary);
+    if (!fin) {
+        throw_ex{} << "Evaluator: failed to open " << path;
+    }
+
+    const size_t chunkSize = std::max(m_params.fileChunkSize, 1u);
+
+    Result result;
+    std::vector<Token> pending; // tokens which are not fully evaluated yet
+
+    // the streaming tokenizer only splits the text where the tokens are the same as the ones of the whole file
+    StreamingTokenizer tokenizer(m_target.model().vocab(), {.addSpecial = false, .chunkSize = chunkSize},
+        [&](std::span<const Token> tokens) {
+            pending.insert(pending.end(), tokens.begin(), tokens.end());
+        }
+    );
+
+    std::string chunk;
+    bool eof = false;
+    while (!eof) {
+        chunk.resize(chunkSize);
+        fin.read(chunk.data(), std::streamsize(chunkSize));
+        chunk.resize(size_t(fin.gcount()));
+        eof = !fin;
+
+        tokenizer.feed(chunk);
+        if (eof) {
+            tokenizer.finish();
+        }
+
+        auto done = evalWindows(pending, eof, result, cbs);
+        pending.erase(pending.begin(), pending.begin() + done);
+    }
+
+    return result;
+}
+
+size_t Evaluator::evalWindows(std::span<const Token> tokens, bool final, Result& result, Callbacks& cbs) {
+    size_t start = 0;
+
+    while (true) {
+        m_windows.clear();
+
+        auto windowStart = start;
+        while (m_windows.size() < m_numParallel) {
+            const uint32_t scoreBegin = result.numWindows + m_windows.size() == 0 ? 1 : m_windowSize - m_stride;
+            const auto available = tokens.size() - std::min(tokens.size(), windowStart);
+
+            if (available < m_windowSize) {
+                if (!final || available <= scoreBegin) break;
+                // trailing partial window
+                m_windows.push_back({tokens.subspan(windowStart, available), scoreBegin});
+                break;
+            }
+
+            m_windows.push_back({tokens.subspan(windowStart, m_windowSize), scoreBegin});
+            windowStart += m_stride;
+        }
+
+        const bool fullGroup = m_windows.size() == m_numParallel;
+        if (m_windows.empty() || (!final && !fullGroup)) {
+            // wait for more tokens to fill the batch
+            return start;
+        }
+
+        decodeGroup(m_windows, result, cbs);
+
+        // after a trailing partial window this can be past the end
+        start = std::min(start + m_windows.size() * size_t(m_stride), tokens.size());
+
+        if (cbs.progress) {
+            cbs.progress(result);
+        }
+    }
+}
+
+void Evaluator::decodeGroup(std::span<const Window> windows, Result& result, Callbacks& cbs) {
+    auto lctx = m_target.lctx();
+    auto refLctx = m_reference ? m_reference->lctx() : nullptr;
+
+    llama_kv_self_clear(lctx);
+    if (refLctx) {
+        llama_kv_self_clear(refLctx);
+    }
+
+    auto batchSize = int32_t(llama_n_batch(lctx));
+    if (refLctx) {
+        batchSize = std::min(batchSize, int32_t(llama_n_batch(refLctx)));
+    }
+    LlamaBatch batch(batchSize);
+
+    size_t w = 0; // current window
+    uint32_t pos = 0; // position in the current window
+    while (w < windows.size()) {
+        batch.batch.n_tokens = 0;
+        m_outputs.clear();
+        m_tokenStats.clear();
+
+        while (w < windows.size() && batch.batch.n_tokens < batchSize) {
+            auto& win = windows[w];
+            const Token token = pos == 0 && m_bos != Token_Invalid ? m_bos : win.tokens[pos];
+
+            // logits at pos predict the token at pos + 1
+            const bool scored = pos + 1 >= win.scoreBegin && pos + 1 < win.tokens.size();
+            if (scored) {
+                m_outputs.push_back(batch.batch.n_tokens);
+                m_tokenStats.push_back({
+                    .index = result.numTokens + m_tokenStats.size() + 1, // every token but the first is scored in order
+                    .token = win.tokens[pos + 1],
+                });
+            }
+            batch.add(token, llama_pos(pos), llama_seq_id(w), scored);
+
+            if (++pos == win.tokens.size()) {
+                ++w;
+                pos = 0;
+            }
+        }
+
+        // teacher forcing: decode the same batch with both models concurrently
+        int32_t res = 0, refRes = 0;
+        auto decode = [&](size_t i) {
+            if (i == 0) res = llama_decode(lctx, batch.batch);
+            else refRes = llama_decode(refLctx, batch.batch);
+        };
+        if (refLctx && m_pool) {
+            m_pool->run(2, 1, decode);
+        }
+        else {
+            decode(0);
+            if (refLctx) decode(1);
+        }
+        if (res != 0 || refRes != 0) {
+            throw_ex{} << "Evaluator: failed to decode batch";
+        }
+
+        // getting the logits synchronizes the context and updates its state, so it's done here and the scoring
+        // threads only get the rows
+        const size_t numOutputs = m_outputs.size();
+        m_logits.resize(numOutputs);
+        m_refLogits.resize(refLctx ? numOutputs : 0);
+        for (size_t i = 0; i < numOutputs; ++i) {
+            m_logits[i] = llama_get_logits_ith(lctx, m_outputs[i]);
+            if (refLctx) {
+                m_refLogits[i] = llama_get_logits_ith(refLctx, m_outputs[i]);
+            }
+        }
+
+        // score the outputs in parallel chunks
+        const size_t minOutputsPerThread = 8;
+        const size_t numChunks = std::max(size_t(1),
+            std::min(size_t(m_numThreads), numOutputs / minOutputsPerThread));
+        const size_t chunkSize = (numOutputs + numChunks - 1) / numChunks;
+
+        m_scratch.resize(std::max(m_scratch.size(), numChunks));
+
+        auto score = [&](size_t c) {
+            scoreOutputs(c * chunkSize, std::min(numOutputs, (c + 1) * chunkSize), m_scratch[c]);
+        };
+        if (m_pool && numChunks > 1) {
+            m_pool->run(numChunks, uint32_t(numChunks - 1), score);
+        }
+        else {
+            for (size_t c = 0; c < numChunks; ++c) {
+                score(c);
+            }
+        }
+
+        // accumulate in stream order
+        for (auto& ts : m_tokenStats) {
+            result.nll += ts.nll;
+            if (refLctx) {
+                result.referenceNll += ts.referenceNll;
+                result.klSum += ts.kl;
+                result.klMax = std::max(result.klMax, double(ts.kl));
+                result.jsdSum += ts.jsd;
+                result.jsdMax = std::max(result.jsdMax, double(ts.jsd));
+                result.top1Matches += ts.top1Match;
+            }
+            if (cbs.token) {
+                cbs.token(ts);
+            }
+        }
+
+        result.numTokens += m_tokenStats.size();
+    }
+
+    result.numWindows += windows.size();
+}
+
+void Evaluator::scoreOutputs(size_t begin, size_t end, std::vector<float>& scratch) {
+    const bool hasRef = m_reference != nullptr;
+
+    const auto nVocab = m_target.model().vocab().nTokens();
+    scratch.resize(size_t(nVocab) * (hasRef ? 2 : 1));
+    float* exps = scratch.data();
+    float* refExps = exps + nVocab;
+
+    for (size_t i = begin; i < end; ++i) {
+        auto& ts = m_tokenStats[i];
+
+        const float* logits = m_logits[i];
+        const float lse = logSumExp(logits, exps, nVocab, hasRef);
+        ts.nll = lse - logits[ts.token];
+
+        if (!hasRef) continue;
+
+        const float* refLogits = m_refLogits[i];
+        const float refLse = logSumExp(refLogits, refExps, nVocab, true);
+        ts.referenceNll = refLse - refLogits[ts.token];
+
+        auto div = divergence(refLogits, refLse, refExps, logits, lse, exps, nVocab);
+        ts.kl = div.kl;
+        ts.jsd = div.jsd;
+        ts.top1Match = vec::argmax(logits, nVocab) == vec::argmax(refLogits, nVocab);
+    }
+}
+
+} // namespace ac::llama
@@ -0,0 +1,145 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "export.h"
+#include "Token.hpp"
+
+#include <astl/ufunction.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace ac::llama {
+class Instance;
+class WorkerPool;
+
+// Perplexity and KL-divergence evaluation over large token streams
+//
+// The input is split into strided windows. Each window is decoded with logits for all scored positions and
+// several windows are decoded as parallel sequences in a single batch (see Instance::InitParams::maxSequences).
+// Every token after the first is scored exactly once:
+// - the first window scores all of its tokens
+// - subsequent windows only score their last `stride` tokens, with the rest serving as context
+//
+// If a reference instance is provided, it's fed the same batches (teacher forcing) concurrently with the target.
+// For each scored token the KL divergence of the target from the reference distribution, the Jensen-Shannon
+// divergence between the two and whether their top-1 tokens agree are computed.
+// The two instances must share a vocabulary and their contexts must accommodate the same windows.
+//
+// The instances must not have active sessions while evaluating
+class AC_LLAMA_EXPORT Evaluator {
+public:
+    struct Params {
+        uint32_t windowSize = 0; // tokens per window (0 = context size / max sequences of the context)
+        uint32_t stride = 0; // distance between window starts (0 = windowSize / 2), must be less than windowSize
+        uint32_t numParallel = 0; // windows decoded in parallel (0 = as many as fit in the context)
+        uint32_t fileChunkSize = 1024 * 1024; // bytes read and tokenized at once by evaluateFile
+
+        // threads for scoring the logits (0 = hardware concurrency)
+        // with a reference the decoding threads of each context are also set to half of these for the evaluation
+        uint32_t numThreads = 0;
+    };
+
+    struct Result {
+        uint64_t numTokens = 0; // number of scored tokens
+        uint64_t numWindows = 0; // number of evaluated windows
+        double nll = 0; // sum of the negative log-likelihoods of the scored tokens
+
+        // only collected when there is a reference instance
+        double referenceNll = 0; // sum of the negative log-likelihoods according to the reference
+        double klSum = 0; // sum of KL(reference || target) for each scored token
+        double klMax = 0; // max KL(reference || target) of a single token
+        double jsdSum = 0; // sum of the Jensen-Shannon divergences for each scored token
+        double jsdMax = 0; // max Jensen-Shannon divergence of a single token
+        uint64_t top1Matches = 0; // number of scored tokens where both models agree on the most likely token
+
+        double perplexity() const noexcept { return numTokens ? std::exp(nll / double(numTokens)) : 0; }
+        double referencePerplexity() const noexcept { return numTokens ? std::exp(referenceNll / double(numTokens)) : 0; }
+        double klMean() const noexcept { return numTokens ? klSum / double(numTokens) : 0; }
+        double jsdMean() const noexcept { return numTokens ? jsdSum / double(numTokens) : 0; }
+        double top1Agreement() const noexcept { return numTokens ? double(top1Matches) / double(numTokens) : 0; }
+    };
+
+    struct TokenStats {
+        uint64_t index; // index of the token in the evaluated stream
+        Token token;
+        float nll;
+
+        // only with a reference
+        float referenceNll;
+        float kl;
+        float jsd;
+        bool top1Match;
+    };
+
+    // called after each batch of windows with the accumulated result so far
+    using ProgressCb = astl::ufunction<void(const Result&)>;
+
+    // called for each scored token in stream order
+    using TokenCb = astl::ufunction<void(const TokenStats&)>;
+
+    Evaluator(Instance& target, Params params);
+    Evaluator(Instance& target, Instance& reference, Params params);
+    ~Evaluator();
+
+    Evaluator(const Evaluator&) = delete;
+    Evaluator& operator=(const Evaluator&) = delete;
+
+    // evaluate a tokenized text
+    Result evaluate(std::span<const Token> tokens, ProgressCb cb = {}, TokenCb tokenCb = {});
+
+    // evaluate a text file
+    // the file is streamed in chunks and never loaded whole (see StreamingTokenizer for how the text is split)
+    Result evaluateFile(const std::string& path, ProgressCb cb = {}, TokenCb tokenCb = {});
+
+    uint32_t windowSize() const noexcept { return m_windowSize; }
+    uint32_t stride() const noexcept { return m_stride; }
+    uint32_t numParallel() const noexcept { return m_numParallel; }
+
+private:
+    struct Window {
+        std::span<const Token> tokens;
+        uint32_t scoreBegin; // index of the first scored token in the window
+    };
+
+    struct Callbacks {
+        ProgressCb& progress;
+        TokenCb& token;
+    };
+
+    // evaluate the complete windows of tokens (and the trailing partial one if final)
+    // returns the number of leading tokens which are no longer needed
+    size_t evalWindows(std::span<const Token> tokens, bool final, Result& result, Callbacks& cbs);
+
+    void decodeGroup(std::span<const Window> windows, Result& result, Callbacks& cbs);
+
+    // compute the stats of m_tokenStats[begin, end) from m_logits and m_refLogits
+    void scoreOutputs(size_t begin, size_t end, std::vector<float>& scratch);
+
+    Instance& m_target;
+    Instance* m_reference;
+    Params m_params;
+
+    uint32_t m_windowSize = 0;
+    uint32_t m_stride = 0;
+    uint32_t m_numParallel = 0;
+    uint32_t m_numThreads = 0;
+    Token m_bos = Token_Invalid; // replaces the first token of each window if the model wants one
+
+    // kept as members so as to avoid reallocations on every batch
+    std::vector<Window> m_windows;
+    std::vector<int32_t> m_outputs; // batch indices of the scored outputs of the current batch
+    std::vector<const float*> m_logits; // logits of each output of the current batch
+    std::vector<const float*> m_refLogits; // ... and of the reference
+    std::vector<TokenStats> m_tokenStats; // stats for each output of the current batch
+    std::vector<std::vector<float>> m_scratch; // vocab-sized buffers for each chunk of scored outputs
+
+    std::unique_ptr<WorkerPool> m_pool; // scoring threads besides the calling one, null for a single thread
+};
+
+} // namespace ac::llama
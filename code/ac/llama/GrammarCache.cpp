@@ -0,0 +1,114 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include "GrammarCache.hpp"
+#include "Vocab.hpp"
+#include "JsonSchema.hpp"
+#include "Logging.hpp"
+
+#include <llama.h>
+
+#include <astl/throw_stdex.hpp>
+
+namespace ac::llama {
+
+GrammarCache::GrammarCache(const Vocab& vocab, size_t maxEntries)
+    : m_vocab(vocab)
+    , m_maxEntries(std::max(maxEntries, size_t(1)))
+{}
+
+GrammarCache::~GrammarCache() = default;
+
+std::shared_ptr<const llama_sampler> GrammarCache::get(std::string_view grammar) {
+    {
+        std::lock_guard lock(m_mutex);
+        auto it = m_index.find(grammar);
+        if (it != m_index.end()) {
+            ++m_stats.hits;
+            m_entries.splice(m_entries.begin(), m_entries, it->second);
+            return it->second->sampler;
+        }
+        ++m_stats.misses;
+    }
+
+    // parse outside of the lock, so that other grammars can be served in the meantime
+    // if the same grammar is requested concurrently it's parsed more than once, but that's fine
+    std::string str(grammar);
+    std::shared_ptr<const llama_sampler> sampler(
+        llama_sampler_init_grammar(m_vocab.lvocab(), str.c_str(), "root"),
+        [](const llama_sampler* s) { llama_sampler_free(const_cast<llama_sampler*>(s)); }
+    );
+    if (!sampler) {
+        throw_ex{} << "Failed to parse grammar";
+    }
+
+    std::lock_guard lock(m_mutex);
+    auto it = m_index.find(grammar);
+    if (it != m_index.end()) {
+        // someone else added it in the meantime
+        return it->second->sampler;
+    }
+
+    m_entries.push_front({std::move(str), sampler});
+    m_index.emplace(m_entries.front().grammar, m_entries.begin());
+
+    if (m_entries.size() > m_maxEntries) {
+        // samplers which cloned the evicted grammar keep it alive through their own reference
+        m_index.erase(m_entries.back().grammar);
+        m_entries.pop_back();
+    }
+
+    LLAMA_LOG(Debug, "Grammar cache: parsed grammar of ", grammar.size(), " bytes");
+    return sampler;
+}
+
+std::shared_ptr<const llama_sampler> GrammarCache::getForJsonSchema(std::string_view schema) {
+    std::string grammar;
+    {
+        std::lock_guard lock(m_mutex);
+        auto it = m_schemaIndex.find(schema);
+        if (it != m_schemaIndex.end()) {
+            ++m_stats.schemaHits;
+            m_schemaEntries.splice(m_schemaEntries.begin(), m_schemaEntries, it->second);
+            grammar = it->second->grammar;
+        }
+        else {
+            ++m_stats.schemaMisses;
+        }
+    }
+
+    if (grammar.empty()) {
+        grammar = jsonSchemaToGrammar(schema);
+
+        std::lock_guard lock(m_mutex);
+        if (!m_schemaIndex.contains(schema)) {
+            m_schemaEntries.push_front({std::string(schema), grammar});
+            m_schemaIndex.emplace(m_schemaEntries.front().schema, m_schemaEntries.begin());
+
+            if (m_schemaEntries.size() > m_maxEntries) {
+                m_schemaIndex.erase(m_schemaEntries.back().schema);
+                m_schemaEntries.pop_back();
+            }
+        }
+
+        LLAMA_LOG(Debug, "Grammar cache: compiled JSON schema of ", schema.size(), " bytes to a grammar of ",
+            grammar.size(), " bytes");
+    }
+
+    return get(grammar);
+}
+
+GrammarCache::Stats GrammarCache::stats() const {
+    std::lock_guard lock(m_mutex);
+    return m_stats;
+}
+
+void GrammarCache::clear() {
+    std::lock_guard lock(m_mutex);
+    m_index.clear();
+    m_entries.clear();
+    m_schemaIndex.clear();
+    m_schemaEntries.clear();
+}
+
+} // namespace ac::llama
@@ -0,0 +1,80 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "export.h"
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+struct llama_sampler;
+
+namespace ac::llama {
+
+class Vocab;
+
+// Cache of parsed grammars for a vocabulary
+//
+// Parsing a GBNF grammar is expensive for large grammars (such as ones generated from JSON schemas), while
+// cloning the parsed grammar is cheap. Each entry holds a grammar sampler in its initial state which samplers
+// clone for their own state.
+// JSON schemas are compiled to grammars (see jsonSchemaToGrammar) and the compiled grammars are memoized as well.
+// Schemas which differ only in formatting compile to the same grammar and share its parsed entry.
+// The cache is owned by the model, so it's shared by all samplers of all instances of the model.
+// It's thread safe.
+class AC_LLAMA_EXPORT GrammarCache {
+public:
+    explicit GrammarCache(const Vocab& vocab, size_t maxEntries = 32);
+    ~GrammarCache();
+
+    GrammarCache(const GrammarCache&) = delete;
+    GrammarCache& operator=(const GrammarCache&) = delete;
+
+    // grammar sampler in its initial state for the grammar
+    // do not apply or accept tokens with it, only clone it
+    // throws if the grammar can't be parsed
+    std::shared_ptr<const llama_sampler> get(std::string_view grammar);
+
+    // grammar sampler in its initial state for a JSON schema
+    // throws if the schema is invalid
+    std::shared_ptr<const llama_sampler> getForJsonSchema(std::string_view schema);
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t schemaHits = 0;
+        uint64_t schemaMisses = 0;
+    };
+    Stats stats() const;
+
+    void clear();
+
+private:
+    const Vocab& m_vocab;
+    const size_t m_maxEntries;
+
+    struct Entry {
+        std::string grammar;
+        std::shared_ptr<const llama_sampler> sampler;
+    };
+
+    mutable std::mutex m_mutex;
+    std::list<Entry> m_entries; // most recently used first
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> m_index; // views into the entry grammars
+
+    struct SchemaEntry {
+        std::string schema;
+        std::string grammar;
+    };
+    std::list<SchemaEntry> m_schemaEntries; // most recently used first
+    std::unordered_map<std::string_view, std::list<SchemaEntry>::iterator> m_schemaIndex;
+
+    Stats m_stats;
+};
+
+} // namespace ac::llama
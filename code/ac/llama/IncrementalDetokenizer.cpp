@@ -0,0 +1,45 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include "IncrementalDetokenizer.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace ac::llama {
+
+std::string_view IncrementalDetokenizer::feed(std::string_view piece) {
+    // at most 3 pending bytes are moved to the front, the buffer is reused
+    m_text.erase(0, m_emitted);
+    m_text += piece;
+    m_emitted = completeLength(m_text);
+    return std::string_view(m_text).substr(0, m_emitted);
+}
+
+void IncrementalDetokenizer::reset() noexcept {
+    m_text.clear();
+    m_emitted = 0;
+}
+
+size_t IncrementalDetokenizer::completeLength(std::string_view text) noexcept {
+    const auto size = text.size();
+
+    // find the lead byte of the last character (no further than a 4-byte character goes)
+    const auto maxBack = std::min(size, size_t(4));
+    for (size_t back = 1; back <= maxBack; ++back) {
+        const auto c = uint8_t(text[size - back]);
+        if ((c & 0xC0) == 0x80) continue; // continuation byte
+
+        size_t len = 1; // ascii or invalid lead byte
+        if ((c & 0xE0) == 0xC0) len = 2;
+        else if ((c & 0xF0) == 0xE0) len = 3;
+        else if ((c & 0xF8) == 0xF0) len = 4;
+
+        return len > back ? size - back : size;
+    }
+
+    // only continuation bytes: invalid, nothing to wait for
+    return size;
+}
+
+} // namespace ac::llama
@@ -0,0 +1,42 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "export.h"
+
+#include <string>
+#include <string_view>
+
+namespace ac::llama {
+
+// Turns a stream of token pieces into a stream of valid UTF-8 text
+//
+// A multibyte character can be split between tokens. The incomplete bytes at the end of a piece are held back
+// until the rest of the character arrives, so each returned chunk is safe to stream on its own. Bytes which can't
+// be part of a valid character are passed through as they are (there's nothing to wait for).
+class AC_LLAMA_EXPORT IncrementalDetokenizer {
+public:
+    IncrementalDetokenizer() = default;
+
+    // feed a token piece
+    // returns the text which is complete so far (possibly empty)
+    // the view is valid until the next call to a non-const method
+    std::string_view feed(std::string_view piece);
+
+    // bytes of an incomplete character held back from the previous feeds
+    std::string_view pending() const noexcept {
+        return std::string_view(m_text).substr(m_emitted);
+    }
+
+    // drop the pending bytes (keeps the buffer)
+    void reset() noexcept;
+
+    // length of the longest prefix of text which doesn't end with an incomplete UTF-8 character
+    static size_t completeLength(std::string_view text) noexcept;
+
+private:
+    std::string m_text; // emitted text from the last feed, followed by the pending bytes
+    size_t m_emitted = 0;
+};
+
+} // namespace ac::llama
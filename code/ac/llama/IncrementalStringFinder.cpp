@@ -8,7 +8,21 @@ namespace ac::llama {
 IncrementalStringFinder::IncrementalStringFinder(std::string searchStr)
     : m_searchStr(std::move(searchStr))
     , m_currentPos(0)
-{}
+{
+    // on a mismatch the search continues from the longest prefix which has been matched, so that overlapping
+    // occurrences are found (as in Knuth-Morris-Pratt)
+    m_fail.resize(m_searchStr.length(), 0);
+    uint16_t k = 0;
+    for (size_t i = 1; i < m_searchStr.length(); ++i) {
+        while (k > 0 && m_searchStr[i] != m_searchStr[k]) {
+            k = m_fail[k - 1];
+        }
+        if (m_searchStr[i] == m_searchStr[k]) {
+            ++k;
+        }
+        m_fail[i] = k;
+    }
+}
 
 int IncrementalStringFinder::feedText(std::string_view text) {
     if (m_searchStr.length() == 0) {
@@ -18,10 +32,10 @@ int IncrementalStringFinder::feedText(std::string_view text) {
     uint32_t promptPos = 0;
 
     while(promptPos < text.length() && m_currentPos < m_searchStr.length()) {
-        if (m_searchStr[m_currentPos] != text[promptPos]) {
+        while (m_currentPos > 0 && m_searchStr[m_currentPos] != text[promptPos]) {
             // different character was found
-            // need to start from the beginning
-            m_currentPos = 0;
+            // continue from the longest prefix which still matches
+            m_currentPos = m_fail[m_currentPos - 1];
         }
 
         if (m_searchStr[m_currentPos] == text[promptPos]) {
@@ -7,6 +7,7 @@
 #include <cstdint>
 #include <string>
 #include <string_view>
+#include <vector>
 
 namespace ac::llama {
 class AC_LLAMA_EXPORT IncrementalStringFinder {
@@ -26,6 +27,7 @@ public:
     uint16_t getCurrentPos() const { return m_currentPos; }
 private:
     std::string m_searchStr;
+    std::vector<uint16_t> m_fail; // length of the longest proper prefix which is a suffix of m_searchStr[0, i]
     uint16_t m_currentPos;
 };
 }
@@ -27,6 +27,7 @@ llama_context_params llamaFromInstanceInitParams(const Instance::InitParams& par
     llamaParams.n_ctx = params.ctxSize;
     llamaParams.n_batch = params.batchSize;
     llamaParams.n_ubatch = params.ubatchSize;
+    llamaParams.n_seq_max = params.maxSequences;
     llamaParams.flash_attn = params.flashAttn;
     return llamaParams;
 }
@@ -36,6 +37,10 @@ Instance::Instance(Model& model, InitParams params)
     : m_model(model)
     , m_sampler(new Sampler(model, {
         .grammar = params.grammar,
+        .jsonSchema = params.jsonSchema,
+        .grammarTriggerWords = params.grammarTriggerWords,
+        .grammarTriggerTokens = params.grammarTriggerTokens,
+        .collectMetrics = params.samplerMetrics,
     }))
     , m_lctx(llama_init_from_model(model.lmodel(), llamaFromInstanceInitParams(params)), llama_free)
 {
@@ -23,8 +23,13 @@ public:
         uint32_t ctxSize = 0; // context size for the model (0 = maximum allowed by model)
         uint32_t batchSize = 2048; // logical batch size for prompt processing (may be silently truncated to ctxSize)
         uint32_t ubatchSize = 512; // physical batch size for prompt processing (0 = batchSize)
+        uint32_t maxSequences = 1; // max number of parallel sequences in the context (for batched evaluation)
         bool flashAttn = false; // enable flash attention
         std::string grammar; // BNF-styled grammar
+        std::string jsonSchema; // JSON schema to constrain the output (ignored if grammar is set)
+        std::vector<std::string> grammarTriggerWords; // make the grammar lazy (see Sampler::Params)
+        std::vector<Token> grammarTriggerTokens;
+        bool samplerMetrics = false; // collect per stage metrics of the sampler (see Sampler::metrics)
     };
 
     explicit Instance(Model& model, InitParams params);
@@ -46,12 +51,17 @@ public:
 
     const Model& model() const noexcept { return m_model; }
 
+    // raw context for subsystems which drive the decoding themselves (Evaluator)
+    // they must not be used while a session is active
+    llama_context* lctx() noexcept { return m_lctx.get(); }
+    bool hasActiveSession() const noexcept { return m_session.has_value(); }
+
     Sampler& sampler() noexcept { return *m_sampler; }
 
-    // Change sampler settings by resetting it
+    // Change sampler settings (in place, see Sampler::setParams)
     // warning: this will clear any previous sampler state
     void resetSampler(const Sampler::Params& params) {
-        m_sampler.reset(new Sampler(m_model, params));
+        m_sampler->setParams(params);
     }
 
 private:
@@ -0,0 +1,503 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include "JsonSchema.hpp"
+#include "Logging.hpp"
+
+#include <ac/vendor/nlohmann/json.hpp>
+
+#include <astl/throw_stdex.hpp>
+
+#include <cstdio>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace ac::llama {
+
+namespace {
+
+using Json = acnl::ordered_json;
+
+struct Primitive {
+    std::string_view name;
+    std::string_view body;
+    std::vector<std::string_view> deps;
+};
+
+// rules added to the grammar on demand
+const Primitive Primitives[] = {
+    {"space", R"(| " " | "\n"{1,2} [ \t]{0,20})", {}},
+    {"boolean", R"(("true" | "false") space)", {"space"}},
+    {"null", R"("null" space)", {"space"}},
+    {"char", R"([^"\\\x7F\x00-\x1F] | [\\] (["\\bfnrt] | "u" [0-9a-fA-F]{4}))", {}},
+    {"integral-part", R"([0] | [1-9] [0-9]{0,15})", {}},
+    {"decimal-part", R"([0-9]{1,16})", {}},
+    {"integer", R"(("-"? integral-part) space)", {"integral-part", "space"}},
+    {"number", R"(("-"? integral-part) ("." decimal-part)? ([eE] [-+]? integral-part)? space)",
+        {"integral-part", "decimal-part", "space"}},
+    {"string", R"("\"" char* "\"" space)", {"char", "space"}},
+    {"value", R"(object | array | string | number | boolean | null)",
+        {"object", "array", "string", "number", "boolean", "null"}},
+    {"object", R"("{" space ( string ":" space value ("," space string ":" space value)* )? "}" space)",
+        {"string", "value", "space"}},
+    {"array", R"("[" space ( value ("," space value)* )? "]" space)", {"value", "space"}},
+
+    // string formats
+    {"date", R"([0-9]{4} "-" ( "0" [1-9] | "1" [0-2] ) "-" ( "0" [1-9] | [1-2] [0-9] | "3" [0-1] ))", {}},
+    {"time", R"(([01] [0-9] | "2" [0-3]) ":" [0-5] [0-9] ":" [0-5] [0-9] ( "." [0-9]{3} )? )"
+        R"(( "Z" | ( "+" | "-" ) ( [01] [0-9] | "2" [0-3] ) ":" [0-5] [0-9] ))", {}},
+    {"date-string", R"("\"" date "\"" space)", {"date", "space"}},
+    {"time-string", R"("\"" time "\"" space)", {"time", "space"}},
+    {"date-time-string", R"("\"" date "T" time "\"" space)", {"date", "time", "space"}},
+    {"uuid-string", R"("\"" [0-9a-fA-F]{8} "-" [0-9a-fA-F]{4} "-" [0-9a-fA-F]{4} "-" [0-9a-fA-F]{4} )"
+        R"("-" [0-9a-fA-F]{12} "\"" space)", {"space"}},
+};
+
+const Primitive* findPrimitive(std::string_view name) {
+    for (auto& p : Primitives) {
+        if (p.name == name) return &p;
+    }
+    return nullptr;
+}
+
+// GBNF string literal
+std::string literal(std::string_view str) {
+    std::string ret = "\"";
+    for (char c : str) {
+        switch (c) {
+        case '"': ret += "\\\""; break;
+        case '\\': ret += "\\\\"; break;
+        case '\n': ret += "\\n"; break;
+        case '\r': ret += "\\r"; break;
+        case '\t': ret += "\\t"; break;
+        default:
+            if (uint8_t(c) < 0x20) {
+                char buf[8];
+                std::snprintf(buf, sizeof(buf), "\\x%02X", unsigned(uint8_t(c)));
+                ret += buf;
+            }
+            else {
+                ret += c;
+            }
+        }
+    }
+    ret += '"';
+    return ret;
+}
+
+// repetition of a grammar expression (max < 0 for unbounded)
+std::string repeat(const std::string& expr, int64_t min, int64_t max) {
+    if (max == 0) return {};
+    if (min == 0 && max < 0) return expr + "*";
+    if (min == 1 && max < 0) return expr + "+";
+    if (min == 0 && max == 1) return expr + "?";
+    if (min == 1 && max == 1) return expr;
+    if (min == max) return expr + "{" + std::to_string(min) + "}";
+    if (max < 0) return expr + "{" + std::to_string(min) + ",}";
+    return expr + "{" + std::to_string(min) + "," + std::to_string(max) + "}";
+}
+
+std::optional<int64_t> optInt(const Json& schema, const char* key) {
+    auto it = schema.find(key);
+    if (it == schema.end()) return std::nullopt;
+    if (!it->is_number_integer() || it->get<int64_t>() < 0) {
+        throw_ex{} << "Invalid JSON schema: " << key << " must be a non-negative integer";
+    }
+    return it->get<int64_t>();
+}
+
+class SchemaConverter {
+public:
+    explicit SchemaConverter(const Json& root) : m_root(root) {}
+
+    std::string compile() {
+        refRule("#", "root");
+
+        std::string ret;
+        for (auto& [name, body] : m_rules) {
+            ret += name;
+            ret += " ::= ";
+            ret += body;
+            ret += '\n';
+        }
+        return ret;
+    }
+
+private:
+    const Json& m_root;
+
+    // rules in order of definition
+    std::vector<std::pair<std::string, std::string>> m_rules;
+    std::unordered_set<std::string> m_names;
+
+    // identical subschemas produce identical bodies (as their own subschemas map to the same rules),
+    // so bodies identify the rules to reuse
+    std::unordered_map<std::string, std::string> m_ruleByBody;
+
+    std::unordered_map<std::string, std::string> m_ruleByRef;
+
+    std::string uniqueName(std::string_view hint) {
+        std::string name;
+        for (char c : hint) {
+            const bool word = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-';
+            name += word ? c : '-';
+        }
+        if (name.empty()) name = "rule";
+
+        auto taken = [&](const std::string& n) {
+            return m_names.contains(n) || findPrimitive(n);
+        };
+        if (!taken(name)) return name;
+        for (int i = 1; ; ++i) {
+            auto candidate = name + "-" + std::to_string(i);
+            if (!taken(candidate)) return candidate;
+        }
+    }
+
+    size_t reserveRule(std::string name) {
+        m_names.insert(name);
+        m_rules.emplace_back(std::move(name), std::string{});
+        return m_rules.size() - 1;
+    }
+
+    std::string primitive(std::string_view name) {
+        if (m_names.contains(std::string(name))) return std::string(name);
+        auto p = findPrimitive(name);
+        auto i = reserveRule(std::string(name));
+        m_rules[i].second = p->body;
+        for (auto dep : p->deps) {
+            primitive(dep);
+        }
+        return std::string(name);
+    }
+
+    const Json& resolve(const std::string& ref) {
+        if (ref.empty() || ref[0] != '#') {
+            throw_ex{} << "Unsupported JSON schema $ref: " << ref << " (only local references are supported)";
+        }
+        Json::json_pointer ptr(ref.substr(1));
+        if (!m_root.contains(ptr)) {
+            throw_ex{} << "Unresolved JSON schema $ref: " << ref;
+        }
+        return m_root.at(ptr);
+    }
+
+    std::string refRule(const std::string& ref, std::string_view hint) {
+        auto it = m_ruleByRef.find(ref);
+        if (it != m_ruleByRef.end()) return it->second;
+
+        // register before visiting, so that recursive references resolve to the rule
+        auto name = uniqueName(hint);
+        m_ruleByRef.emplace(ref, name);
+        auto i = reserveRule(name);
+        auto b = body(resolve(ref), name);
+        m_rules[i].second = std::move(b);
+        return name;
+    }
+
+    // rule for a subschema
+    std::string rule(const Json& schema, std::string_view hint) {
+        auto b = body(schema, hint);
+
+        // aliases of other rules
+        if (m_names.contains(b)) return b;
+
+        auto it = m_ruleByBody.find(b);
+        if (it != m_ruleByBody.end()) return it->second;
+
+        auto name = uniqueName(hint);
+        auto i = reserveRule(name);
+        m_ruleByBody.emplace(b, name);
+        m_rules[i].second = std::move(b);
+        return name;
+    }
+
+    std::string alternatives(const Json& schemas, std::string_view hint) {
+        if (!schemas.is_array() || schemas.empty()) {
+            throw_ex{} << "Invalid JSON schema: alternatives must be a non-empty array";
+        }
+        std::string ret;
+        for (size_t i = 0; i < schemas.size(); ++i) {
+            if (i) ret += " | ";
+            ret += rule(schemas[i], std::string(hint) + "-" + std::to_string(i));
+        }
+        return ret;
+    }
+
+    std::string valueLiteral(const Json& value) {
+        return literal(value.dump()) + " " + primitive("space");
+    }
+
+    std::string body(const Json& schema, std::string_view name) {
+        if (schema.is_boolean()) {
+            if (!schema.get<bool>()) {
+                throw_ex{} << "Unsatisfiable JSON schema: false";
+            }
+            return primitive("value");
+        }
+        if (!schema.is_object()) {
+            throw_ex{} << "Invalid JSON schema: " << schema.dump();
+        }
+
+        if (auto ref = schema.find("$ref"); ref != schema.end()) {
+            auto& r = ref->get_ref<const std::string&>();
+            auto slash = r.rfind('/');
+            return refRule(r, slash == std::string::npos ? r : r.substr(slash + 1));
+        }
+
+        if (auto c = schema.find("const"); c != schema.end()) {
+            return valueLiteral(*c);
+        }
+
+        if (auto e = schema.find("enum"); e != schema.end()) {
+            if (!e->is_array() || e->empty()) {
+                throw_ex{} << "Invalid JSON schema: enum must be a non-empty array";
+            }
+            std::string ret;
+            for (auto& v : *e) {
+                if (!ret.empty()) ret += " | ";
+                ret += literal(v.dump());
+            }
+            return "(" + ret + ") " + primitive("space");
+        }
+
+        if (auto a = schema.find("anyOf"); a != schema.end()) {
+            return alternatives(*a, name);
+        }
+        if (auto a = schema.find("oneOf"); a != schema.end()) {
+            return alternatives(*a, name);
+        }
+
+        if (schema.contains("allOf")) {
+            return objectBody(mergeAllOf(schema), name);
+        }
+
+        auto type = schema.find("type");
+        if (type == schema.end()) {
+            if (schema.contains("properties") || schema.contains("additionalProperties")) {
+                return objectBody(schema, name);
+            }
+            if (schema.contains("items") || schema.contains("prefixItems")) {
+                return arrayBody(schema, name);
+            }
+            return primitive("value");
+        }
+
+        if (type->is_array()) {
+            std::string ret;
+            for (auto& t : *type) {
+                auto single = schema;
+                single["type"] = t;
+                if (!ret.empty()) ret += " | ";
+                ret += rule(single, std::string(name) + "-" + t.get<std::string>());
+            }
+            return ret;
+        }
+
+        auto& t = type->get_ref<const std::string&>();
+        if (t == "object") return objectBody(schema, name);
+        if (t == "array") return arrayBody(schema, name);
+        if (t == "string") return stringBody(schema);
+        if (t == "number" || t == "integer" || t == "boolean" || t == "null") {
+            return primitive(t);
+        }
+        throw_ex{} << "Unsupported JSON schema type: " << t;
+    }
+
+    Json mergeAllOf(const Json& schema) {
+        Json merged = schema;
+        merged.erase("allOf");
+        merged["type"] = "object";
+        Json props = schema.value("properties", Json::object());
+        Json required = schema.value("required", Json::array());
+
+        for (auto& item : schema["allOf"]) {
+            auto* sub = &item;
+            if (auto ref = sub->find("$ref"); ref != sub->end()) {
+                sub = &resolve(ref->get<std::string>());
+            }
+            if (!sub->is_object() || sub->value("type", "object") != "object") {
+                throw_ex{} << "Unsupported JSON schema: allOf is only supported for object schemas";
+            }
+            if (auto p = sub->find("properties"); p != sub->end()) {
+                props.update(*p);
+            }
+            if (auto r = sub->find("required"); r != sub->end()) {
+                required.insert(required.end(), r->begin(), r->end());
+            }
+            if (auto ap = sub->find("additionalProperties"); ap != sub->end()) {
+                merged["additionalProperties"] = *ap;
+            }
+        }
+
+        merged["properties"] = std::move(props);
+        merged["required"] = std::move(required);
+        return merged;
+    }
+
+    std::string objectBody(const Json& schema, std::string_view name) {
+        static const Json empty = Json::object();
+        auto pit = schema.find("properties");
+        const Json& props = pit == schema.end() ? empty : *pit;
+
+        std::unordered_set<std::string> required;
+        if (auto r = schema.find("required"); r != schema.end()) {
+            for (auto& p : *r) {
+                required.insert(p.get<std::string>());
+            }
+        }
+
+        // additional properties are allowed only when explicitly requested, unless there are no properties at all
+        std::string additional;
+        if (auto ap = schema.find("additionalProperties"); ap != schema.end()) {
+            if (!ap->is_boolean() || ap->get<bool>()) {
+                additional = rule(*ap, std::string(name) + "-additional");
+            }
+        }
+        else if (props.empty()) {
+            additional = primitive("value");
+        }
+
+        const auto space = primitive("space");
+        if (props.empty() && additional == "value") {
+            return primitive("object");
+        }
+
+        auto kv = [&](const std::string& key, const std::string& valueRule) {
+            return literal(Json(key).dump()) + " " + space + " \":\" " + space + " " + valueRule;
+        };
+
+        std::vector<std::string> requiredKvs, optionalKvs;
+        for (auto& [key, sub] : props.items()) {
+            auto kvs = kv(key, rule(sub, std::string(name) + "-" + key));
+            (required.contains(key) ? requiredKvs : optionalKvs).push_back(std::move(kvs));
+        }
+
+        std::string extraKv;
+        if (!additional.empty()) {
+            extraKv = primitive("string") + " \":\" " + space + " " + additional;
+        }
+
+        auto next = [&](const std::string& kv) {
+            return "( \",\" " + space + " " + kv + " )";
+        };
+
+        std::string members;
+        if (!requiredKvs.empty()) {
+            for (size_t i = 0; i < requiredKvs.size(); ++i) {
+                members += i ? " \",\" " + space + " " : std::string{};
+                members += requiredKvs[i];
+            }
+            for (auto& o : optionalKvs) {
+                members += " " + next(o) + "?";
+            }
+            if (!extraKv.empty()) {
+                members += " " + next(extraKv) + "*";
+            }
+        }
+        else if (!optionalKvs.empty() || !extraKv.empty()) {
+            // any subset of the optional properties in order: each alternative starts with a different one
+            // the tails are separate rules, so that the size of the grammar is linear in the number of properties
+            std::string tail = extraKv.empty() ? std::string{} : next(extraKv) + "*";
+            std::vector<std::string> alts(optionalKvs.size());
+            for (size_t i = optionalKvs.size(); i-- > 0; ) {
+                alts[i] = tail.empty() ? optionalKvs[i] : optionalKvs[i] + " " + tail;
+                if (i > 0) {
+                    auto tailBody = tail.empty() ? next(optionalKvs[i]) + "?" : next(optionalKvs[i]) + "? " + tail;
+                    auto tailName = uniqueName(std::string(name) + "-tail");
+                    m_rules[reserveRule(tailName)].second = std::move(tailBody);
+                    tail = tailName;
+                }
+            }
+            if (!extraKv.empty()) {
+                alts.push_back(extraKv + " " + next(extraKv) + "*");
+            }
+
+            members = "(";
+            for (size_t i = 0; i < alts.size(); ++i) {
+                members += i ? " | " : " ";
+                members += alts[i];
+            }
+            members += " )?";
+        }
+
+        return "\"{\" " + space + (members.empty() ? "" : " " + members) + " \"}\" " + space;
+    }
+
+    std::string arrayBody(const Json& schema, std::string_view name) {
+        const auto space = primitive("space");
+
+        // tuples
+        const Json* tuple = nullptr;
+        if (auto p = schema.find("prefixItems"); p != schema.end()) tuple = &*p;
+        else if (auto i = schema.find("items"); i != schema.end() && i->is_array()) tuple = &*i;
+        if (tuple) {
+            std::string ret = "\"[\" " + space;
+            for (size_t i = 0; i < tuple->size(); ++i) {
+                if (i) ret += " \",\" " + space;
+                ret += " " + rule((*tuple)[i], std::string(name) + "-" + std::to_string(i));
+            }
+            return ret + " \"]\" " + space;
+        }
+
+        auto min = optInt(schema, "minItems").value_or(0);
+        auto max = optInt(schema, "maxItems").value_or(-1);
+
+        auto items = schema.find("items");
+        if (items == schema.end() && min == 0 && max < 0) {
+            return primitive("array");
+        }
+        auto item = items == schema.end() ? primitive("value") : rule(*items, std::string(name) + "-item");
+
+        std::string ret = "\"[\" " + space;
+        if (max != 0) {
+            auto more = repeat("( \",\" " + space + " " + item + " )",
+                std::max(min - 1, int64_t(0)), max < 0 ? -1 : max - 1);
+            auto seq = more.empty() ? item : item + " " + more;
+            ret += " " + (min == 0 ? "( " + seq + " )?" : seq);
+        }
+        return ret + " \"]\" " + space;
+    }
+
+    std::string stringBody(const Json& schema) {
+        if (auto f = schema.find("format"); f != schema.end()) {
+            auto& format = f->get_ref<const std::string&>();
+            if (format == "date" || format == "time" || format == "date-time" || format == "uuid") {
+                return primitive(format + "-string");
+            }
+            LLAMA_LOG(Warning, "JSON schema string format ", format, " is not supported and will be ignored");
+        }
+        if (schema.contains("pattern")) {
+            LLAMA_LOG(Warning, "JSON schema string patterns are not supported and will be ignored");
+        }
+
+        auto min = optInt(schema, "minLength").value_or(0);
+        auto max = optInt(schema, "maxLength").value_or(-1);
+        if (min == 0 && max < 0) {
+            return primitive("string");
+        }
+        return "\"\\\"\" " + repeat(primitive("char"), min, max) + " \"\\\"\" " + primitive("space");
+    }
+};
+
+} // namespace
+
+std::string jsonSchemaToGrammar(std::string_view schema) {
+    auto json = Json::parse(schema, nullptr, false);
+    if (json.is_discarded()) {
+        throw_ex{} << "Invalid JSON schema: not a valid JSON";
+    }
+
+    try {
+        return SchemaConverter(json).compile();
+    }
+    catch (const acnl::json::exception& e) {
+        // type errors in the schema
+        throw_ex{} << "Invalid JSON schema: " << e.what();
+    }
+}
+
+} // namespace ac::llama
@@ -0,0 +1,28 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "export.h"
+
+#include <string>
+#include <string_view>
+
+namespace ac::llama {
+
+// Compile a JSON schema to a GBNF grammar (with the start rule "root") which constrains sampling to JSON values
+// that conform to the schema.
+//
+// Supported: type (including type lists), properties, required, additionalProperties, items, prefixItems,
+// minItems, maxItems, minLength, maxLength, enum, const, anyOf, oneOf, allOf (of objects), local $ref-s
+// (including recursive ones), and the date, time, date-time, and uuid string formats.
+// Keywords which can't be expressed (pattern, numeric ranges and others) are ignored, so the grammar may accept
+// a superset of the schema. Objects produce the required properties before the optional ones.
+//
+// Identical subschemas are compiled to a single rule, so repetitive schemas don't bloat the grammar.
+//
+// Compiled grammars are memoized by the model's grammar cache (see GrammarCache::getForJsonSchema).
+//
+// throws on invalid JSON or an invalid schema
+AC_LLAMA_EXPORT std::string jsonSchemaToGrammar(std::string_view schema);
+
+} // namespace ac::llama
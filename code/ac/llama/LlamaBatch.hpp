@@ -0,0 +1,29 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "Token.hpp"
+
+#include <llama.h>
+
+namespace ac::llama {
+
+// owning llama_batch of single sequence tokens, filled with add and reused by resetting n_tokens
+struct LlamaBatch {
+    llama_batch batch;
+    explicit LlamaBatch(int32_t size) : batch(llama_batch_init(size, 0, 1)) {}
+    ~LlamaBatch() { llama_batch_free(batch); }
+    LlamaBatch(const LlamaBatch&) = delete;
+    LlamaBatch& operator=(const LlamaBatch&) = delete;
+
+    void add(Token token, llama_pos pos, llama_seq_id seq, bool logits) {
+        auto i = batch.n_tokens++;
+        batch.token[i] = token;
+        batch.pos[i] = pos;
+        batch.n_seq_id[i] = 1;
+        batch.seq_id[i][0] = seq;
+        batch.logits[i] = logits;
+    }
+};
+
+} // namespace ac::llama
@@ -2,33 +2,84 @@
 // SPDX-License-Identifier: MIT
 //
 #include "LogitComparer.hpp"
+#include "VecMath.hpp"
+
+#include <astl/throw_stdex.hpp>
+
+#include <algorithm>
 #include <cmath>
 #include <cassert>
-namespace {
-std::unordered_map<int32_t, float> softmax(const ac::llama::TokenDataVector& data) {
-    std::unordered_map<int32_t, float> result(data.size());
+#include <thread>
 
-    // Step 1: Find max logit to subtract for numerical stability
-    float maxLogit = data[0].logit;
+namespace ac::llama {
 
-    // Step 2: Compute exp(logit - maxLogit) for each element
-    float sumExp = 0.0f;
+namespace {
+// per-thread scratch buffers
+// comparisons don't allocate once these have grown to the size of the compared data
+struct Workspace {
+    std::vector<float> values1, values2; // logits or probabilities in input order
+    std::vector<uint32_t> order2; // indices of the second data sorted by token
+    std::vector<float> matched1, matched2; // values for the tokens found in both
+    std::vector<float> found; // 1 if the token of the first data was found in the second, 0 otherwise
+};
+
+thread_local Workspace t_ws;
+
+void gatherLogits(const TokenDataVector& data, std::vector<float>& out) {
+    out.resize(data.size());
     for (size_t i = 0; i < data.size(); ++i) {
-        float p = std::exp(data[i].logit - maxLogit);
-        result[data[i].token] = p;
-        sumExp += p;
+        out[i] = data[i].logit;
     }
+}
 
-    // Step 3: Normalize to get probabilities
-    for (auto& val : result) {
-        val.second /= sumExp;
+void sortByToken(const TokenDataVector& data, std::vector<uint32_t>& order) {
+    order.resize(data.size());
+    for (uint32_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
     }
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return data[a].token < data[b].token;
+    });
+}
 
-    return result;
+// index in data of token or -1 if not found
+int64_t findToken(const TokenDataVector& data, const std::vector<uint32_t>& order, Token token) {
+    auto it = std::lower_bound(order.begin(), order.end(), token, [&](uint32_t i, Token t) {
+        return data[i].token < t;
+    });
+    if (it == order.end() || data[*it].token != token) return -1;
+    return *it;
 }
+
+// Jensen-Shannon divergence of the matched probabilities
+// both sides are measured against their average distribution
+float jsd(const float* p, const float* q, size_t n) {
+    constexpr auto Lanes = vec::Lanes;
+    float acc[Lanes] = {};
+
+    auto term = [](float p, float q) {
+        const float m = (p + q) * 0.5f;
+        const float tp = p > 0.f ? p * vec::log(p / m) : 0.f;
+        const float tq = q > 0.f ? q * vec::log(q / m) : 0.f;
+        return tp + tq;
+    };
+
+    size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes) {
+        for (size_t l = 0; l < Lanes; ++l) {
+            acc[l] += term(p[i + l], q[i + l]);
+        }
+    }
+    float ret = 0;
+    for (; i < n; ++i) {
+        ret += term(p[i], q[i]);
+    }
+    for (auto a : acc) ret += a;
+
+    return ret / 2.f;
 }
+} // namespace
 
-namespace ac::llama {
 // We apply 3 step comparison
 // 1. Compare the euclidean distance of the logits
 //  - If the distance is less than 2% of the max distance, we consider them equal
@@ -38,8 +89,18 @@ namespace ac::llama {
 //  - If the divergence is less than the treshold, we consider them equal
 bool LogitComparer::compare(const TokenDataVector& data1, const TokenDataVector& data2) {
     const auto minSize = std::min(data1.size(), data2.size());
-    float distance1 = euclidean_distance_sq({data1.data(), minSize});
-    float distance2 = euclidean_distance_sq({data2.data(), minSize});
+    if (minSize == 0) {
+        return data1.size() == data2.size();
+    }
+
+    auto& ws = t_ws;
+    gatherLogits(data1, ws.values1);
+    gatherLogits(data2, ws.values2);
+
+    // To achieve the total euclidean distance, we need to take the square root of the sums,
+    // but since we don't need it to be accurate, we can skip it
+    float distance1 = vec::sumSquares(ws.values1.data(), minSize);
+    float distance2 = vec::sumSquares(ws.values2.data(), minSize);
 
     float relative_threshold = 0.02f; // 2% difference allowed
     float res = std::fabs(distance1 - distance2) / std::max(distance1, distance2);
@@ -47,81 +108,127 @@ bool LogitComparer::compare(const TokenDataVector& data1, const TokenDataVector&
         return false;
     }
 
-    auto prob_map = softmax(data1);
-    auto prob_map2 = softmax(data2);
+    vec::softmax(ws.values1.data(), ws.values1.size());
+    vec::softmax(ws.values2.data(), ws.values2.size());
 
     // Check if at least 80% of the tokens are the same
-    float matchingTokens = 0;
-    for (const auto& p : data1) {
-        if (prob_map2.count(p.token)) {
-            matchingTokens++;
-        }
+    sortByToken(data2, ws.order2);
+    ws.matched1.clear();
+    ws.matched2.clear();
+    for (size_t i = 0; i < data1.size(); ++i) {
+        auto j = findToken(data2, ws.order2, data1[i].token);
+        if (j < 0) continue;
+        ws.matched1.push_back(ws.values1[i]);
+        ws.matched2.push_back(ws.values2[j]);
     }
 
-    float matchingPercentage = matchingTokens / minSize;
+    float matchingPercentage = float(ws.matched1.size()) / minSize;
     if (matchingPercentage < 0.8f) {
         return false;
     }
 
-    return jsd(prob_map, prob_map2) < 0.01f; // 1% divergence allowed
+    return jsd(ws.matched1.data(), ws.matched2.data(), ws.matched1.size()) < 0.01f; // 1% divergence allowed
 }
 
 float LogitComparer::logitSimilarity(const TokenDataVector& data1, const TokenDataVector& data2) {
     assert(data1.size() == data2.size());
-    std::unordered_map<int32_t, float> l_map, l2_map;
 
-    for (const auto& t : data1) l_map[t.token] = t.logit;
-    for (const auto& t : data2) l2_map[t.token] = t.logit;
+    auto& ws = t_ws;
+    gatherLogits(data1, ws.values1);
+    sortByToken(data2, ws.order2);
+
+    // logits of data2 aligned to data1
+    ws.values2.resize(data1.size());
+    ws.found.resize(data1.size());
+    for (size_t i = 0; i < data1.size(); ++i) {
+        auto j = findToken(data2, ws.order2, data1[i].token);
+        ws.values2[i] = j < 0 ? 0.f : data2[j].logit;
+        ws.found[i] = j < 0 ? 0.f : 1.f;
+    }
 
-    float weightedSimSum = 0.0f;
-    float totalWeight = 0.0f;
-    for (auto& t : data1) {
-        float weight = t.logit;
-        float sim = 0.0f;
-        if (l2_map.count(t.token)) {
-            sim = 1 - (std::abs(t.logit - l2_map[t.token]) / std::max(t.logit, l2_map[t.token]));
+    constexpr auto Lanes = vec::Lanes;
+    float simAcc[Lanes] = {};
+    float weightAcc[Lanes] = {};
+
+    auto weightedSim = [](float l1, float l2, float found) {
+        // the logit itself is the weight
+        return found > 0.f ? l1 * (1 - (std::fabs(l1 - l2) / std::max(l1, l2))) : 0.f;
+    };
+
+    const auto n = data1.size();
+    const float* l1 = ws.values1.data();
+    const float* l2 = ws.values2.data();
+    const float* found = ws.found.data();
+
+    size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes) {
+        for (size_t l = 0; l < Lanes; ++l) {
+            simAcc[l] += weightedSim(l1[i + l], l2[i + l], found[i + l]);
+            weightAcc[l] += l1[i + l];
         }
+    }
 
-        weightedSimSum += weight * sim;
-        totalWeight += weight;
+    float weightedSimSum = 0.0f;
+    float totalWeight = 0.0f;
+    for (; i < n; ++i) {
+        weightedSimSum += weightedSim(l1[i], l2[i], found[i]);
+        totalWeight += l1[i];
+    }
+    for (size_t l = 0; l < Lanes; ++l) {
+        weightedSimSum += simAcc[l];
+        totalWeight += weightAcc[l];
     }
 
     return totalWeight > 0.0f ? (weightedSimSum / totalWeight) : 0.0f;
 }
 
-float LogitComparer::jsd(const std::unordered_map<Token, float>& probs1, const std::unordered_map<Token, float>& probs2) {
-    std::unordered_map<Token, float> avg_dist;
-    for (const auto& [token, p] : probs1) {
-        if (probs2.count(token)) {
-            avg_dist[token] = (p + probs2.at(token)) / 2.0f;
-        }
+std::vector<LogitComparer::StepResult> LogitComparer::compareTraces(
+    std::span<const TokenDataVector> trace1,
+    std::span<const TokenDataVector> trace2,
+    unsigned numThreads
+) {
+    if (trace1.size() != trace2.size()) {
+        throw_ex{} << "LogitComparer: traces have different lengths: " << trace1.size() << " vs " << trace2.size();
     }
 
-    auto kl_divergence = [](const std::unordered_map<Token, float>& P, const std::unordered_map<Token, float>& Q) {
-        float kl = 0.0f;
-        for (const auto& [token, p] : P) {
-            if (p > 0.0f && Q.count(token) && Q.at(token) > 0.0f) {
-                kl += p * std::log(p / Q.at(token));
-            }
+    std::vector<StepResult> ret(trace1.size());
+
+    auto run = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            ret[i] = {
+                .equal = compare(trace1[i], trace2[i]),
+                .similarity = logitSimilarity(trace1[i], trace2[i]),
+            };
         }
-        return kl;
     };
 
-    auto div1 = kl_divergence(probs1, avg_dist);
-    auto div2 = kl_divergence(probs2, avg_dist);
+    // don't bother spawning threads for a handful of steps
+    constexpr size_t minStepsPerThread = 16;
 
-    return (div1 + div2) / 2.0f;
-}
+    if (numThreads == 0) {
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    const size_t numChunks = std::min(size_t(numThreads), (ret.size() + minStepsPerThread - 1) / minStepsPerThread);
 
-float LogitComparer::euclidean_distance_sq(std::span<const TokenData> tokens) {
-    float distance = 0.0f;
-    for (auto& t : tokens) {
-        distance += t.logit * t.logit;
+    if (numChunks <= 1) {
+        run(0, ret.size());
+        return ret;
     }
 
-    // To achieve total result, we need to take the square root of the sum,
-    // but since we don't need it to be accurate, we can skip it
-    return distance;
+    const size_t chunkSize = (ret.size() + numChunks - 1) / numChunks;
+
+    std::vector<std::thread> threads;
+    threads.reserve(numChunks - 1);
+    for (size_t c = 1; c < numChunks; ++c) {
+        threads.emplace_back(run, c * chunkSize, std::min(ret.size(), (c + 1) * chunkSize));
+    }
+    run(0, chunkSize);
+
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    return ret;
 }
 
 }
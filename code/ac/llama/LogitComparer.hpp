@@ -2,20 +2,31 @@
 // SPDX-License-Identifier: MIT
 //
 #pragma once
+#include "export.h"
 #include "Token.hpp"
-#include <unordered_map>
 #include <span>
+#include <vector>
 
 namespace ac::llama {
 
-class LogitComparer {
+class AC_LLAMA_EXPORT LogitComparer {
 public:
     static bool compare(const TokenDataVector& data1, const TokenDataVector& data2);
 
     static float logitSimilarity(const TokenDataVector& data1, const TokenDataVector& data2);
 
-private:
-    static float jsd(const std::unordered_map<Token, float>& logits1, const std::unordered_map<Token, float>& logits2);
-    static float euclidean_distance_sq(std::span<const TokenData> tokens);
+    struct StepResult {
+        bool equal; // result of compare
+        float similarity; // result of logitSimilarity
+    };
+
+    // compare two generation traces step by step
+    // the steps are split among numThreads threads (0 = hardware concurrency)
+    // the traces must be of equal length
+    static std::vector<StepResult> compareTraces(
+        std::span<const TokenDataVector> trace1,
+        std::span<const TokenDataVector> trace2,
+        unsigned numThreads = 0
+    );
 };
 }
@@ -2,6 +2,8 @@
 // SPDX-License-Identifier: MIT
 //
 #include "Model.hpp"
+#include "TokenTrie.hpp"
+#include "TokenClasses.hpp"
 #include "Logging.hpp"
 #include <llama.h>
 #include <astl/move.hpp>
@@ -63,6 +65,20 @@ bool Model::shouldAddBosToken() const noexcept {
     return llama_vocab_get_add_bos(m_vocab.lvocab());
 }
 
+const TokenTrie& Model::tokenTrie() const {
+    std::call_once(m_tokenTrieOnce, [this] {
+        m_tokenTrie = std::make_unique<TokenTrie>(m_vocab);
+    });
+    return *m_tokenTrie;
+}
+
+const TokenClasses& Model::tokenClasses() const {
+    std::call_once(m_tokenClassesOnce, [this] {
+        m_tokenClasses = std::make_unique<TokenClasses>(m_vocab);
+    });
+    return *m_tokenClasses;
+}
+
 bool Model::hasEncoder() const noexcept {
     return llama_model_has_encoder(m_lmodel.get());
 }
@@ -4,11 +4,14 @@
 #pragma once
 #include "export.h"
 #include "Vocab.hpp"
+#include "GrammarCache.hpp"
 
 #include <astl/mem_ext.hpp>
 #include <astl/ufunction.hpp>
 
 #include <algorithm>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <span>
 #include <vector>
@@ -18,6 +21,8 @@ struct llama_model;
 namespace ac::llama {
 class Job;
 class LoraAdapter;
+class TokenTrie;
+class TokenClasses;
 
 using ModelLoadProgressCb = astl::ufunction<void(float)>;
 
@@ -29,6 +34,7 @@ public:
         bool gpu = true; // try to load data on gpu
         bool vocabOnly = false; // do not load model, only vocab
         bool prefixInputsWithBos = false; // add bos token to interactive inputs (#13)
+        size_t tokenizeCacheSize = 0; // budget in bytes of the tokenization cache (0 disables it, see Vocab)
 
         bool operator==(const Params& other) const noexcept = default;
     };
@@ -50,11 +56,29 @@ public:
     const llama_model* lmodel() const noexcept { return m_lmodel.get(); }
 
     const Vocab& vocab() const noexcept { return m_vocab; }
+
+    // parsed grammars shared by the samplers of all instances of this model
+    GrammarCache& grammarCache() noexcept { return m_grammarCache; }
+
+    // trie of the token pieces
+    // built on first use, as it's only needed for constrained sampling
+    const TokenTrie& tokenTrie() const;
+
+    // classes of the tokens (see TokenClasses)
+    // built on first use, as it's only needed for bans and biases by class
+    const TokenClasses& tokenClasses() const;
 private:
     const Params m_params;
     astl::c_unique_ptr<llama_model> m_lmodel;
 
     Vocab m_vocab{*this};
+    GrammarCache m_grammarCache{m_vocab};
+
+    mutable std::once_flag m_tokenTrieOnce;
+    mutable std::unique_ptr<TokenTrie> m_tokenTrie;
+
+    mutable std::once_flag m_tokenClassesOnce;
+    mutable std::unique_ptr<TokenClasses> m_tokenClasses;
 };
 
 } // namespace ac::llama
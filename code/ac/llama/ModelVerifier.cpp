@@ -0,0 +1,72 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include "ModelVerifier.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+namespace ac::llama {
+
+namespace {
+// nearest-rank percentile, reorders the values
+float percentile(std::vector<float>& values, double p) {
+    if (values.empty()) return 0;
+    auto n = std::min(values.size() - 1, size_t(p * double(values.size())));
+    std::nth_element(values.begin(), values.begin() + n, values.end());
+    return values[n];
+}
+} // namespace
+
+std::string ModelVerifier::Report::summary() const {
+    std::ostringstream out;
+    out << "tokens: " << totals.numTokens << "\n"
+        << "perplexity: " << totals.perplexity() << " (reference: " << totals.referencePerplexity() << ")\n"
+        << "KL divergence: mean " << totals.klMean() << ", median " << klMedian
+        << ", p99 " << klP99 << ", max " << totals.klMax << "\n"
+        << "JS divergence: mean " << totals.jsdMean() << ", p99 " << jsdP99 << ", max " << totals.jsdMax << "\n"
+        << "top-1 agreement: " << totals.top1Agreement() * 100 << "%\n"
+        << "result: " << (passed ? "PASSED" : "FAILED") << "\n";
+    return out.str();
+}
+
+ModelVerifier::ModelVerifier(Instance& target, Instance& reference, Params params)
+    : m_params(params)
+    , m_evaluator(target, reference, params.eval)
+{}
+
+Evaluator::TokenCb ModelVerifier::collector() {
+    m_kl.clear();
+    m_jsd.clear();
+    return [this](const Evaluator::TokenStats& ts) {
+        m_kl.push_back(ts.kl);
+        m_jsd.push_back(ts.jsd);
+    };
+}
+
+ModelVerifier::Report ModelVerifier::verify(std::span<const Token> tokens, ProgressCb cb) {
+    auto totals = m_evaluator.evaluate(tokens, std::move(cb), collector());
+    return makeReport(totals);
+}
+
+ModelVerifier::Report ModelVerifier::verifyFile(const std::string& path, ProgressCb cb) {
+    auto totals = m_evaluator.evaluateFile(path, std::move(cb), collector());
+    return makeReport(totals);
+}
+
+ModelVerifier::Report ModelVerifier::makeReport(const Evaluator::Result& totals) {
+    Report ret;
+    ret.totals = totals;
+    ret.klMedian = percentile(m_kl, 0.5);
+    ret.klP99 = percentile(m_kl, 0.99);
+    ret.jsdP99 = percentile(m_jsd, 0.99);
+
+    ret.passed = totals.numTokens > 0
+        && totals.klMean() <= m_params.maxKlMean
+        && ret.klP99 <= m_params.maxKlP99
+        && totals.top1Agreement() >= m_params.minTop1Agreement;
+
+    return ret;
+}
+
+} // namespace ac::llama
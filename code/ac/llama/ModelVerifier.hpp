@@ -0,0 +1,64 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "export.h"
+#include "Evaluator.hpp"
+
+#include <string>
+#include <vector>
+
+namespace ac::llama {
+class Instance;
+
+// Checks whether a model is equivalent to a reference (for example a quantization of it)
+//
+// Both models are teacher-forced over the same token sequence with an Evaluator and the per-token divergences
+// are checked against thresholds. This is much faster than generating with each model and comparing the
+// sampled logits step by step, as all positions are decoded in large parallel batches.
+class AC_LLAMA_EXPORT ModelVerifier {
+public:
+    struct Params {
+        Evaluator::Params eval;
+
+        // thresholds for passing the verification
+        float maxKlMean = 0.05f;
+        float maxKlP99 = 0.5f;
+        float minTop1Agreement = 0.9f;
+    };
+
+    struct Report {
+        Evaluator::Result totals;
+
+        float klMedian = 0;
+        float klP99 = 0; // 99th percentile of the per-token KL divergence
+        float jsdP99 = 0;
+
+        bool passed = false;
+
+        // human readable multi-line summary
+        std::string summary() const;
+    };
+
+    using ProgressCb = Evaluator::ProgressCb;
+
+    ModelVerifier(Instance& target, Instance& reference, Params params);
+
+    Report verify(std::span<const Token> tokens, ProgressCb cb = {});
+    Report verifyFile(const std::string& path, ProgressCb cb = {});
+
+    const Params& params() const noexcept { return m_params; }
+
+private:
+    Evaluator::TokenCb collector();
+    Report makeReport(const Evaluator::Result& totals);
+
+    Params m_params;
+    Evaluator m_evaluator;
+
+    // per token divergences of the current verification
+    std::vector<float> m_kl;
+    std::vector<float> m_jsd;
+};
+
+} // namespace ac::llama
@@ -3,21 +3,999 @@
 //
 #include "Sampler.hpp"
 #include "Model.hpp"
+#include "TokenTrie.hpp"
+#include "DryPenalty.hpp"
+#include "VecMath.hpp"
 #include <llama.h>
 #include <astl/move.hpp>
 #include <astl/iile.h>
+#include <astl/throw_stdex.hpp>
 #include <span>
 #include <cmath>
 #include <cstddef>
+#include <random>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <limits>
+#include <optional>
+#include <string_view>
 
 namespace ac::llama {
 
-Sampler::Sampler(Model& model, const Params& params)
-    : m_grammarSampler(llama_sampler_init_grammar(llama_model_get_vocab(model.lmodel()), params.grammar.c_str(), "root"), llama_sampler_free)
-    , m_samplerChain(llama_sampler_chain_init({ .no_perf = false }), llama_sampler_free)
+namespace {
+bool byLogitDesc(const llama_token_data& a, const llama_token_data& b) {
+    return a.logit > b.logit;
+}
+
+// append the n entries with the highest values in x to out (unordered)
+// n must be less than size
+//
+// A running threshold (the lowest of the best n so far) is kept and the input is checked in blocks. Most blocks
+// have no values above it, which we check with a vectorized compare, so the values are copied out very rarely.
+void selectTop(const float* x, int32_t size, size_t n, std::vector<llama_token_data>& out) {
+    const auto begin = out.size();
+    for (int32_t i = 0; i < int32_t(n); ++i) {
+        out.push_back({i, x[i], 0.f});
+    }
+
+    float threshold = std::min_element(out.begin() + begin, out.end(), [](auto& a, auto& b) {
+        return a.logit < b.logit;
+    })->logit;
+
+    // once this many are collected, we drop the ones outside of the best n and raise the threshold
+    // compacting often keeps the threshold close to the final one, so fewer blocks need to be scanned
+    const size_t cap = begin + std::max(n * 2, size_t(64));
+
+    auto compact = [&] {
+        std::nth_element(out.begin() + begin, out.begin() + begin + n - 1, out.end(), [](auto& a, auto& b) {
+            return a.logit > b.logit;
+        });
+        out.resize(begin + n);
+        threshold = out.back().logit;
+    };
+
+    auto scan = [&](int32_t from, int32_t to) {
+        for (int32_t j = from; j < to; ++j) {
+            if (x[j] > threshold) {
+                out.push_back({j, x[j], 0.f});
+            }
+        }
+        if (out.size() >= cap) {
+            compact();
+        }
+    };
+
+    // check blocks and then their lane-sized parts, so that only the latter are scanned element by element
+    constexpr int32_t Block = 64;
+    constexpr int32_t Lanes = int32_t(vec::Lanes);
+    int32_t i = int32_t(n);
+    for (; i + Block <= size; i += Block) {
+        if (!vec::anyGreater(x + i, Block, threshold)) continue;
+        for (int32_t j = i; j < i + Block; j += Lanes) {
+            if (vec::anyGreater(x + j, Lanes, threshold)) {
+                scan(j, j + Lanes);
+            }
+        }
+    }
+    scan(i, size);
+
+    if (out.size() > begin + n) {
+        compact();
+    }
+}
+
+// the following implement the same semantics as the equivalent llama.cpp samplers
+// on candidates which have been pre-selected by top-k, or on all of them
+//
+// Sorting a few dozen candidates is cheap, but sorting the entire vocabulary (which the llama.cpp samplers do when
+// there is no top-k) costs more than the rest of sampling combined. Larger candidate sets are not sorted by the
+// stages: top-p and typical-p find the cut with a radix selection instead (see radixCut) and the final choice is
+// made among the candidates in any order. The selected sets and the distributions are the same, but the order of
+// the candidates (and so the token drawn for a given seed) is not the one of llama.cpp.
+
+// unsorted candidate sets larger than this are not sorted by the stages
+constexpr size_t SortFreeAbove = 1024;
+
+bool sortFree(const llama_token_data_array& cur) {
+    return !cur.sorted && cur.size > SortFreeAbove;
+}
+
+// buffers of the sort-free stages
+// kept by the caller so as to avoid reallocation on every sample call
+struct SelectBuffers {
+    std::vector<float> probs;
+    std::vector<uint32_t> keys;
+    std::vector<uint32_t> bucket;
+};
+
+// set the probabilities of the candidates without reordering them
+// the candidates must have finite logits
+// the exps are computed on a contiguous copy of the logits, so that they are vectorized
+void probabilities(llama_token_data_array& cur, std::vector<float>& probs) {
+    probs.resize(cur.size);
+    for (size_t i = 0; i < cur.size; ++i) {
+        probs[i] = cur.data[i].logit;
+    }
+    vec::softmax(probs.data(), probs.size());
+    for (size_t i = 0; i < cur.size; ++i) {
+        cur.data[i].p = probs[i];
+    }
+}
+
+// key of a float which preserves the order: a < b <=> floatKey(a) < floatKey(b)
+uint32_t floatKey(float f) {
+    const auto bits = std::bit_cast<uint32_t>(f);
+    return bits & 0x8000'0000u ? ~bits : bits | 0x8000'0000u;
+}
+
+// the last candidate to keep when they're taken in the order of their keys
+struct Cut {
+    uint32_t key;
+    size_t ties; // number of the candidates with this key to keep
+};
+
+// Find where to cut the candidates, if they are taken in ascending order of their keys until their total
+// probability reaches p (exceeds it if strict) and there are at least minKeep of them.
+//
+// Instead of sorting, the probability mass is collected in a histogram of the top 11 bits of the keys. Walking it
+// tells which bucket has the cut, and everything before it is kept. Only the candidates in this bucket are refined
+// by the next bits, and so on, until few enough are left to sort. This makes a pass over all candidates and a few
+// over small subsets of them.
+//
+// Returns nothing if the candidates never reach p, in which case all are kept.
+std::optional<Cut> radixCut(const llama_token_data_array& cur, const std::vector<uint32_t>& keys, float p,
+    bool strict, size_t minKeep, std::vector<uint32_t>& bucket)
 {
-    auto lmodel = model.lmodel();
-    auto chain = m_samplerChain.get();
+    constexpr uint32_t Shifts[] = {21, 10, 0};
+    constexpr uint32_t Masks[] = {0x7ff, 0x7ff, 0x3ff};
+    constexpr size_t SmallBucket = 64;
+
+    double mass = 0; // of the candidates before the current bucket
+    size_t count = 0;
+    auto reached = [&](double m, size_t n) {
+        return (strict ? m > p : m >= p) && n >= minKeep;
+    };
+
+    std::array<double, 2048> bucketMass;
+    std::array<uint32_t, 2048> bucketCount;
+
+    bool all = true; // the current bucket is everything
+    for (size_t level = 0; level < std::size(Shifts); ++level) {
+        const auto shift = Shifts[level];
+        const auto mask = Masks[level];
+        auto bucketOf = [&](uint32_t i) { return (keys[i] >> shift) & mask; };
+
+        std::fill_n(bucketMass.begin(), mask + 1, 0.);
+        std::fill_n(bucketCount.begin(), mask + 1, 0);
+        auto add = [&](uint32_t i) {
+            const auto b = bucketOf(i);
+            bucketMass[b] += cur.data[i].p;
+            ++bucketCount[b];
+        };
+        if (all) {
+            for (uint32_t i = 0; i < cur.size; ++i) add(i);
+        }
+        else {
+            for (auto i : bucket) add(i);
+        }
+
+        uint32_t b = 0;
+        for (; b <= mask; ++b) {
+            if (!bucketCount[b]) continue;
+            if (reached(mass + bucketMass[b], count + bucketCount[b])) break;
+            mass += bucketMass[b];
+            count += bucketCount[b];
+        }
+        if (b > mask) return {};
+
+        if (all) {
+            bucket.clear();
+            for (uint32_t i = 0; i < cur.size; ++i) {
+                if (bucketOf(i) == b) bucket.push_back(i);
+            }
+            all = false;
+        }
+        else {
+            bucket.erase(std::remove_if(bucket.begin(), bucket.end(), [&](uint32_t i) {
+                return bucketOf(i) != b;
+            }), bucket.end());
+        }
+
+        if (bucket.size() <= SmallBucket) break;
+    }
+
+    // the rest is small (or has equal keys)
+    std::sort(bucket.begin(), bucket.end(), [&](uint32_t a, uint32_t b) {
+        return keys[a] != keys[b] ? keys[a] < keys[b] : a < b;
+    });
+    for (size_t j = 0; j < bucket.size(); ++j) {
+        mass += cur.data[bucket[j]].p;
+        ++count;
+        if (reached(mass, count)) {
+            const auto key = keys[bucket[j]];
+            const auto ties = size_t(std::count_if(bucket.begin(), bucket.begin() + j + 1, [&](uint32_t i) {
+                return keys[i] == key;
+            }));
+            return Cut{key, ties};
+        }
+    }
+
+    // rounding
+    return {};
+}
+
+// keep the candidates before the cut, preserving their order
+void keepCut(llama_token_data_array& cur, const std::vector<uint32_t>& keys, Cut cut) {
+    size_t n = 0;
+    for (size_t i = 0; i < cur.size; ++i) {
+        const auto key = keys[i];
+        if (key < cut.key || (key == cut.key && cut.ties && cut.ties--)) {
+            cur.data[n++] = cur.data[i];
+        }
+    }
+    cur.size = n;
+}
+
+// drop the candidates which can't be chosen (masked by the grammar), preserving the order of the rest
+void dropImpossible(llama_token_data_array& cur) {
+    cur.size = size_t(std::remove_if(cur.data, cur.data + cur.size, [](auto& c) {
+        return c.logit == -INFINITY;
+    }) - cur.data);
+}
+
+void softmax(llama_token_data_array& cur) {
+    if (!cur.sorted) {
+        std::sort(cur.data, cur.data + cur.size, byLogitDesc);
+        cur.sorted = true;
+    }
+
+    const float maxLogit = cur.data[0].logit;
+    float sum = 0.f;
+    for (size_t i = 0; i < cur.size; ++i) {
+        const float p = std::exp(cur.data[i].logit - maxLogit);
+        cur.data[i].p = p;
+        sum += p;
+    }
+    for (size_t i = 0; i < cur.size; ++i) {
+        cur.data[i].p /= sum;
+    }
+}
+
+void topP(llama_token_data_array& cur, float p, size_t minKeep, SelectBuffers& buf) {
+    if (sortFree(cur)) {
+        // descending order of the logits
+        probabilities(cur, buf.probs);
+        buf.keys.resize(cur.size);
+        for (size_t i = 0; i < cur.size; ++i) {
+            buf.keys[i] = ~floatKey(cur.data[i].logit);
+        }
+        if (auto cut = radixCut(cur, buf.keys, p, false, minKeep, buf.bucket)) {
+            keepCut(cur, buf.keys, *cut);
+        }
+        return;
+    }
+
+    softmax(cur);
+
+    float cumSum = 0.f;
+    for (size_t i = 0; i < cur.size; ++i) {
+        cumSum += cur.data[i].p;
+        if (cumSum >= p && i + 1 >= minKeep) {
+            cur.size = i + 1;
+            break;
+        }
+    }
+}
+
+void minP(llama_token_data_array& cur, float p, size_t minKeep) {
+    // keep the tokens whose probability is at least p times the max probability
+    // the order of the candidates is preserved
+    const float maxLogit = std::max_element(cur.data, cur.data + cur.size, [](auto& a, auto& b) {
+        return a.logit < b.logit;
+    })->logit;
+    const float minLogit = maxLogit + std::log(p);
+
+    auto kept = size_t(std::count_if(cur.data, cur.data + cur.size, [&](auto& c) {
+        return c.logit >= minLogit;
+    }));
+    if (kept < minKeep) {
+        std::sort(cur.data, cur.data + cur.size, byLogitDesc);
+        cur.sorted = true;
+        cur.size = std::min(minKeep, cur.size);
+        return;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < cur.size; ++i) {
+        if (cur.data[i].logit >= minLogit) {
+            cur.data[n++] = cur.data[i];
+        }
+    }
+    cur.size = n;
+}
+
+void typicalP(llama_token_data_array& cur, float p, size_t minKeep, std::vector<llama_token_data>& scratch,
+    SelectBuffers& buf)
+{
+    if (sortFree(cur)) {
+        probabilities(cur, buf.probs);
+
+        float entropy = 0.f;
+        for (auto prob : buf.probs) {
+            entropy -= prob * vec::log(prob);
+        }
+
+        // ascending order of the distance of the information content from the entropy
+        buf.keys.resize(cur.size);
+        for (size_t i = 0; i < cur.size; ++i) {
+            buf.keys[i] = floatKey(std::fabs(-vec::log(buf.probs[i]) - entropy));
+        }
+        if (auto cut = radixCut(cur, buf.keys, p, true, minKeep, buf.bucket)) {
+            keepCut(cur, buf.keys, *cut);
+        }
+        return;
+    }
+
+    softmax(cur);
+
+    float entropy = 0.f;
+    for (size_t i = 0; i < cur.size; ++i) {
+        entropy += -cur.data[i].p * std::log(cur.data[i].p);
+    }
+
+    // order by the distance of the information content from the entropy
+    // (kept in the p field of the scratch buffer, while the candidates keep their probabilities)
+    scratch.resize(cur.size);
+    for (size_t i = 0; i < cur.size; ++i) {
+        scratch[i] = {int32_t(i), 0.f, std::fabs(-std::log(cur.data[i].p) - entropy)};
+    }
+    std::sort(scratch.begin(), scratch.end(), [](auto& a, auto& b) {
+        return a.p < b.p;
+    });
+
+    size_t last = scratch.size();
+    float cumSum = 0.f;
+    for (size_t i = 0; i < scratch.size(); ++i) {
+        cumSum += cur.data[scratch[i].id].p;
+        if (cumSum > p && (minKeep == 0 || i >= minKeep - 1)) {
+            last = i + 1;
+            break;
+        }
+    }
+
+    scratch.resize(last);
+    for (auto& s : scratch) {
+        s = cur.data[s.id];
+    }
+    std::copy(scratch.begin(), scratch.end(), cur.data);
+    cur.size = last;
+    cur.sorted = false;
+}
+
+void temperature(llama_token_data_array& cur, float temp, float range, float exponent, SelectBuffers& buf) {
+    if (range > 0) {
+        // dynamic temperature based on the entropy of the candidates
+        if (cur.size <= 1) return;
+
+        const float minTemp = std::max(0.f, temp - range);
+        const float maxTemp = temp + range;
+        const float maxEntropy = -std::log(1.f / float(cur.size));
+
+        if (sortFree(cur)) {
+            probabilities(cur, buf.probs);
+        }
+        else {
+            softmax(cur);
+        }
+
+        float entropy = 0.f;
+        for (size_t i = 0; i < cur.size; ++i) {
+            const float p = cur.data[i].p;
+            if (p > 0.f) {
+                entropy -= p * std::log(p);
+            }
+        }
+
+        const float dynTemp = minTemp + (maxTemp - minTemp) * std::pow(entropy / maxEntropy, exponent);
+        for (size_t i = 0; i < cur.size; ++i) {
+            cur.data[i].logit /= dynTemp;
+        }
+        if (!sortFree(cur)) {
+            softmax(cur);
+        }
+        return;
+    }
+
+    if (temp <= 0) {
+        // greedy: only the best candidate remains possible
+        auto best = std::max_element(cur.data, cur.data + cur.size, [](auto& a, auto& b) {
+            return a.logit < b.logit;
+        });
+        for (size_t i = 0; i < cur.size; ++i) {
+            if (cur.data + i != best) {
+                cur.data[i].logit = -INFINITY;
+            }
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < cur.size; ++i) {
+        cur.data[i].logit /= temp;
+    }
+}
+
+size_t countFinite(const llama_token_data* data, size_t size) {
+    return size_t(std::count_if(data, data + size, [](auto& c) { return c.logit != -INFINITY; }));
+}
+
+// metrics of a single call of a stage of sampling
+// does nothing if there are no metrics to collect
+// the time can be collected in several parts, so that nested stages are not counted twice
+class StageProbe {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    StageProbe(Sampler::Metrics* metrics, std::string_view name)
+        : m_metrics(metrics)
+    {
+        if (!m_metrics) return;
+        auto& stages = m_metrics->stages;
+        auto it = std::find_if(stages.begin(), stages.end(), [&](auto& s) { return s.name == name; });
+        m_index = size_t(it - stages.begin());
+        if (it == stages.end()) {
+            stages.push_back({.name = std::string(name)});
+        }
+        ++stage().calls;
+    }
+
+    template <typename Count>
+    void in(Count&& count) {
+        if (m_metrics) stage().candidatesIn += count();
+    }
+
+    template <typename Count>
+    void out(Count&& count) {
+        if (m_metrics) stage().candidatesOut += count();
+    }
+
+    void start() {
+        if (m_metrics) m_start = Clock::now();
+    }
+
+    void stop() {
+        if (m_metrics) stage().timeNs += uint64_t(std::chrono::nanoseconds(Clock::now() - m_start).count());
+    }
+
+private:
+    // stages nested in this one can add stages to the vector, so we keep an index and not a pointer
+    Sampler::StageMetrics& stage() { return m_metrics->stages[m_index]; }
+
+    Sampler::Metrics* m_metrics = nullptr;
+    size_t m_index = 0;
+    Clock::time_point m_start;
+};
+
+// apply a stage to the candidates with metrics
+template <typename Stage>
+void profileStage(Sampler::Metrics* metrics, std::string_view name, llama_token_data_array& cur, Stage&& stage) {
+    StageProbe probe(metrics, name);
+    probe.in([&] { return countFinite(cur.data, cur.size); });
+    probe.start();
+    stage();
+    probe.stop();
+    probe.out([&] { return countFinite(cur.data, cur.size); });
+}
+} // namespace
+
+// Fast path for sampler sequences of typical-p, top-p, min-p and temperature, optionally preceded by top-k
+// (this includes the default one)
+//
+// The general path builds a vocab-sized candidate array for every sampled token and each sampler in the chain
+// does at least one pass over it. Here the top-k candidates are instead selected in a single pass over the
+// raw logits. The logit bias and the repetition penalties only affect a handful of tokens, so their adjusted
+// logits are computed directly and merged with the selection. The remaining samplers only see the k
+// candidates and disabled ones are dropped at construction.
+//
+// With top-k the results are the same as the ones of the equivalent llama.cpp sampler chain. This includes the
+// tokens picked for a given seed, since the final choice uses the same generator and std::discrete_distribution
+// as llama.cpp's dist sampler (which makes it depend on the standard library, like llama.cpp itself). Without
+// top-k, all tokens are candidates and the stages don't sort them (see SortFreeAbove), so only the distributions
+// are the same.
+class Sampler::FusedChain {
+public:
+    static bool supports(const Params& params) {
+        auto& seq = params.samplerSequence;
+        if (params.mirostat.ver != 0 || seq.empty()) return false;
+        return std::all_of(seq.begin() + (seq.front() == SamplingType::Top_K), seq.end(), [](SamplingType t) {
+            return t == SamplingType::Typical_P
+                || t == SamplingType::Top_P
+                || t == SamplingType::Min_P
+                || t == SamplingType::Temperature;
+        });
+    }
+
+    FusedChain(int32_t nVocab, const Params& params)
+        : m_nVocab(nVocab)
+    {
+        setParams(params);
+    }
+
+    // reconfigure in place, keeping the buffers
+    // the state is reset
+    void setParams(const Params& params) {
+        m_params = params;
+        m_seed = params.rngSeed == LLAMA_DEFAULT_SEED ? std::random_device{}() : params.rngSeed;
+
+        // top-k is the selection itself (0 = all tokens)
+        const bool topK = params.samplerSequence.front() == SamplingType::Top_K && params.topK > 0;
+        m_topK = topK ? std::min(size_t(params.topK), size_t(m_nVocab)) : 0;
+
+        m_stages.clear();
+        for (auto type : params.samplerSequence) {
+            if (type == SamplingType::Top_K) continue;
+            if (type == SamplingType::Typical_P && params.typicalP >= 1) continue;
+            if (type == SamplingType::Top_P && params.topP >= 1) continue;
+            if (type == SamplingType::Min_P && params.minP <= 0) continue;
+            m_stages.push_back(type);
+        }
+
+        auto& pen = params.repetitionPenalty;
+        m_penalize = pen.numTokens > 0 && (pen.repeat != 1 || pen.freq != 0 || pen.present != 0);
+
+        reset();
+    }
+
+    // fill cur with the top-k candidates according to the adjusted logits, ordered by logit
+    // without top-k all tokens are candidates (unordered)
+    // if a grammar is provided, only the tokens which fit it are candidates
+    // dry are the DRY penalties (ordered by token)
+    void candidates(const float* logits, std::vector<llama_token_data>& cur, Sampler* grammar,
+        std::span<const TokenData> dry)
+    {
+        const auto nVocab = [this] { return size_t(m_nVocab); };
+        {
+            StageProbe penalties(m_metrics, "penalties");
+            penalties.in(nVocab);
+            penalties.start();
+            computeAdjusted(logits, dry);
+            penalties.stop();
+            penalties.out(nVocab);
+        }
+
+        const auto k = m_topK ? m_topK : size_t(m_nVocab);
+
+        // with a grammar we start with a wider selection in the hope that enough of it is valid
+        size_t width = grammar ? std::max(k * 4, size_t(256)) : k;
+
+        // the grammar is a stage of its own, so it's excluded from the time of the selection
+        StageProbe topK(m_metrics, m_topK ? "top-k" : "logits");
+        topK.in(nVocab);
+
+        while (true) {
+            topK.start();
+            gather(logits, cur, width);
+            topK.stop();
+
+            if (grammar) {
+                llama_token_data_array arr = {cur.data(), cur.size(), -1, false};
+                grammar->applyGrammar(arr);
+            }
+
+            topK.start();
+            const auto kk = std::min(k, cur.size());
+            if (m_topK) {
+                std::partial_sort(cur.begin(), cur.begin() + kk, cur.end(), byLogitDesc);
+            }
+            topK.stop();
+
+            // all tokens outside of the gathered ones have lower logits than the gathered unadjusted ones,
+            // so if k of them are valid, nothing outside can make it into the top k
+            if (!grammar || width >= size_t(m_nVocab) || validUnadjusted(cur) >= k) {
+                cur.resize(kk);
+                topK.out([&] { return countFinite(cur.data(), cur.size()); });
+                return;
+            }
+
+            width = size_t(m_nVocab);
+        }
+    }
+
+    // apply the remaining samplers to the candidates from `candidates` and sample
+    Token sample(std::vector<llama_token_data>& cur) {
+        llama_token_data_array arr = {cur.data(), cur.size(), -1, m_topK != 0};
+        const size_t minKeep = size_t(m_params.minKeep);
+
+        if (sortFree(arr)) {
+            dropImpossible(arr);
+        }
+
+        for (auto type : m_stages) {
+            switch (type) {
+            case SamplingType::Typical_P:
+                profileStage(m_metrics, "typical", arr, [&] { typicalP(arr, m_params.typicalP, minKeep, m_scratch, m_select); });
+                break;
+            case SamplingType::Top_P:
+                profileStage(m_metrics, "top-p", arr, [&] { topP(arr, m_params.topP, minKeep, m_select); });
+                break;
+            case SamplingType::Min_P:
+                profileStage(m_metrics, "min-p", arr, [&] { minP(arr, m_params.minP, minKeep); });
+                break;
+            case SamplingType::Temperature:
+                profileStage(m_metrics, "temp-ext", arr, [&] {
+                    temperature(arr, m_params.temp, m_params.tempRange, m_params.tempExp, m_select);
+                });
+                break;
+            default: break;
+            }
+        }
+
+        Token ret = Token_Invalid;
+        profileStage(m_metrics, "dist", arr, [&] {
+            if (sortFree(arr)) {
+                dropImpossible(arr);
+                if (arr.size == 0) {
+                    throw std::runtime_error("no possible token during sampling - check your sampling configuration");
+                }
+                probabilities(arr, m_select.probs);
+            }
+            else {
+                softmax(arr);
+            }
+
+            auto probs = [&](size_t i) { return double(arr.data[i].p); };
+            m_dist.param(std::discrete_distribution<int>::param_type(arr.size, 0, double(arr.size), [&](double x) {
+                return probs(size_t(x));
+            }));
+            ret = arr.data[m_dist(m_rng)].id;
+        });
+        return ret;
+    }
+
+    void setMetrics(Metrics* metrics) {
+        m_metrics = metrics;
+    }
+
+    void accept(Token id) {
+        if (!m_penalize) return;
+
+        const auto n = size_t(m_params.repetitionPenalty.numTokens);
+        ++m_counts[id];
+        if (m_history.size() < n) {
+            m_history.push_back(id);
+            return;
+        }
+
+        // ring buffer is full: replace the oldest token
+        auto& oldest = m_history[m_historyPos];
+        auto it = m_counts.find(oldest);
+        if (--it->second == 0) {
+            m_counts.erase(it);
+        }
+        oldest = id;
+        m_historyPos = (m_historyPos + 1) % n;
+    }
+
+    void reset() {
+        m_history.clear();
+        m_historyPos = 0;
+        m_counts.clear();
+        m_rng.seed(m_seed);
+    }
+
+private:
+    // tokens whose logits are changed by the bias or the penalties, with their new logits, ordered by token
+    void computeAdjusted(const float* logits, std::span<const TokenData> dry) {
+        m_adjusted.clear();
+
+        auto& bias = m_params.logitBias;
+        auto& pen = m_params.repetitionPenalty;
+
+        auto b = bias.begin();
+        auto c = m_counts.begin();
+        auto d = dry.begin();
+        while (b != bias.end() || c != m_counts.end() || d != dry.end()) {
+            Token token = std::numeric_limits<Token>::max();
+            if (b != bias.end()) token = std::min(token, b->first);
+            if (c != m_counts.end()) token = std::min(token, c->first);
+            if (d != dry.end()) token = std::min(token, d->token);
+
+            float logit = token >= 0 && token < m_nVocab ? logits[token] : -INFINITY;
+            if (b != bias.end() && b->first == token) {
+                logit += b->second;
+                ++b;
+            }
+            if (c != m_counts.end() && c->first == token) {
+                const float count = float(c->second);
+                logit = logit <= 0 ? logit * pen.repeat : logit / pen.repeat;
+                logit -= count * pen.freq + (count > 0 ? pen.present : 0.f);
+                ++c;
+            }
+            if (d != dry.end() && d->token == token) {
+                logit -= d->logit;
+                ++d;
+            }
+
+            if (token >= 0 && token < m_nVocab) {
+                m_adjusted.push_back({token, logit, 0.f});
+            }
+        }
+    }
+
+    bool isAdjusted(Token token) const {
+        return std::binary_search(m_adjusted.begin(), m_adjusted.end(), llama_token_data{token, 0.f, 0.f},
+            [](auto& a, auto& b) { return a.id < b.id; });
+    }
+
+    // gather the width tokens with the highest adjusted logits into cur (unordered)
+    void gather(const float* logits, std::vector<llama_token_data>& cur, size_t width) {
+        cur.clear();
+
+        // the best `width` unadjusted tokens are within the best width + m_adjusted.size() raw ones
+        const size_t n = width + m_adjusted.size();
+        if (n >= size_t(m_nVocab)) {
+            cur.resize(size_t(m_nVocab));
+            for (Token id = 0; id < m_nVocab; ++id) {
+                cur[id] = {id, logits[id], 0.f};
+            }
+            for (auto& a : m_adjusted) {
+                cur[a.id] = a;
+            }
+            return;
+        }
+
+        selectTop(logits, m_nVocab, n, cur);
+        if (m_adjusted.empty()) return;
+
+        cur.erase(std::remove_if(cur.begin(), cur.end(), [&](auto& c) {
+            return isAdjusted(c.id);
+        }), cur.end());
+        cur.insert(cur.end(), m_adjusted.begin(), m_adjusted.end());
+    }
+
+    size_t validUnadjusted(const std::vector<llama_token_data>& cur) const {
+        return size_t(std::count_if(cur.begin(), cur.end(), [&](auto& c) {
+            return c.logit != -INFINITY && !isAdjusted(c.id);
+        }));
+    }
+
+    Params m_params;
+    int32_t m_nVocab;
+
+    size_t m_topK = 0; // number of candidates (0 = all tokens)
+    std::vector<SamplingType> m_stages; // samplers after top-k which are not disabled
+
+    // repetition penalty state
+    bool m_penalize = false;
+    std::vector<Token> m_history; // ring buffer of the last accepted tokens
+    size_t m_historyPos = 0; // oldest token in m_history when full
+    astl::flat_map<Token, int32_t> m_counts; // occurrences of each token in m_history
+
+    std::vector<llama_token_data> m_adjusted;
+    std::vector<llama_token_data> m_scratch;
+    SelectBuffers m_select;
+
+    Metrics* m_metrics = nullptr; // null if not collected
+
+    uint32_t m_seed = 0;
+    std::mt19937 m_rng;
+    std::discrete_distribution<int> m_dist;
+};
+
+// Grammar masking of large candidate sets
+//
+// Applying the grammar sampler to the whole vocabulary walks the text of every token. Instead we walk the
+// model's token trie level by level and apply the grammar to one token per node. If the piece of a node is
+// rejected, so are all pieces which start with it, which allows us to skip whole subtrees. In constrained
+// states (which is what grammars are mostly about) only a small part of the vocabulary is visited.
+class Sampler::GrammarMask {
+public:
+    explicit GrammarMask(const Model& model) : m_model(model) {}
+
+    // candidate sets smaller than this are masked by the grammar directly
+    static constexpr size_t MinCandidates = 1024;
+
+    // compute the tokens which fit the current state of the grammar
+    // returns a vocab-sized array of flags
+    const std::vector<uint8_t>& allowed(llama_sampler* grammar) {
+        walk(grammar, false);
+        return m_allowed;
+    }
+
+    // text which is forced by the grammar: all tokens which fit it start with this text, and it continues with what's
+    // forced after it
+    // this is called for every token, mostly in states where nothing is forced, so in them it costs no more than
+    // probing the end of generation and the first byte of the pieces
+    std::string forced(llama_sampler* grammar, size_t maxLength) {
+        auto& trie = m_model.tokenTrie();
+        std::string ret;
+
+        // a copy of the grammar is advanced through the forced pieces (it's only made once there is a piece)
+        astl::c_unique_ptr<llama_sampler> copy(nullptr, llama_sampler_free);
+        llama_sampler* state = grammar;
+
+        while (ret.size() < maxLength) {
+            walk(state, true);
+            if (m_eogAllowed || m_minPos > m_maxPos) break; // the generation may end here or nothing fits
+
+            // descend to the deepest node which contains all fitting tokens in its subtree
+            // since subtrees are contiguous ranges in the token order, it's enough to check the first and last one
+            auto* node = &trie.root();
+            while (m_minPos >= node->tokenEnd) {
+                auto children = trie.children(*node);
+                auto next = std::find_if(children.begin(), children.end(), [&](const TokenTrie::Node& c) {
+                    return c.tokenBegin <= m_minPos && m_maxPos < trie.subtreeEnd(c);
+                });
+                if (next == children.end()) return ret; // several continuations
+                node = &*next;
+                ret += char(node->byte);
+                if (ret.size() == maxLength) return ret;
+            }
+
+            // the piece of the node fits and all fitting tokens start with it (longer ones may also fit)
+            // grammars work on text, so we can continue from the state after the piece regardless of how the text
+            // is tokenized in the end
+            if (!copy) {
+                copy.reset(llama_sampler_clone(grammar));
+                state = copy.get();
+            }
+            llama_sampler_accept(state, trie.tokens(*node).front());
+        }
+
+        return ret;
+    }
+
+private:
+    // walk the trie and mark the allowed tokens
+    // if stopAtBranch is true, the tokens are not marked and the walk stops when several nodes of a level fit the
+    // grammar or the generation may end, as nothing can be forced then (only the range of fitting tokens is
+    // computed and it covers the subtrees which weren't visited)
+    void walk(llama_sampler* grammar, bool stopAtBranch) {
+        auto& trie = m_model.tokenTrie();
+
+        if (!stopAtBranch) {
+            m_allowed.assign(size_t(m_model.vocab().nTokens()), 0);
+        }
+        m_minPos = UINT32_MAX;
+        m_maxPos = 0;
+
+        // end-of-generation tokens are special for grammars, so they are checked one by one
+        m_probes.clear();
+        for (auto t : trie.eogTokens()) {
+            m_probes.push_back({t, 0.f, 0.f});
+        }
+        applyProbes(grammar);
+        m_eogAllowed = false;
+        for (auto& p : m_probes) {
+            const bool fits = p.logit != -INFINITY;
+            if (!stopAtBranch) {
+                m_allowed[size_t(p.id)] = fits;
+            }
+            m_eogAllowed |= fits;
+        }
+        if (stopAtBranch && m_eogAllowed) return;
+
+        // tokens with an empty piece are never accepted, so we start with the children of the root
+        auto nodes = trie.nodes();
+        m_level.assign(1, {trie.root().childBegin, trie.root().childEnd});
+
+        while (!m_level.empty()) {
+            // probe the first token of each node which has tokens
+            m_probes.clear();
+            for (auto [begin, end] : m_level) {
+                for (auto i = begin; i < end; ++i) {
+                    auto tokens = trie.tokens(nodes[i]);
+                    if (!tokens.empty()) {
+                        m_probes.push_back({tokens.front(), 0.f, 0.f});
+                    }
+                }
+            }
+            applyProbes(grammar);
+
+            m_nextLevel.clear();
+            size_t probe = 0;
+            size_t numFit = 0;
+            for (auto [begin, end] : m_level) {
+                for (auto i = begin; i < end; ++i) {
+                    auto& node = nodes[i];
+                    auto tokens = trie.tokens(node);
+                    if (!tokens.empty()) {
+                        if (m_probes[probe++].logit == -INFINITY) continue; // prune the subtree
+                        if (!stopAtBranch) {
+                            for (auto t : tokens) {
+                                m_allowed[size_t(t)] = 1;
+                            }
+                        }
+                        m_minPos = std::min(m_minPos, node.tokenBegin);
+                        m_maxPos = std::max(m_maxPos, node.tokenEnd - 1);
+                        ++numFit;
+                    }
+                    if (node.childBegin != node.childEnd) {
+                        m_nextLevel.push_back({node.childBegin, node.childEnd});
+                    }
+                }
+            }
+
+            if (stopAtBranch && numFit > 1) {
+                for (auto [begin, end] : m_nextLevel) {
+                    m_minPos = std::min(m_minPos, nodes[begin].tokenBegin);
+                    m_maxPos = std::max(m_maxPos, trie.subtreeEnd(nodes[end - 1]) - 1);
+                }
+                return;
+            }
+
+            m_level.swap(m_nextLevel);
+        }
+    }
+
+    void applyProbes(llama_sampler* grammar) {
+        if (m_probes.empty()) return;
+        llama_token_data_array arr = {m_probes.data(), m_probes.size(), -1, false};
+        llama_sampler_apply(grammar, &arr);
+    }
+
+    const Model& m_model;
+
+    std::vector<uint8_t> m_allowed;
+    std::vector<llama_token_data> m_probes;
+
+    // results of the last walk
+    bool m_eogAllowed = false;
+    uint32_t m_minPos = 0, m_maxPos = 0; // range of the fitting tokens in the trie order (empty if min > max)
+
+    // ranges of sibling nodes in the current and next level of the walk
+    std::vector<std::pair<uint32_t, uint32_t>> m_level, m_nextLevel;
+};
+
+namespace {
+std::shared_ptr<const llama_sampler> grammarPrototype(Model& model, const Sampler::Params& params) {
+    if (params.grammar.empty() && !params.jsonSchema.empty()) {
+        return model.grammarCache().getForJsonSchema(params.jsonSchema);
+    }
+    return model.grammarCache().get(params.grammar);
+}
+
+// DRY penalties in the llama.cpp chain
+// the history is owned and updated by Sampler (which knows the sequence breakers), so there is no accept
+struct DrySamplerCtx {
+    const DryPenalty& dry;
+    TokenDataVector penalties;
+};
+
+void DrySampler_apply(llama_sampler* smpl, llama_token_data_array* cur) {
+    auto& ctx = *static_cast<DrySamplerCtx*>(smpl->ctx);
+    ctx.dry.penalties(ctx.penalties);
+    for (auto& p : ctx.penalties) {
+        // unless something reordered them, the candidates are the vocabulary in token order
+        if (size_t(p.token) < cur->size && cur->data[p.token].id == p.token) {
+            cur->data[p.token].logit -= p.logit;
+            continue;
+        }
+        for (size_t i = 0; i < cur->size; ++i) {
+            if (cur->data[i].id == p.token) {
+                cur->data[i].logit -= p.logit;
+                break;
+            }
+        }
+    }
+}
+
+llama_sampler_i DrySampler_iface = {
+    .name = [](const llama_sampler*) { return "dry"; },
+    .accept = nullptr,
+    .apply = DrySampler_apply,
+    .reset = nullptr,
+    .clone = nullptr,
+    .free = [](llama_sampler* smpl) { delete static_cast<DrySamplerCtx*>(smpl->ctx); },
+};
+
+// llama.cpp sampler chain for the sequences which the fused chain doesn't support
+astl::c_unique_ptr<llama_sampler> createChain(const llama_model* lmodel, const Sampler::Params& params, const DryPenalty* dry) {
+    using SamplingType = Sampler::SamplingType;
+
+    astl::c_unique_ptr<llama_sampler> ret(llama_sampler_chain_init({ .no_perf = false }), llama_sampler_free);
+    auto chain = ret.get();
 
     // static assertions to add logitBias
     auto& logitBiasBuf = params.logitBias.container();
@@ -44,6 +1022,10 @@ Sampler::Sampler(Model& model, const Params& params)
         )
     );
 
+    if (dry) {
+        llama_sampler_chain_add(chain, llama_sampler_init(&DrySampler_iface, new DrySamplerCtx{*dry, {}}));
+    }
+
     const auto& miro = params.mirostat;
 
     if (miro.ver == 1) {
@@ -94,25 +1076,225 @@ Sampler::Sampler(Model& model, const Params& params)
 
         llama_sampler_chain_add(chain, llama_sampler_init_dist(params.rngSeed));
     }
+
+    return ret;
+}
+} // namespace
+
+Sampler::Sampler(Model& model, const Params& params)
+    : m_model(model)
+    , m_grammarSampler(nullptr, llama_sampler_free)
+    , m_samplerChain(nullptr, llama_sampler_free)
+{
+    setParams(params);
+}
+
+void Sampler::setParams(const Params& params) {
+    const bool hasGrammar = !params.grammar.empty() || !params.jsonSchema.empty();
+
+    // the parsed grammar is shared, so we only need a new one if it's different
+    if (!m_grammarPrototype || params.grammar != m_grammar || params.jsonSchema != m_jsonSchema) {
+        m_grammarPrototype = grammarPrototype(m_model, params);
+        m_grammar = params.grammar;
+        m_jsonSchema = params.jsonSchema;
+    }
+
+    if (hasGrammar) {
+        if (!m_grammarMask) {
+            m_grammarMask = std::make_unique<GrammarMask>(m_model);
+        }
+        m_grammarTriggerWords = params.grammarTriggerWords;
+        m_grammarTriggerTokens = params.grammarTriggerTokens;
+        m_adaptiveGrammarFirst = params.adaptiveGrammarFirst;
+    }
+    else {
+        m_grammarMask.reset();
+        m_grammarTriggerWords.clear();
+        m_grammarTriggerTokens.clear();
+        m_adaptiveGrammarFirst = false;
+    }
+
+    m_penaltyNumTokens = params.repetitionPenalty.numTokens;
+
+    // the chain refers to the DRY state, so the old one must be gone before replacing it
+    m_samplerChain.reset();
+    if (params.dry.multiplier > 0) {
+        m_dry = std::make_unique<DryPenalty>(DryPenalty::Params{
+            .multiplier = params.dry.multiplier,
+            .base = params.dry.base,
+            .allowedLength = uint32_t(std::max(params.dry.allowedLength, 0)),
+            .maxHistory = uint32_t(std::max(params.dry.numTokens, 0)),
+        });
+        m_dryNumTokens = uint32_t(std::max(params.dry.numTokens, 0));
+        if (m_dryBreakers != params.dry.sequenceBreakers) {
+            m_dryBreakers = params.dry.sequenceBreakers;
+            m_dryBreakerCache.clear();
+        }
+    }
+    else {
+        m_dry.reset();
+    }
+    m_dryPenalties.clear();
+
+    m_collectMetrics = params.collectMetrics;
+
+    m_classBias.clear();
+    if (params.bannedClasses || !params.classBias.empty()) {
+        auto masks = m_model.tokenClasses().masks();
+        m_classBias.resize(masks.size());
+        for (size_t i = 0; i < masks.size(); ++i) {
+            float bias = 0;
+            for (auto& cb : params.classBias) {
+                if (masks[i] & cb.classes) bias += cb.bias;
+            }
+            m_classBias[i] = masks[i] & params.bannedClasses ? -INFINITY : bias;
+        }
+    }
+
+    if (params.fusedChain && FusedChain::supports(params)) {
+        if (m_fusedChain) {
+            m_fusedChain->setParams(params);
+        }
+        else {
+            auto lmodel = m_model.lmodel();
+            m_fusedChain = std::make_unique<FusedChain>(llama_vocab_n_tokens(llama_model_get_vocab(lmodel)), params);
+        }
+    }
+    else {
+        // llama.cpp samplers can't be reconfigured, but building a chain is cheap compared to the grammar
+        m_fusedChain.reset();
+        m_samplerChain = createChain(m_model.lmodel(), params, m_dry.get());
+    }
+
+    if (m_fusedChain) {
+        m_fusedChain->setMetrics(m_collectMetrics ? &m_metrics : nullptr);
+    }
+
+    reset();
 }
 
 Sampler::~Sampler() = default;
 
 void Sampler::accept(Token id, bool acceptGrammar) {
+    accept({&id, 1}, acceptGrammar);
+}
+
+void Sampler::accept(std::span<const Token> tokens, bool acceptGrammar) {
     if (acceptGrammar) {
-        llama_sampler_accept(m_grammarSampler.get(), id);
+        for (auto id : tokens) {
+            if (m_grammarActive) {
+                llama_sampler_accept(m_grammarSampler.get(), id);
+            }
+            else {
+                checkGrammarTriggers(id);
+            }
+        }
+    }
+
+    // last n tokens (0 = all)
+    auto recent = [&](size_t n) {
+        return n && n < tokens.size() ? tokens.last(n) : tokens;
+    };
+
+    // the repetition penalties only count the tokens in their window
+    // (and the other samplers in a chain don't care about accepted tokens)
+    if (m_penaltyNumTokens != 0) {
+        const auto window = recent(size_t(std::max(m_penaltyNumTokens, 0)));
+        for (auto id : window) {
+            if (m_fusedChain) {
+                m_fusedChain->accept(id);
+            }
+            else {
+                llama_sampler_accept(m_samplerChain.get(), id);
+            }
+        }
+    }
+
+    if (m_dry) {
+        // the DRY history keeps at most twice its size
+        for (auto id : recent(size_t(m_dryNumTokens) * 2)) {
+            m_dry->accept(id, isDryBreaker(id));
+        }
     }
+}
+
+bool Sampler::isDryBreaker(Token id) {
+    if (m_dryBreakers.empty()) return false;
 
-    llama_sampler_accept(m_samplerChain.get(), id);
+    auto& vocab = m_model.vocab();
+    if (m_dryBreakerCache.empty()) {
+        m_dryBreakerCache.resize(size_t(vocab.nTokens()), -1);
+    }
+    if (id < 0 || size_t(id) >= m_dryBreakerCache.size()) return true;
+
+    auto& cached = m_dryBreakerCache[size_t(id)];
+    if (cached < 0) {
+        const auto piece = vocab.tokenPiece(id);
+        cached = std::any_of(m_dryBreakers.begin(), m_dryBreakers.end(), [&](const std::string& b) {
+            return piece.find(b) != std::string_view::npos;
+        });
+    }
+    return cached;
 }
 
-namespace {
-llama_token_data_array fillLogits(std::vector<llama_token_data>& out, llama_context* lctx, int idx) {
-    const auto* logits = llama_get_logits_ith(lctx, idx);
+void Sampler::checkGrammarTriggers(Token id) {
+    if (std::find(m_grammarTriggerTokens.begin(), m_grammarTriggerTokens.end(), id) != m_grammarTriggerTokens.end()) {
+        m_grammarActive = true;
+        m_triggerText.clear();
+        llama_sampler_accept(m_grammarSampler.get(), id);
+        return;
+    }
 
-    const auto* lmodel = llama_get_model(lctx);
-    const int vocabSize = llama_vocab_n_tokens(llama_model_get_vocab(lmodel));
+    if (m_grammarTriggerWords.empty()) return;
+
+    m_triggerText += m_model.vocab().tokenPiece(id);
+
+    auto start = std::string::npos;
+    size_t maxLength = 0;
+    for (auto& w : m_grammarTriggerWords) {
+        start = std::min(start, m_triggerText.find(w));
+        maxLength = std::max(maxLength, w.size());
+    }
 
+    if (start == std::string::npos) {
+        // only keep what can be the start of a trigger split between tokens
+        if (m_triggerText.size() >= maxLength) {
+            m_triggerText.erase(0, m_triggerText.size() - maxLength + 1);
+        }
+        return;
+    }
+
+    m_grammarActive = true;
+
+    // the grammar starts from the trigger, which may start in the middle of a token
+    // grammars only care about the text, so we feed it with the longest tokens which make it up
+    auto& trie = m_model.tokenTrie();
+    std::string_view text = m_triggerText;
+    text.remove_prefix(start);
+    while (!text.empty()) {
+        auto* node = &trie.root();
+        Token token = Token_Invalid;
+        size_t length = 0;
+        for (size_t i = 0; i < text.size(); ++i) {
+            node = trie.child(*node, uint8_t(text[i]));
+            if (!node) break;
+            if (auto tokens = trie.tokens(*node); !tokens.empty()) {
+                token = tokens.front();
+                length = i + 1;
+            }
+        }
+        if (token == Token_Invalid) {
+            throw_ex{} << "Grammar trigger text can't be represented with tokens";
+        }
+        llama_sampler_accept(m_grammarSampler.get(), token);
+        text.remove_prefix(length);
+    }
+
+    m_triggerText.clear();
+}
+
+namespace {
+llama_token_data_array fillLogits(std::vector<llama_token_data>& out, int vocabSize, const float* logits) {
     out.resize(vocabSize);
 
     for (llama_token id = 0; id < vocabSize; id++) {
@@ -123,17 +1305,182 @@ llama_token_data_array fillLogits(std::vector<llama_token_data>& out, llama_cont
 }
 }
 
-Token Sampler::sample(llama_context* lctx, int idx, bool grammarFirst) {
-    auto grammar = m_grammarSampler.get();
+bool Sampler::fitsGrammar(Token id) {
+    if (!m_grammarActive) return true;
+
+    llama_token_data       singleTokenData = {id, 1.0f, 0.0f};
+    llama_token_data_array singleTokenDataAr = {&singleTokenData, 1, -1, false};
+
+    profileStage(m_collectMetrics ? &m_metrics : nullptr, "grammar-check", singleTokenDataAr, [&] {
+        llama_sampler_apply(m_grammarSampler.get(), &singleTokenDataAr);
+    });
+
+    return singleTokenDataAr.data[0].logit != -INFINITY;
+}
+
+std::string Sampler::forcedText(size_t maxLength) {
+    if (!m_grammarMask || !m_grammarActive) return {};
+    return m_grammarMask->forced(m_grammarSampler.get(), maxLength);
+}
+
+std::span<const uint8_t> Sampler::allowedTokens() {
+    if (!m_grammarMask || !m_grammarActive) return {};
+    return m_grammarMask->allowed(m_grammarSampler.get());
+}
+
+void Sampler::applyGrammar(llama_token_data_array& cur) {
+    if (!m_grammarActive) return;
+
+    profileStage(m_collectMetrics ? &m_metrics : nullptr, "grammar", cur, [&] {
+        if (!m_grammarMask || cur.size < GrammarMask::MinCandidates) {
+            llama_sampler_apply(m_grammarSampler.get(), &cur);
+            return;
+        }
+
+        auto& allowed = m_grammarMask->allowed(m_grammarSampler.get());
+        for (size_t i = 0; i < cur.size; ++i) {
+            if (!allowed[size_t(cur.data[i].id)]) {
+                cur.data[i].logit = -INFINITY;
+            }
+        }
+    });
+}
+
+namespace {
+// weight of a new verification in the moving average of the rejection rate
+constexpr float RejectionRateAlpha = 1.f / 8;
+
+// a rejected token costs a second pass over the logits with the grammar applied, which is about as much as
+// grammar-first, so the latter pays off once most tokens are rejected
+// the gap between the thresholds prevents switching back and forth on every other token
+constexpr float GrammarFirstAbove = 0.5f;
+constexpr float GrammarFirstBelow = 0.25f;
+
+// while grammar-first is chosen, every so often sample and verify instead to see whether rejections are still
+// frequent (which is all we can learn from it)
+constexpr uint32_t GrammarFirstProbeInterval = 16;
+} // namespace
+
+bool Sampler::useGrammarFirst(bool grammarFirst) {
+    if (!m_grammarMask || !m_grammarActive) return false;
+
+    if (!grammarFirst && m_preferGrammarFirst) {
+        if (m_samplesToProbe == 0) {
+            m_samplesToProbe = GrammarFirstProbeInterval;
+            return false;
+        }
+        --m_samplesToProbe;
+        grammarFirst = true;
+    }
+
+    if (grammarFirst) {
+        ++m_grammarStats.grammarFirst;
+    }
+    return grammarFirst;
+}
+
+void Sampler::recordVerification(bool fits) {
+    if (!m_grammarMask || !m_grammarActive) return;
+
+    ++m_grammarStats.verified;
+    if (!fits) {
+        ++m_grammarStats.rejected;
+    }
+
+    m_rejectionRate += ((fits ? 0.f : 1.f) - m_rejectionRate) * RejectionRateAlpha;
+
+    if (!m_adaptiveGrammarFirst) return;
+
+    if (m_preferGrammarFirst ? m_rejectionRate < GrammarFirstBelow : m_rejectionRate > GrammarFirstAbove) {
+        m_preferGrammarFirst = !m_preferGrammarFirst;
+        m_samplesToProbe = GrammarFirstProbeInterval;
+        ++m_grammarStats.switches;
+    }
+}
+
+const float* Sampler::biasedLogits(const float* raw) {
+    if (m_classBias.empty()) return raw;
+
+    StageProbe probe(m_collectMetrics ? &m_metrics : nullptr, "class-bias");
+    probe.start();
+    m_biasedLogits.resize(m_classBias.size());
+    for (size_t i = 0; i < m_classBias.size(); ++i) {
+        m_biasedLogits[i] = raw[i] + m_classBias[i];
+    }
+    probe.stop();
+    return m_biasedLogits.data();
+}
+
+Token Sampler::sampleFused(const float* rawLogits, bool grammarFirst) {
+    const auto* logits = biasedLogits(rawLogits);
+
+    if (m_dry) {
+        StageProbe probe(m_collectMetrics ? &m_metrics : nullptr, "dry");
+        probe.start();
+        m_dry->penalties(m_dryPenalties);
+        probe.stop();
+        probe.out([&] { return m_dryPenalties.size(); });
+    }
+
+    if (!useGrammarFirst(grammarFirst)) {
+        m_fusedChain->candidates(logits, m_cur, nullptr, m_dryPenalties);
+        const auto id = m_fusedChain->sample(m_cur);
+        const bool fits = fitsGrammar(id);
+        recordVerification(fits);
+        if (fits) {
+            return id;
+        }
+    }
+
+    // grammar first or resampling
+    m_fusedChain->candidates(logits, m_cur, this, m_dryPenalties);
+    return m_fusedChain->sample(m_cur);
+}
+
+void Sampler::applyChain(llama_token_data_array& cur) {
     auto chain = m_samplerChain.get();
+    if (!m_collectMetrics) {
+        llama_sampler_apply(chain, &cur);
+        return;
+    }
 
-    auto cur = fillLogits(m_cur, lctx, idx);
+    // the same as applying the chain, but one sampler at a time
+    for (int i = 0; i < llama_sampler_chain_n(chain); ++i) {
+        auto smpl = llama_sampler_chain_get(chain, i);
+        profileStage(&m_metrics, llama_sampler_name(smpl), cur, [&] { llama_sampler_apply(smpl, &cur); });
+    }
+}
+
+Token Sampler::sample(llama_context* lctx, int idx, bool grammarFirst) {
+    return sample(llama_get_logits_ith(lctx, idx), grammarFirst);
+}
+
+Token Sampler::sample(const float* logits, bool grammarFirst) {
+    if (!m_collectMetrics) {
+        return doSample(logits, grammarFirst);
+    }
 
+    const auto start = std::chrono::steady_clock::now();
+    const auto id = doSample(logits, grammarFirst);
+    m_metrics.timeNs += uint64_t(std::chrono::nanoseconds(std::chrono::steady_clock::now() - start).count());
+    ++m_metrics.samples;
+    return id;
+}
+
+Token Sampler::doSample(const float* logits, bool grammarFirst) {
+    if (m_fusedChain) {
+        return sampleFused(logits, grammarFirst);
+    }
+
+    const auto nVocab = m_model.vocab().nTokens();
+    auto cur = fillLogits(m_cur, nVocab, biasedLogits(logits));
+
+    grammarFirst = useGrammarFirst(grammarFirst);
     if (grammarFirst) {
-        llama_sampler_apply(grammar, &cur);
+        applyGrammar(cur);
     }
 
-    llama_sampler_apply(chain, &cur);
+    applyChain(cur);
 
     if (cur.selected == -1) {
         throw std::runtime_error("no selected token during sampling - check your sampling configuration");
@@ -146,24 +1493,18 @@ Token Sampler::sample(llama_context* lctx, int idx, bool grammarFirst) {
     }
 
     // check if it the sampled token fits the grammar
-    {
-        llama_token_data       singleTokenData = {id, 1.0f, 0.0f};
-        llama_token_data_array singleTokenDataAr = {&singleTokenData, 1, -1, false};
-
-        llama_sampler_apply(grammar, &singleTokenDataAr);
-
-        const bool is_valid = singleTokenDataAr.data[0].logit != -INFINITY;
-        if (is_valid) {
-            return id;
-        }
+    const bool fits = fitsGrammar(id);
+    recordVerification(fits);
+    if (fits) {
+        return id;
     }
 
     // resampling:
     // if the token is not valid, sample again, but first apply the grammar sampler and then the sampling chain
-    cur = fillLogits(m_cur, lctx, idx);
+    cur = fillLogits(m_cur, nVocab, biasedLogits(logits));
 
-    llama_sampler_apply(grammar, &cur);
-    llama_sampler_apply(chain, &cur);
+    applyGrammar(cur);
+    applyChain(cur);
 
     if (cur.selected == -1) {
         throw std::runtime_error("no selected token during re-sampling - check your sampling configuration");
@@ -173,14 +1514,37 @@ Token Sampler::sample(llama_context* lctx, int idx, bool grammarFirst) {
 }
 
 void Sampler::reset() {
-    llama_sampler_reset(m_grammarSampler.get());
-    llama_sampler_reset(m_samplerChain.get());
+    // resetting the grammar sampler would parse the grammar again, cloning the parsed one is much cheaper
+    m_grammarSampler.reset(llama_sampler_clone(m_grammarPrototype.get()));
+    m_grammarActive = !m_grammarMask || (m_grammarTriggerWords.empty() && m_grammarTriggerTokens.empty());
+    m_triggerText.clear();
+    m_preferGrammarFirst = false;
+    m_rejectionRate = 0;
+    m_samplesToProbe = 0;
+    if (m_dry) {
+        m_dry->reset();
+    }
+    if (m_fusedChain) {
+        m_fusedChain->reset();
+    }
+    else {
+        llama_sampler_reset(m_samplerChain.get());
+    }
 }
 
 void Sampler::perfReset() {
+    m_grammarStats = {};
+
+    // the fused chain refers to the metrics, so they're cleared in place
+    m_metrics.samples = 0;
+    m_metrics.timeNs = 0;
+    m_metrics.stages.clear();
+
     // perf on grammar samplers is not supported upstream
     //llama_perf_sampler_reset(m_grammarSampler.get());
-    llama_perf_sampler_reset(m_samplerChain.get());
+    if (m_samplerChain) {
+        llama_perf_sampler_reset(m_samplerChain.get());
+    }
 }
 
 } // namespace ac::llama
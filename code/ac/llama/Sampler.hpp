@@ -4,10 +4,13 @@
 #pragma once
 #include "export.h"
 #include "Token.hpp"
+#include "TokenClasses.hpp"
 #include <astl/flat_map.hpp>
 #include <astl/mem_ext.hpp>
 #include <vector>
 #include <string>
+#include <memory>
+#include <span>
 
 struct llama_token_data;
 struct llama_context;
@@ -18,6 +21,7 @@ struct llama_vocab;
 namespace ac::llama {
 
 class Model;
+class DryPenalty;
 
 class AC_LLAMA_EXPORT Sampler {
 public:
@@ -52,6 +56,15 @@ public:
             float   present   = 0.00f; // 0.0 = disabled
         } repetitionPenalty;
 
+        // DRY penalty of tokens which continue repetitions of earlier text (see DryPenalty)
+        struct Dry {
+            float multiplier = 0.00f; // 0.0 = disabled
+            float base = 1.75f; // growth of the penalty with the length of the repetition
+            int32_t allowedLength = 2; // repetitions up to this length are not penalized
+            int32_t numTokens = 4096; // (at least) last n tokens to check for repetitions (0 = all)
+            std::vector<std::string> sequenceBreakers = {"\n", ":", "\"", "*"}; // tokens with these end repetitions
+        } dry;
+
         struct Mirostat {
             int32_t ver = 0; // 0 = disabled, 1 = mirostat, 2 = mirostat 2.0
             float tau = 5.00f; // target entropy
@@ -72,8 +85,34 @@ public:
         };
 
         std::string grammar; // optional BNF-like grammar to constrain sampling
+        std::string jsonSchema; // optional JSON schema to constrain sampling (ignored if grammar is set)
+
+        // lazy grammar: if any triggers are set, the grammar (or schema) is only applied after one of them is
+        // generated, starting from the trigger, so the trigger itself must fit the grammar
+        std::vector<std::string> grammarTriggerWords;
+        std::vector<Token> grammarTriggerTokens;
+
+        // when sample is called without grammarFirst, switch to grammar-first automatically if most of the sampled
+        // tokens are rejected by the grammar (and back when they stop being rejected)
+        bool adaptiveGrammarFirst = true;
+
+        // collect per stage timings and candidate counts (see metrics)
+        // this adds a few clock reads and a pass over the candidates per stage
+        bool collectMetrics = false;
+
+        // use the fused fast path (see Sampler.cpp) for the sampler sequences which it supports
+        // if false, the llama.cpp sampler chain is always used (to compare the two, for example)
+        bool fusedChain = true;
 
         astl::flat_map<Token, float> logitBias; // bias for specific tokens
+
+        // bias and bans of classes of tokens (see TokenClasses), applied to all logits in a single pass
+        struct ClassBias {
+            TokenClasses::Mask classes; // tokens with any of these classes
+            float bias;
+        };
+        std::vector<ClassBias> classBias;
+        TokenClasses::Mask bannedClasses = 0; // tokens with any of these classes are never sampled
     };
 
     explicit Sampler(Model& model, const Params& params);
@@ -85,9 +124,44 @@ public:
     // reset the sampler state
     void reset();
 
+    // change the parameters in place
+    // the parsed grammar is kept if it's the same and the fused chain (see Sampler.cpp) is reconfigured without
+    // reallocations, so this is much cheaper than creating a new sampler (as it would be per request)
+    // the sampler state is reset
+    void setParams(const Params& params);
+
     // reset the performance counters
     void perfReset();
 
+    // counters of the grammar checks since the last perfReset
+    struct GrammarStats {
+        uint64_t verified = 0; // tokens sampled first and then checked against the grammar
+        uint64_t rejected = 0; // verified tokens which didn't fit and had to be resampled
+        uint64_t grammarFirst = 0; // tokens sampled with the grammar applied first
+        uint64_t switches = 0; // automatic switches between the two
+    };
+    const GrammarStats& grammarStats() const noexcept { return m_grammarStats; }
+
+    // metrics of a stage of sampling since the last perfReset (only with Params::collectMetrics)
+    //
+    // the stages are the samplers in the sequence (named as in llama.cpp: "top-k", "top-p", "temp-ext"...),
+    // "class-bias", "logit-bias", "penalties", "dry", "grammar" (masking), "grammar-check" (verification of a sampled
+    // token) and "dist" (the final random choice)
+    // with the fused chain (see Sampler.cpp) the logit bias and the penalties are a single "penalties" stage
+    struct StageMetrics {
+        std::string name;
+        uint64_t calls = 0;
+        uint64_t timeNs = 0;
+        uint64_t candidatesIn = 0; // total number of candidates with a finite logit before the stage
+        uint64_t candidatesOut = 0; // ... and after it
+    };
+    struct Metrics {
+        uint64_t samples = 0;
+        uint64_t timeNs = 0; // total time spent in sample, including the work outside of the stages
+        std::vector<StageMetrics> stages; // in order of first use
+    };
+    const Metrics& metrics() const noexcept { return m_metrics; }
+
     // extended sampling implementation:
     //
     // - set logits
@@ -97,19 +171,114 @@ public:
     //
     // if grammarFirst is true, the grammar is applied before the samplers (slower)
     // useful in cases where all the resulting candidates (not just the sampled one) must fit the grammar
+    // if it's false, but adaptiveGrammarFirst is set, the sampler may still choose grammar-first when the
+    // resampling becomes too frequent (see grammarStats)
     //
     // idx is optional for sampling from the logits of the ith token
     Token sample(llama_context* lctx, int idx = -1, bool grammarFirst = false);
 
+    // sample from a row of logits (one per token of the vocabulary) obtained from the context beforehand
+    // unlike getting the logits, this doesn't touch the context, so distinct samplers can do it concurrently
+    Token sample(const float* logits, bool grammarFirst = false);
+
+    // text which the grammar forces at its current state (up to maxLength bytes)
+    // all tokens which fit the grammar start with it (it may span several tokens)
+    // empty if there is no grammar or it allows several continuations
+    std::string forcedText(size_t maxLength = 64);
+
+    // tokens which fit the grammar at its current state, as a vocab-sized array of flags (valid until the next call)
+    // this is the mask which is applied to large candidate sets (see GrammarMask in Sampler.cpp)
+    // empty if there is no grammar or it's waiting for a trigger
+    std::span<const uint8_t> allowedTokens();
+
+    // false if the grammar is lazy and still waiting for a trigger
+    bool grammarActive() const noexcept { return m_grammarActive; }
+
     // accept token as sampled
     // if acceptGrammar is true, the token is accepted both by the sampling chain and the grammar
     void accept(Token id, bool acceptGrammar);
 
+    // accept several tokens (like a prompt) at once
+    // the penalties only look at the most recent tokens, so the rest are skipped
+    void accept(std::span<const Token> tokens, bool acceptGrammar);
+
 private:
+    Token sampleFused(const float* logits, bool grammarFirst);
+
+    // decide whether to apply the grammar first for this sample
+    bool useGrammarFirst(bool grammarFirst);
+
+    // update the rejection rate and the adaptive choice with the result of a check
+    void recordVerification(bool fits);
+
+    bool fitsGrammar(Token id);
+
+    // set the logits of the candidates which don't fit the grammar to -inf
+    void applyGrammar(llama_token_data_array& cur);
+
+    // check generated tokens for triggers of a lazy grammar and activate it
+    void checkGrammarTriggers(Token id);
+
+    bool isDryBreaker(Token id);
+
+    // sampling without the metrics of the whole call
+    Token doSample(const float* logits, bool grammarFirst);
+
+    // apply the llama.cpp chain, profiling each sampler if metrics are collected
+    void applyChain(llama_token_data_array& cur);
+
+    // the logits with the class bias applied
+    const float* biasedLogits(const float* logits);
+
+    Model& m_model;
+
+    // parsed grammar in its initial state from the model's grammar cache
+    // m_grammarSampler is cloned from it on construction and reset
+    std::string m_grammar;
+    std::string m_jsonSchema;
+    std::shared_ptr<const llama_sampler> m_grammarPrototype;
     astl::c_unique_ptr<llama_sampler> m_grammarSampler;
-    astl::c_unique_ptr<llama_sampler> m_samplerChain;
+    astl::c_unique_ptr<llama_sampler> m_samplerChain; // null if the fused chain is used
+
+    // fast path for the common sampler sequences (see Sampler.cpp)
+    class FusedChain;
+    std::unique_ptr<FusedChain> m_fusedChain;
+
+    // grammar masking of large candidate sets through the model's token trie (null without a grammar)
+    class GrammarMask;
+    std::unique_ptr<GrammarMask> m_grammarMask;
+
+    // lazy grammar state
+    std::vector<std::string> m_grammarTriggerWords;
+    std::vector<Token> m_grammarTriggerTokens;
+    bool m_grammarActive = true;
+    std::string m_triggerText; // tail of the generated text which may contain the start of a trigger word
+
+    int32_t m_penaltyNumTokens = 0;
+
+    // DRY penalty state (null if disabled)
+    std::unique_ptr<DryPenalty> m_dry;
+    uint32_t m_dryNumTokens = 0;
+    std::vector<std::string> m_dryBreakers;
+    std::vector<int8_t> m_dryBreakerCache; // per token: -1 = unknown, 0 = no, 1 = yes
+    TokenDataVector m_dryPenalties; // penalties for the current sample
+
+    // adaptive grammar-first state
+    bool m_adaptiveGrammarFirst = false;
+    bool m_preferGrammarFirst = false;
+    float m_rejectionRate = 0; // moving average of the rejected verifications
+    uint32_t m_samplesToProbe = 0; // grammar-first samples until the next verification
+
+    GrammarStats m_grammarStats;
+
+    bool m_collectMetrics = false;
+    Metrics m_metrics;
+
+    // per token sum of the class biases (-inf for the banned ones), empty if there are none
+    std::vector<float> m_classBias;
+    std::vector<float> m_biasedLogits;
 
-    // current tokens for sampling (one for each vocabulary entry)
+    // current tokens for sampling
     // kept as member so as to avoid reallocation on every sample call
     std::vector<llama_token_data> m_cur;
 };
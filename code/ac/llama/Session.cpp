@@ -5,11 +5,15 @@
 #include "Model.hpp"
 #include "Instance.hpp"
 #include "Logging.hpp"
+#include "LlamaBatch.hpp"
 
 #include <llama.h>
 
 #include <astl/throw_stdex.hpp>
 
+#include <algorithm>
+#include <cmath>
+
 namespace ac::llama {
 namespace {
 llama_batch makeInputBatch(std::span<const Token> tokens) {
@@ -33,6 +37,15 @@ TokenDataVector fillLogits(llama_context* lctx) {
 
     return result;
 }
+
+float logProb(const float* logits, int32_t vocabSize, Token token) {
+    const float maxLogit = *std::max_element(logits, logits + vocabSize);
+    float sum = 0;
+    for (int32_t i = 0; i < vocabSize; ++i) {
+        sum += std::exp(logits[i] - maxLogit);
+    }
+    return logits[token] - maxLogit - std::log(sum);
+}
 }
 
 Session::Session(Instance& instance, llama_context* ctx, InitParams params)
@@ -117,6 +130,9 @@ void Session::pushPrompt(std::span<const Token> prompt, std::span<const Token> p
     // reset sampling and don't allow previous inputs to affect the generation
     sampler.reset();
 
+    // the interaction continues from the prompt
+    dropForcedTokens();
+
     std::vector<Token> tokens;
     constexpr uint32_t maxAdditionalTokens = 4; // bos + fim_pre + fim_suf + fim_mid
     tokens.reserve(prompt.size() + postfix.size() + maxAdditionalTokens);
@@ -168,6 +184,16 @@ Token Session::getToken() {
 
     flushPendingState();
 
+    if (m_state.numForcedReturned < m_state.forcedTokens.size()) {
+        return m_state.forcedTokens[m_state.numForcedReturned++];
+    }
+
+    if (m_params.jumpForward) {
+        if (auto t = jumpForward(); t != Token_Invalid) {
+            return t;
+        }
+    }
+
     auto& sampler = m_instance.sampler();
     auto& vocab = m_instance.model().vocab();
 
@@ -181,6 +207,83 @@ Token Session::getToken() {
     return m_state.m_currToken;
 }
 
+Token Session::jumpForward() {
+    auto& vocab = m_instance.model().vocab();
+
+    const auto text = m_instance.sampler().forcedText();
+    if (text.empty()) {
+        return Token_Invalid;
+    }
+
+    auto tokens = vocab.tokenize(text, false, false);
+
+    // the last token may merge with what follows the forced text, so it's left to the sampler
+    if (tokens.size() < 2) {
+        return Token_Invalid;
+    }
+    tokens.pop_back();
+
+    // some tokenizers add a space prefix or normalize the text, in which case the tokens may not fit the grammar
+    const auto check = vocab.detokenize(tokens);
+    if (!text.starts_with(check)) {
+        return Token_Invalid;
+    }
+
+    // decoding accepts the tokens in the sampler and the grammar as generated
+    doDecode(tokens, Source::Generated);
+
+    m_state.forcedTokens = std::move(tokens);
+    m_state.numForcedReturned = 1;
+    return m_state.forcedTokens.front();
+}
+
+void Session::dropForcedTokens() {
+    // the forced tokens are the last ones in the context, as nothing else is decoded while they are returned
+    const auto unreturned = uint32_t(m_state.forcedTokens.size() - m_state.numForcedReturned);
+    if (unreturned) {
+        m_state.numPast -= unreturned;
+        llama_kv_self_seq_rm(m_ctx, 0, m_state.numPast, -1);
+        redecodeLast(m_state.forcedTokens[m_state.numForcedReturned - 1]);
+    }
+    m_state.forcedTokens.clear();
+    m_state.numForcedReturned = 0;
+}
+
+void Session::redecodeLast(Token token) {
+    // the token is already in the sampler, it's only decoded again for its logits
+    llama_kv_self_seq_rm(m_ctx, 0, m_state.numPast - 1, -1);
+    if (llama_decode(m_ctx, makeInputBatch({&token, 1})) != 0) {
+        throw_ex{} << "Failed to decode tokens";
+    }
+}
+
+float Session::probeLogLikelihood(std::span<const Token> tokens) {
+    // the first token is predicted by the logits of the context
+    if (tokens.size() < 2) return 0;
+    const auto probed = tokens.first(tokens.size() - 1);
+
+    if (m_state.numPast + probed.size() >= llama_n_ctx(m_ctx) || probed.size() > llama_n_batch(m_ctx)) {
+        throw_ex{} << "Option too long: " << tokens.size() << " tokens";
+    }
+
+    LlamaBatch batch(int32_t(probed.size()));
+    for (size_t i = 0; i < probed.size(); ++i) {
+        batch.add(probed[i], llama_pos(m_state.numPast + i), 0, true);
+    }
+    if (llama_decode(m_ctx, batch.batch) != 0) {
+        throw_ex{} << "Failed to decode tokens";
+    }
+
+    const auto vocabSize = llama_vocab_n_tokens(m_instance.model().vocab().lvocab());
+    float ret = 0;
+    for (size_t i = 0; i < probed.size(); ++i) {
+        ret += logProb(llama_get_logits_ith(m_ctx, int32_t(i)), vocabSize, tokens[i + 1]);
+    }
+
+    llama_kv_self_seq_rm(m_ctx, 0, m_state.numPast, -1);
+    return ret;
+}
+
 TokenDataVector Session::getSampledTokenData(int32_t topK) {
     flushPendingState();
 
@@ -196,6 +299,139 @@ TokenDataVector Session::getSampledTokenData(int32_t topK) {
     return result;
 }
 
+Session::Choice Session::choose(std::span<const std::string> options) {
+    if (m_state.m_phase != State::Phase::Generating) {
+        throw_ex{} << "Session hasn't started yet";
+    }
+    if (options.empty()) {
+        throw_ex{} << "No options to choose from";
+    }
+
+    flushPendingState();
+
+    // the interaction continues from the choice
+    dropForcedTokens();
+
+    auto& vocab = m_instance.model().vocab();
+    std::vector<std::vector<Token>> tokens;
+    tokens.reserve(options.size());
+    for (auto& o : options) {
+        tokens.push_back(vocab.tokenize(o, false, false));
+        if (tokens.back().empty()) {
+            throw_ex{} << "Empty option " << tokens.size() - 1;
+        }
+    }
+
+    const auto vocabSize = llama_vocab_n_tokens(vocab.lvocab());
+
+    // options which are still possible (the ones with the prefix taken so far)
+    std::vector<size_t> live(options.size());
+    for (size_t i = 0; i < live.size(); ++i) {
+        live[i] = i;
+    }
+
+    // equal options are the same choice (the first one)
+    auto unique = [&] {
+        return std::all_of(live.begin() + 1, live.end(), [&](size_t i) {
+            return tokens[i] == tokens[live.front()];
+        });
+    };
+
+    Choice ret;
+    size_t depth = 0; // of the current branches
+    size_t decoded = 0; // tokens of the choice in the context
+    float prefixLogLik = 0; // of the tokens taken so far
+
+    struct Branch {
+        Token token;
+        float logit;
+    };
+    std::vector<Branch> branches;
+
+    while (!unique()) {
+        auto& prefix = tokens[live.front()];
+        if (decoded < depth) {
+            doDecode(std::span(prefix).subspan(decoded, depth - decoded), Source::InteractivePrompt);
+            decoded = depth;
+        }
+
+        const auto* logits = llama_get_logits_ith(m_ctx, -1);
+
+        if (std::any_of(live.begin(), live.end(), [&](size_t i) { return tokens[i].size() == depth; })) {
+            // some options end here and there is no branch for that (the EOS logit says nothing about an option
+            // ending mid-text), so the remaining ones are scored by the likelihood of all of their tokens (per
+            // token) and their tails are only probed
+            const std::vector<float> branchLogits(logits, logits + vocabSize);
+
+            struct Candidate {
+                size_t index;
+                float score;
+            };
+            std::vector<Candidate> candidates;
+            for (auto i : live) {
+                if (std::any_of(candidates.begin(), candidates.end(), [&](const Candidate& c) {
+                    return tokens[c.index] == tokens[i];
+                })) continue;
+
+                float logLik = prefixLogLik;
+                auto tail = std::span(tokens[i]).subspan(depth);
+                if (!tail.empty()) {
+                    logLik += logProb(branchLogits.data(), vocabSize, tail.front()) + probeLogLikelihood(tail);
+                }
+                candidates.push_back({i, logLik / float(tokens[i].size())});
+            }
+
+            auto best = *std::max_element(candidates.begin(), candidates.end(),
+                [](const Candidate& a, const Candidate& b) { return a.score < b.score; });
+            float sum = 0;
+            for (auto& c : candidates) {
+                sum += std::exp(c.score - best.score);
+            }
+            ret.probability /= sum;
+
+            live = {best.index};
+            if (tokens[best.index].size() == depth) {
+                // the probes replaced the logits of the context
+                redecodeLast(prefix[depth - 1]);
+            }
+            break;
+        }
+
+        branches.clear();
+        for (auto i : live) {
+            const auto t = tokens[i][depth];
+            if (std::none_of(branches.begin(), branches.end(), [&](const Branch& b) { return b.token == t; })) {
+                branches.push_back({t, logits[t]});
+            }
+        }
+
+        auto best = *std::max_element(branches.begin(), branches.end(), [](const Branch& a, const Branch& b) {
+            return a.logit < b.logit;
+        });
+        float sum = 0;
+        for (auto& b : branches) {
+            sum += std::exp(b.logit - best.logit);
+        }
+        ret.probability /= sum;
+        prefixLogLik += logProb(logits, vocabSize, best.token);
+
+        std::erase_if(live, [&](size_t i) {
+            return tokens[i][depth] != best.token;
+        });
+
+        ++depth;
+    }
+
+    ret.index = live.front();
+
+    auto rest = std::span(tokens[ret.index]).subspan(decoded);
+    if (!rest.empty()) {
+        doDecode(rest, Source::InteractivePrompt);
+    }
+
+    return ret;
+}
+
 std::vector<uint8_t> Session::getState() {
     if (m_state.m_phase != State::Phase::Generating) {
         throw_ex{} << "Session hasn't started yet";
@@ -288,10 +524,8 @@ void Session::doDecode(std::span<const Token> tokens, Source src) {
     }
 
     // add to sampler
-    for (auto t : tokens) {
-        // only apply grammar for generated content
-        sampler.accept(t, src == Source::Generated);
-    }
+    // only apply grammar for generated content
+    sampler.accept(tokens, src == Source::Generated);
 
     // decode
     const auto batchSize = llama_n_batch(m_ctx);
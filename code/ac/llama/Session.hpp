@@ -7,6 +7,7 @@
 #include <utility>
 #include <exception>
 #include <coroutine>
+#include <string>
 #include <vector>
 #include <cassert>
 
@@ -24,6 +25,12 @@ public:
         // if true, the inference tries to extend the context by truncating previous tokens
         // only used if gaFactor == 1
         bool infiniteContext = true;
+
+        // if true and the sampler has a grammar, the tokens which are forced by the grammar are decoded in a single
+        // batch without sampling, and then returned by getToken one by one
+        // if the interaction continues (pushPrompt, choose) before all of them are returned, the rest are removed
+        // from the context (but the sampler has seen them)
+        bool jumpForward = false;
     };
     Session(Instance& instance, llama_context* ctx, InitParams params);
     Session(const Session&) = delete;
@@ -38,6 +45,26 @@ public:
     void pushPrompt(std::span<const Token> prompt, std::span<const Token> postfix = {});
     Token getToken();
     TokenDataVector getSampledTokenData(int32_t topK);
+
+    struct Choice {
+        size_t index = 0; // index of the chosen option
+        float probability = 1; // of the choice among the options (see choose)
+    };
+
+    // choose one of the options as a continuation of the context
+    //
+    // The options are tokenized (so they should include a leading space if the tokenizer requires one) and their
+    // tokens form a prefix tree. At each step only the branches of the options which are still possible are
+    // allowed and the most likely one is taken, so this is a handful of decoded tokens, instead of free generation
+    // and matching of the result. It stops as soon as a single option remains and the rest of it is decoded in one
+    // batch, so the context continues from the whole option.
+    //
+    // The probability is the product of the probabilities of the taken branches among the allowed ones. When an
+    // option is a prefix of the remaining ones, there is no branch for it ending there, so they are compared by the
+    // log-likelihood of all of their tokens per token (as in ChoiceScorer): the tails of the longer ones are decoded
+    // and removed, and the last factor of the probability is the softmax of these scores.
+    // The sampler is not used, but the tokens of the choice are added to its history.
+    Choice choose(std::span<const std::string> options);
     std::vector<uint8_t> getState();
 private:
     enum class Source {
@@ -49,6 +76,19 @@ private:
     void doDecode(std::span<const Token> tokens, Source src);
     void flushPendingState();
 
+    // decode the tokens forced by the grammar (if any) and return the first one
+    Token jumpForward();
+
+    // remove the forced tokens which were not returned by getToken from the context
+    void dropForcedTokens();
+
+    // decode the last token of the context again (after removing tokens after it) to restore its logits
+    void redecodeLast(Token token);
+
+    // log-likelihood of tokens[1..] after tokens decoded at the end of the context, which is left unchanged
+    // (the logits aside)
+    float probeLogLikelihood(std::span<const Token> tokens);
+
     struct State {
         enum class Phase {
             Initial,
@@ -62,6 +102,10 @@ private:
         unsigned numKeep = 0;
         uint32_t gaIndex = 0; // number of grouped KV tokens (only used if params.gaFactor > 1)
         uint32_t numPast = 0; // number of tokens in the context (that's prompts + generated)
+
+        // tokens forced by the grammar which are already decoded, but not yet returned by getToken
+        std::vector<Token> forcedTokens;
+        size_t numForcedReturned = 0;
     };
 
     Instance& m_instance;
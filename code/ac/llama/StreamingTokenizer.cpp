@@ -0,0 +1,95 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include "StreamingTokenizer.hpp"
+#include "Vocab.hpp"
+
+#include <llama.h>
+
+#include <algorithm>
+
+namespace ac::llama {
+
+namespace {
+bool isSpace(char c) noexcept {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+bool isSplittable(const llama_vocab* lvocab) noexcept {
+    // BPE pre-tokenizers don't merge across a word-starting space and WPM splits the text at all whitespace
+    const auto type = llama_vocab_type(lvocab);
+    return type == LLAMA_VOCAB_TYPE_BPE || type == LLAMA_VOCAB_TYPE_WPM;
+}
+} // namespace
+
+StreamingTokenizer::StreamingTokenizer(const Vocab& vocab, Params params, Sink sink)
+    : m_vocab(vocab)
+    , m_params(params)
+    , m_sink(std::move(sink))
+    , m_splittable(isSplittable(vocab.lvocab()))
+{}
+
+StreamingTokenizer::~StreamingTokenizer() = default;
+
+size_t StreamingTokenizer::splitPoint(std::string_view text, size_t from) noexcept {
+    from = std::max(from, size_t(1));
+    for (size_t p = text.size() < 2 ? 0 : text.size() - 2; p >= from; --p) {
+        if (text[p] == ' ' && !isSpace(text[p - 1]) && !isSpace(text[p + 1])) {
+            return p;
+        }
+    }
+    return 0;
+}
+
+void StreamingTokenizer::feed(std::string_view text) {
+    m_text += text;
+    if (!m_splittable || m_text.size() < m_params.chunkSize) return;
+
+    const auto split = splitPoint(m_text, m_scanned);
+    if (split == 0) {
+        // no point to split at yet, keep buffering (and don't rescan what's checked)
+        m_scanned = m_text.size() - 1;
+        return;
+    }
+
+    emit(std::string_view(m_text).substr(0, split), false);
+
+    // split is the last split point, so there are none in the rest
+    m_text.erase(0, split);
+    m_scanned = m_text.size() - 1;
+}
+
+void StreamingTokenizer::finish() {
+    emit(m_text, true);
+    m_text.clear();
+    m_scanned = 0;
+    m_started = false;
+}
+
+void StreamingTokenizer::emit(std::string_view text, bool last) {
+    m_tokens.clear();
+
+    if (!m_splittable) {
+        // whole text at once
+        m_vocab.tokenizeAppend(text, m_params.addSpecial, m_params.parseSpecial, m_tokens);
+    }
+    else {
+        auto lvocab = m_vocab.lvocab();
+        const bool first = !m_started;
+        m_started = true;
+
+        if (first && m_params.addSpecial && llama_vocab_get_add_bos(lvocab)) {
+            m_tokens.push_back(llama_vocab_bos(lvocab));
+        }
+        m_vocab.tokenizeAppend(text, false, m_params.parseSpecial, m_tokens);
+        if (last && m_params.addSpecial && llama_vocab_get_add_eos(lvocab)) {
+            m_tokens.push_back(llama_vocab_eos(lvocab));
+        }
+    }
+
+    if (!m_tokens.empty()) {
+        m_sink(m_tokens);
+    }
+}
+
+} // namespace ac::llama
@@ -0,0 +1,74 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "export.h"
+#include "Token.hpp"
+
+#include <astl/ufunction.hpp>
+
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ac::llama {
+class Vocab;
+
+// Tokenizes a text which arrives in pieces (a large file being read, a network stream) and emits the tokens
+// incrementally to a sink, so that the whole text doesn't need to be in memory
+//
+// The buffered text is tokenized in chunks which are split before a space which starts a word (a space between
+// two non-whitespace characters). No pre-tokenizer of a BPE vocabulary merges across such a point and a WPM
+// (BERT-style) vocabulary splits the text into words at any whitespace, so the tokens are the same as the ones
+// of the whole text.
+// SPM and UGM vocabularies (SentencePiece) have no pre-tokenizer and can merge across any point, so for them the
+// entire text is buffered and tokenized on finish.
+class AC_LLAMA_EXPORT StreamingTokenizer {
+public:
+    // the span is only valid during the call
+    using Sink = astl::ufunction<void(std::span<const Token>)>;
+
+    struct Params {
+        bool addSpecial = true; // add bos and eos (as configured by the vocabulary) around the entire text
+        bool parseSpecial = false; // parse special tokens in the text
+        size_t chunkSize = 64 * 1024; // text is tokenized when at least this many bytes are buffered
+    };
+
+    StreamingTokenizer(const Vocab& vocab, Params params, Sink sink);
+    ~StreamingTokenizer();
+
+    StreamingTokenizer(const StreamingTokenizer&) = delete;
+    StreamingTokenizer& operator=(const StreamingTokenizer&) = delete;
+
+    // add text to the stream
+    void feed(std::string_view text);
+
+    // tokenize the remaining text and end the stream
+    // after this a new text can be fed
+    void finish();
+
+    // bytes of text which have been fed but not yet tokenized
+    size_t bufferedBytes() const noexcept { return m_text.size(); }
+
+    // last position in text from `from` on before which it can be split (a space between non-whitespace)
+    // returns 0 if there's none
+    static size_t splitPoint(std::string_view text, size_t from = 1) noexcept;
+
+private:
+    // tokenize text (the beginning of the stream if it's the first call) and send the tokens to the sink
+    void emit(std::string_view text, bool last);
+
+    const Vocab& m_vocab;
+    const Params m_params;
+    Sink m_sink;
+
+    const bool m_splittable;
+    bool m_started = false; // whether tokens of the current stream have been emitted
+
+    std::string m_text; // buffered text
+    size_t m_scanned = 0; // there are no split points in m_text before this
+    std::vector<Token> m_tokens; // reused for each chunk
+};
+
+} // namespace ac::llama
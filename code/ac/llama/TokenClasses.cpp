@@ -0,0 +1,65 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include "TokenClasses.hpp"
+#include "Vocab.hpp"
+
+#include <astl/throw_stdex.hpp>
+
+#include <array>
+
+namespace ac::llama {
+
+namespace {
+// class of each byte value
+constexpr std::array<TokenClasses::Mask, 256> ByteClasses = [] {
+    std::array<TokenClasses::Mask, 256> ret = {};
+    for (int c = 0; c < 256; ++c) {
+        auto& m = ret[size_t(c)];
+        if (c >= 0x80) m = TokenClasses::NonAscii;
+        else if (c == '\n' || c == '\r') m = TokenClasses::Newline;
+        else if (c == ' ' || c == '\t' || c == '\v' || c == '\f') m = TokenClasses::Space;
+        else if (c >= '0' && c <= '9') m = TokenClasses::Digit;
+        else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) m = TokenClasses::Letter;
+        else if (c < 0x20 || c == 0x7f) m = TokenClasses::Control;
+        else m = TokenClasses::Punct;
+    }
+    return ret;
+}();
+} // namespace
+
+TokenClasses::TokenClasses(const Vocab& vocab) {
+    const auto nTokens = vocab.nTokens();
+    m_masks.resize(size_t(nTokens));
+    for (Token t = 0; t < nTokens; ++t) {
+        if (vocab.isEog(t) || vocab.isControl(t)) {
+            m_masks[size_t(t)] = Special;
+            continue;
+        }
+        m_masks[size_t(t)] = classify(vocab.tokenPiece(t));
+    }
+}
+
+TokenClasses::~TokenClasses() = default;
+
+TokenClasses::Mask TokenClasses::classify(std::string_view piece) noexcept {
+    Mask ret = 0;
+    for (auto c : piece) {
+        ret |= ByteClasses[uint8_t(c)];
+    }
+    return ret;
+}
+
+TokenClasses::Class TokenClasses::fromName(std::string_view name) {
+    if (name == "newline") return Newline;
+    if (name == "space") return Space;
+    if (name == "digit") return Digit;
+    if (name == "letter") return Letter;
+    if (name == "punct") return Punct;
+    if (name == "non_ascii") return NonAscii;
+    if (name == "control") return Control;
+    if (name == "special") return Special;
+    throw_ex{} << "Unknown token class: " << name;
+}
+
+} // namespace ac::llama
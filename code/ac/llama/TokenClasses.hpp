@@ -0,0 +1,62 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "export.h"
+#include "Token.hpp"
+
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace ac::llama {
+
+class Vocab;
+
+// Classification of the tokens of a vocabulary by the characters in their text pieces
+//
+// Each token has a bitmask of the classes of the bytes in its piece, so restricting generation to a format (no new
+// lines, ASCII only, no digits...) is a matter of checking the mask of each token instead of detokenizing the
+// entire vocabulary. Control tokens (including end-of-generation) only have the Special class.
+class AC_LLAMA_EXPORT TokenClasses {
+public:
+    using Mask = uint32_t;
+
+    enum Class : Mask {
+        Newline = 1 << 0, // \n or \r
+        Space = 1 << 1, // whitespace other than new lines
+        Digit = 1 << 2, // ASCII digit
+        Letter = 1 << 3, // ASCII letter
+        Punct = 1 << 4, // ASCII punctuation
+        NonAscii = 1 << 5, // any byte >= 0x80 (part of a multibyte UTF-8 character)
+        Control = 1 << 6, // ASCII control character other than whitespace
+        Special = 1 << 7, // control token (such as BOS or EOS)
+    };
+
+    explicit TokenClasses(const Vocab& vocab);
+    ~TokenClasses();
+
+    TokenClasses(const TokenClasses&) = delete;
+    TokenClasses& operator=(const TokenClasses&) = delete;
+
+    // classes of the token (0 for tokens outside of the vocabulary)
+    Mask of(Token token) const noexcept {
+        return token >= 0 && size_t(token) < m_masks.size() ? m_masks[size_t(token)] : 0;
+    }
+
+    // masks of all tokens, indexed by token
+    std::span<const Mask> masks() const noexcept { return m_masks; }
+
+    // classes of the bytes in a piece of text
+    static Mask classify(std::string_view piece) noexcept;
+
+    // class by its name: "newline", "space", "digit", "letter", "punct", "non_ascii", "control" or "special"
+    // throws on unknown names
+    static Class fromName(std::string_view name);
+
+private:
+    std::vector<Mask> m_masks;
+};
+
+} // namespace ac::llama
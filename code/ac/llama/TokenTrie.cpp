@@ -0,0 +1,101 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include "TokenTrie.hpp"
+#include "Vocab.hpp"
+
+#include <algorithm>
+#include <numeric>
+#include <string_view>
+
+namespace ac::llama {
+
+TokenTrie::TokenTrie(const Vocab& vocab) {
+    const auto nTokens = vocab.nTokens();
+
+    std::vector<std::string_view> pieces(static_cast<size_t>(nTokens));
+    m_tokens.reserve(size_t(nTokens));
+    for (Token t = 0; t < nTokens; ++t) {
+        if (vocab.isEog(t)) {
+            m_eogTokens.push_back(t);
+            continue;
+        }
+        pieces[size_t(t)] = vocab.tokenPiece(t);
+        m_tokens.push_back(t);
+    }
+
+    // std::string_view compares bytes as unsigned, so children end up ordered by byte
+    std::stable_sort(m_tokens.begin(), m_tokens.end(), [&](Token a, Token b) {
+        return pieces[size_t(a)] < pieces[size_t(b)];
+    });
+
+    auto piece = [&](uint32_t i) {
+        return pieces[size_t(m_tokens[i])];
+    };
+
+    // ranges in m_tokens of the tokens which start with the prefix of each node, and the prefix length
+    struct Range {
+        uint32_t begin;
+        uint32_t end;
+        uint32_t depth;
+    };
+    std::vector<Range> ranges;
+
+    m_nodes.push_back({});
+    ranges.push_back({0, uint32_t(m_tokens.size()), 0});
+
+    // breadth first, so the children of each node are added contiguously
+    for (size_t ni = 0; ni < m_nodes.size(); ++ni) {
+        const auto r = ranges[ni];
+
+        // the piece equal to the prefix sorts before all longer ones
+        auto i = r.begin;
+        while (i < r.end && piece(i).size() == r.depth) ++i;
+
+        m_nodes[ni].tokenBegin = r.begin;
+        m_nodes[ni].tokenEnd = i;
+        m_nodes[ni].childBegin = uint32_t(m_nodes.size());
+
+        while (i < r.end) {
+            const auto byte = uint8_t(piece(i)[r.depth]);
+            auto j = i + 1;
+            while (j < r.end && uint8_t(piece(j)[r.depth]) == byte) ++j;
+
+            m_nodes.push_back({.byte = byte});
+            ranges.push_back({i, j, r.depth + 1});
+            i = j;
+        }
+
+        m_nodes[ni].childEnd = uint32_t(m_nodes.size());
+    }
+
+    m_subtreeEnd.resize(ranges.size());
+    std::transform(ranges.begin(), ranges.end(), m_subtreeEnd.begin(), [](const Range& r) { return r.end; });
+    m_nodes.shrink_to_fit();
+}
+
+TokenTrie::~TokenTrie() = default;
+
+std::span<const Token> TokenTrie::subtreeTokens(const Node& node) const noexcept {
+    return {m_tokens.data() + node.tokenBegin, m_tokens.data() + m_subtreeEnd[index(node)]};
+}
+
+const TokenTrie::Node* TokenTrie::child(const Node& node, uint8_t byte) const noexcept {
+    auto ch = children(node);
+    auto it = std::lower_bound(ch.begin(), ch.end(), byte, [](const Node& n, uint8_t b) {
+        return n.byte < b;
+    });
+    if (it == ch.end() || it->byte != byte) return nullptr;
+    return &*it;
+}
+
+const TokenTrie::Node* TokenTrie::find(std::string_view prefix) const noexcept {
+    const Node* node = &root();
+    for (auto c : prefix) {
+        node = child(*node, uint8_t(c));
+        if (!node) return nullptr;
+    }
+    return node;
+}
+
+} // namespace ac::llama
@@ -0,0 +1,77 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include "export.h"
+#include "Token.hpp"
+
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace ac::llama {
+
+class Vocab;
+
+// Byte trie of the text pieces of the tokens of a vocabulary
+//
+// Each node corresponds to a byte prefix shared by one or more token pieces and holds the tokens whose piece is
+// exactly that prefix (several tokens can have the same piece). Nodes are stored level by level (breadth first),
+// with the children of a node being contiguous and ordered by byte.
+//
+// End-of-generation tokens are not in the trie as they are treated specially by samplers and grammars.
+class AC_LLAMA_EXPORT TokenTrie {
+public:
+    explicit TokenTrie(const Vocab& vocab);
+    ~TokenTrie();
+
+    TokenTrie(const TokenTrie&) = delete;
+    TokenTrie& operator=(const TokenTrie&) = delete;
+
+    struct Node {
+        uint32_t childBegin;
+        uint32_t childEnd;
+        uint32_t tokenBegin;
+        uint32_t tokenEnd;
+        uint8_t byte; // last byte of the prefix (0 for the root)
+    };
+
+    const Node& root() const noexcept { return m_nodes.front(); }
+    std::span<const Node> nodes() const noexcept { return m_nodes; }
+    uint32_t index(const Node& node) const noexcept { return uint32_t(&node - m_nodes.data()); }
+
+    std::span<const Node> children(const Node& node) const noexcept {
+        return {m_nodes.data() + node.childBegin, m_nodes.data() + node.childEnd};
+    }
+
+    // tokens whose piece is the prefix of the node
+    std::span<const Token> tokens(const Node& node) const noexcept {
+        return {m_tokens.data() + node.tokenBegin, m_tokens.data() + node.tokenEnd};
+    }
+
+    // all tokens in the subtree of the node (including its own)
+    // their positions in the trie order of tokens are [node.tokenBegin, subtreeEnd(node))
+    std::span<const Token> subtreeTokens(const Node& node) const noexcept;
+    uint32_t subtreeEnd(const Node& node) const noexcept { return m_subtreeEnd[index(node)]; }
+
+    // child of the node for the byte or nullptr
+    const Node* child(const Node& node, uint8_t byte) const noexcept;
+
+    // node of the prefix or nullptr if no token starts with it
+    const Node* find(std::string_view prefix) const noexcept;
+
+    // end-of-generation tokens (not in the trie)
+    std::span<const Token> eogTokens() const noexcept { return m_eogTokens; }
+
+private:
+    std::vector<Node> m_nodes;
+
+    // tokens ordered by piece, so the tokens of each subtree are contiguous
+    std::vector<Token> m_tokens;
+    std::vector<uint32_t> m_subtreeEnd; // end of the subtree tokens of each node in m_tokens
+
+    std::vector<Token> m_eogTokens;
+};
+
+} // namespace ac::llama
@@ -0,0 +1,195 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+// Branchless float kernels written so that the compiler can vectorize them.
+// We don't use intrinsics: the loops work on contiguous arrays in blocks of Lanes independent accumulators,
+// which lets the SLP vectorizer map them to whatever the target supports (SSE, AVX, NEON) without fast-math.
+namespace ac::llama::vec {
+
+inline constexpr size_t Lanes = 8;
+
+// exp with ~1 ulp error on the float range
+// arguments below -87 flush to ~0, above 88 saturate to ~FLT_MAX
+inline float exp(float x) noexcept {
+    x = std::clamp(x, -87.f, 88.f);
+
+    // exp(x) = 2^n * exp(r), r in [-ln2/2, ln2/2]
+    const float n = (x * 1.44269504088896341f + 12582912.f) - 12582912.f; // round to nearest
+    const float r = x - n * 0.693359375f + n * 2.12194440e-4f;
+
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.f;
+
+    return p * std::bit_cast<float>((int32_t(n) + 127) << 23);
+}
+
+// natural log for positive normal arguments (~1 ulp error)
+inline float log(float x) noexcept {
+    const auto bits = std::bit_cast<int32_t>(x);
+    float e = float((bits >> 23) - 127);
+    float m = std::bit_cast<float>((bits & 0x007fffff) | 0x3f800000); // [1, 2)
+
+    // move m to [sqrt(1/2), sqrt(2)) for better polynomial accuracy
+    const bool big = m > 1.41421356f;
+    m = big ? m * 0.5f : m;
+    e = big ? e + 1.f : e;
+
+    const float f = m - 1.f;
+    const float f2 = f * f;
+
+    float p = 7.0376836292e-2f;
+    p = p * f - 1.1514610310e-1f;
+    p = p * f + 1.1676998740e-1f;
+    p = p * f - 1.2420140846e-1f;
+    p = p * f + 1.4249322787e-1f;
+    p = p * f - 1.6668057665e-1f;
+    p = p * f + 2.0000714765e-1f;
+    p = p * f - 2.4999993993e-1f;
+    p = p * f + 3.3333331174e-1f;
+    p = p * f * f2;
+
+    return f - 0.5f * f2 + p + e * 0.693147180559945f;
+}
+
+inline float max(const float* x, size_t n) noexcept {
+    float acc[Lanes];
+    std::fill_n(acc, Lanes, n ? x[0] : 0.f);
+    size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes) {
+        for (size_t l = 0; l < Lanes; ++l) {
+            acc[l] = std::max(acc[l], x[i + l]);
+        }
+    }
+    float ret = *std::max_element(acc, acc + Lanes);
+    for (; i < n; ++i) {
+        ret = std::max(ret, x[i]);
+    }
+    return ret;
+}
+
+// index of the max element (the first one if there are several)
+inline size_t argmax(const float* x, size_t n) noexcept {
+    float accMax[Lanes];
+    uint32_t accIdx[Lanes] = {};
+    std::fill_n(accMax, Lanes, n ? x[0] : 0.f);
+    size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes) {
+        for (size_t l = 0; l < Lanes; ++l) {
+            const bool gt = x[i + l] > accMax[l];
+            accMax[l] = gt ? x[i + l] : accMax[l];
+            accIdx[l] = gt ? uint32_t(i + l) : accIdx[l];
+        }
+    }
+    size_t ret = 0;
+    float retMax = n ? x[0] : 0.f;
+    for (size_t l = 0; l < Lanes; ++l) {
+        if (accMax[l] > retMax || (accMax[l] == retMax && accIdx[l] < ret)) {
+            retMax = accMax[l];
+            ret = accIdx[l];
+        }
+    }
+    for (; i < n; ++i) {
+        if (x[i] > retMax) {
+            retMax = x[i];
+            ret = i;
+        }
+    }
+    return ret;
+}
+
+// true if any element is greater than t
+inline bool anyGreater(const float* x, size_t n, float t) noexcept {
+    int32_t acc[Lanes] = {};
+    const size_t blocked = n - n % Lanes;
+    for (size_t i = 0; i < blocked; i += Lanes) {
+        for (size_t l = 0; l < Lanes; ++l) {
+            acc[l] |= x[i + l] > t;
+        }
+    }
+    int32_t ret = 0;
+    for (size_t i = blocked; i < n; ++i) {
+        ret |= x[i] > t;
+    }
+    for (auto a : acc) ret |= a;
+    return ret != 0;
+}
+
+inline float sum(const float* x, size_t n) noexcept {
+    float acc[Lanes] = {};
+    size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes) {
+        for (size_t l = 0; l < Lanes; ++l) {
+            acc[l] += x[i + l];
+        }
+    }
+    float ret = 0;
+    for (; i < n; ++i) {
+        ret += x[i];
+    }
+    for (auto a : acc) ret += a;
+    return ret;
+}
+
+inline float sumSquares(const float* x, size_t n) noexcept {
+    float acc[Lanes] = {};
+    size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes) {
+        for (size_t l = 0; l < Lanes; ++l) {
+            acc[l] += x[i + l] * x[i + l];
+        }
+    }
+    float ret = 0;
+    for (; i < n; ++i) {
+        ret += x[i] * x[i];
+    }
+    for (auto a : acc) ret += a;
+    return ret;
+}
+
+// out[i] = exp(x[i] - shift), returns the sum of out
+// out may alias x
+inline float expShifted(const float* x, float* out, size_t n, float shift) noexcept {
+    float acc[Lanes] = {};
+    size_t i = 0;
+    for (; i + Lanes <= n; i += Lanes) {
+        for (size_t l = 0; l < Lanes; ++l) {
+            const float e = vec::exp(x[i + l] - shift);
+            out[i + l] = e;
+            acc[l] += e;
+        }
+    }
+    float ret = 0;
+    for (; i < n; ++i) {
+        out[i] = vec::exp(x[i] - shift);
+        ret += out[i];
+    }
+    for (auto a : acc) ret += a;
+    return ret;
+}
+
+inline void scale(float* x, size_t n, float s) noexcept {
+    for (size_t i = 0; i < n; ++i) {
+        x[i] *= s;
+    }
+}
+
+// in place softmax of x, returns the max of x
+inline float softmax(float* x, size_t n) noexcept {
+    const float m = vec::max(x, n);
+    const float s = expShifted(x, x, n, m);
+    scale(x, n, 1.f / s);
+    return m;
+}
+
+} // namespace ac::llama::vec
@@ -3,9 +3,16 @@
 //
 #include "Vocab.hpp"
 #include "Model.hpp"
+#include "WorkerPool.hpp"
 #include <llama-vocab.h>
+#include <algorithm>
 #include <type_traits>
 #include <cassert>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 #include <llama.h>
 
@@ -13,10 +20,101 @@ namespace ac::llama {
 
 static_assert(std::is_same_v<Token, llama_token>);
 
+struct Vocab::TokenizeCache {
+    explicit TokenizeCache(size_t budget) : budget(budget) {}
+
+    const size_t budget;
+
+    struct Key {
+        std::string_view text;
+        uint8_t flags;
+        bool operator==(const Key&) const noexcept = default;
+    };
+    struct KeyHash {
+        size_t operator()(const Key& k) const noexcept {
+            return std::hash<std::string_view>{}(k.text) ^ (size_t(k.flags) * size_t(0x9e3779b97f4a7c15ull));
+        }
+    };
+
+    struct Entry {
+        std::string text;
+        uint8_t flags;
+        std::vector<Token> tokens;
+
+        size_t bytes() const noexcept { return text.size() + tokens.size() * sizeof(Token); }
+    };
+
+    std::mutex mutex;
+    std::list<Entry> entries; // most recently used first
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index; // views into the entry texts
+    TokenizeCacheStats stats;
+
+    static uint8_t flags(bool addSpecial, bool parseSpecial) noexcept {
+        return uint8_t(addSpecial) | uint8_t(parseSpecial << 1);
+    }
+
+    bool get(std::string_view text, uint8_t flags, std::vector<Token>& out) {
+        std::lock_guard lock(mutex);
+        auto it = index.find({text, flags});
+        if (it == index.end()) {
+            ++stats.misses;
+            return false;
+        }
+        ++stats.hits;
+        entries.splice(entries.begin(), entries, it->second);
+        out = it->second->tokens;
+        return true;
+    }
+
+    void put(std::string_view text, uint8_t flags, const std::vector<Token>& tokens) {
+        const auto bytes = text.size() + tokens.size() * sizeof(Token); // Entry::bytes without making the entry
+        if (bytes > budget) return; // would evict everything else
+
+        Entry e{std::string(text), flags, tokens};
+
+        std::lock_guard lock(mutex);
+        if (index.contains({text, flags})) return; // someone else added it in the meantime
+
+        entries.push_front(std::move(e));
+        index.emplace(Key{entries.front().text, flags}, entries.begin());
+        stats.bytes += bytes;
+
+        while (stats.bytes > budget) {
+            auto& back = entries.back();
+            stats.bytes -= back.bytes();
+            index.erase({back.text, back.flags});
+            entries.pop_back();
+            ++stats.evictions;
+        }
+        stats.entries = entries.size();
+    }
+};
+
+// workers of tokenizeBatch, created on first use and grown when more are needed
+// a pool runs one task at a time, so concurrent batches take turns
+struct Vocab::TokenizePool {
+    std::mutex mutex;
+    std::unique_ptr<WorkerPool> pool;
+};
+
 Vocab::Vocab(const Model& model)
     : m_model(model)
     , m_lVocab(llama_model_get_vocab(model.lmodel()))
-{}
+    , m_tokenizePool(std::make_unique<TokenizePool>())
+{
+    const auto n = nTokens();
+    m_pieceOffsets.reserve(size_t(n) + 1);
+    m_pieceOffsets.push_back(0);
+    for (Token t = 0; t < n; ++t) {
+        m_pieces += tokenToString(t);
+        m_pieceOffsets.push_back(uint32_t(m_pieces.size()));
+    }
+    m_pieces.shrink_to_fit();
+
+    if (auto budget = model.params().tokenizeCacheSize) {
+        m_tokenizeCache = std::make_unique<TokenizeCache>(budget);
+    }
+}
 Vocab::~Vocab() = default;
 
 Token Vocab::decoderStartToken() const noexcept {
@@ -30,27 +128,138 @@ bool Vocab::isEog(Token token) const noexcept {
     return llama_vocab_is_eog(m_lVocab, token);
 }
 
+bool Vocab::isControl(Token token) const noexcept {
+    return llama_vocab_is_control(m_lVocab, token);
+}
+
 int32_t Vocab::nTokens() const noexcept {
     return llama_vocab_n_tokens(m_lVocab);
 }
 
-std::vector<Token> Vocab::tokenize(std::string_view text, bool addSpecial, bool parseSpecial) const {
+size_t Vocab::tokenizeAppend(std::string_view text, bool addSpecial, bool parseSpecial, std::vector<Token>& out) const {
+    const auto begin = out.size();
     int32_t numTokens = int32_t(text.length()) + 2 * addSpecial; // optimistic max
-    std::vector<Token> ret(numTokens);
-    numTokens = llama_tokenize(m_lVocab, text.data(), int32_t(text.length()), ret.data(), numTokens, addSpecial, parseSpecial);
+    out.resize(begin + size_t(numTokens));
+    numTokens = llama_tokenize(m_lVocab, text.data(), int32_t(text.length()), out.data() + begin, numTokens, addSpecial, parseSpecial);
     if (numTokens < 0) {
-        ret.resize(-numTokens);
+        out.resize(begin + size_t(-numTokens));
         [[maybe_unused]] int check =
-            llama_tokenize(m_lVocab, text.data(), int32_t(text.length()), ret.data(), -numTokens, addSpecial, parseSpecial);
+            llama_tokenize(m_lVocab, text.data(), int32_t(text.length()), out.data() + begin, -numTokens, addSpecial, parseSpecial);
         assert(check == -numTokens);
+        numTokens = -numTokens;
     }
     else {
-        ret.resize(numTokens);
+        out.resize(begin + size_t(numTokens));
+    }
+    return size_t(numTokens);
+}
+
+std::vector<Token> Vocab::tokenize(std::string_view text, bool addSpecial, bool parseSpecial) const {
+    std::vector<Token> ret;
+    if (!m_tokenizeCache) {
+        tokenizeAppend(text, addSpecial, parseSpecial, ret);
+        return ret;
+    }
+
+    const auto flags = TokenizeCache::flags(addSpecial, parseSpecial);
+    if (m_tokenizeCache->get(text, flags, ret)) {
+        return ret;
+    }
+
+    // tokenize outside of the lock
+    tokenizeAppend(text, addSpecial, parseSpecial, ret);
+    m_tokenizeCache->put(text, flags, ret);
+    return ret;
+}
+
+Vocab::TokenizeCacheStats Vocab::tokenizeCacheStats() const {
+    if (!m_tokenizeCache) return {};
+    std::lock_guard lock(m_tokenizeCache->mutex);
+    return m_tokenizeCache->stats;
+}
+
+Vocab::TokenizedBatch Vocab::tokenizeBatch(
+    std::span<const std::string_view> texts,
+    bool addSpecial,
+    bool parseSpecial,
+    uint32_t numThreads
+) const {
+    TokenizedBatch ret;
+    ret.offsets.resize(texts.size() + 1);
+
+    size_t totalBytes = 0;
+    for (auto& t : texts) {
+        totalBytes += t.size();
+    }
+
+    // don't bother with threads for a handful of texts
+    constexpr size_t minBytesPerThread = 16 * 1024;
+
+    if (numThreads == 0) {
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    const size_t numChunks = std::min({size_t(numThreads), texts.size(), totalBytes / minBytesPerThread});
+
+    if (numChunks <= 1) {
+        ret.tokens.reserve(totalBytes + 2 * addSpecial * texts.size());
+        for (size_t i = 0; i < texts.size(); ++i) {
+            ret.offsets[i + 1] = ret.offsets[i] + tokenizeAppend(texts[i], addSpecial, parseSpecial, ret.tokens);
+        }
+        return ret;
+    }
+
+    // contiguous ranges of texts with similar byte counts
+    std::vector<size_t> chunkBegins;
+    chunkBegins.reserve(numChunks + 1);
+    chunkBegins.push_back(0);
+    size_t bytes = 0;
+    for (size_t i = 0; i < texts.size() && chunkBegins.size() < numChunks; ++i) {
+        bytes += texts[i].size();
+        if (bytes * numChunks >= totalBytes * chunkBegins.size()) {
+            chunkBegins.push_back(i + 1);
+        }
+    }
+    chunkBegins.push_back(texts.size());
+
+    // each chunk has its own buffer and stores the token count of each text in the offsets
+    std::vector<std::vector<Token>> chunkTokens(chunkBegins.size() - 1);
+    auto task = [&](size_t c) {
+        auto& out = chunkTokens[c];
+        for (size_t i = chunkBegins[c]; i < chunkBegins[c + 1]; ++i) {
+            ret.offsets[i + 1] = tokenizeAppend(texts[i], addSpecial, parseSpecial, out);
+        }
+    };
+
+    {
+        // the calling thread takes part, so one worker less is needed
+        const auto numWorkers = uint32_t(chunkTokens.size() - 1);
+        std::lock_guard lock(m_tokenizePool->mutex);
+        auto& pool = m_tokenizePool->pool;
+        if (!pool || pool->numWorkers() < numWorkers) {
+            pool.reset(); // join the old workers first
+            pool = std::make_unique<WorkerPool>(numWorkers);
+        }
+        pool->run(chunkTokens.size(), numWorkers, task);
+    }
+
+    for (size_t i = 0; i < texts.size(); ++i) {
+        ret.offsets[i + 1] += ret.offsets[i];
+    }
+
+    ret.tokens.resize(ret.offsets.back());
+    for (size_t c = 0; c < chunkTokens.size(); ++c) {
+        auto& src = chunkTokens[c];
+        std::copy(src.begin(), src.end(), ret.tokens.begin() + ptrdiff_t(ret.offsets[chunkBegins[c]]));
     }
+
     return ret;
 }
 
 std::string Vocab::tokenToString(Token token, bool special) const {
+    if (special && size_t(token) + 1 < m_pieceOffsets.size()) {
+        return std::string(tokenPiece(token));
+    }
+
     std::string ret;
 
     auto to_piece = [&]() {
@@ -71,4 +280,25 @@ std::string Vocab::tokenToString(Token token, bool special) const {
     return ret;
 }
 
+void Vocab::detokenize(std::span<const Token> tokens, std::string& out) const {
+    size_t size = 0;
+    for (auto t : tokens) {
+        size += tokenPiece(t).size();
+    }
+
+    auto pos = out.size();
+    out.resize(pos + size);
+    for (auto t : tokens) {
+        auto piece = tokenPiece(t);
+        std::memcpy(out.data() + pos, piece.data(), piece.size());
+        pos += piece.size();
+    }
+}
+
+std::string Vocab::detokenize(std::span<const Token> tokens) const {
+    std::string ret;
+    detokenize(tokens, ret);
+    return ret;
+}
+
 } // namespace ac::llama
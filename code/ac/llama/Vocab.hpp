@@ -4,6 +4,9 @@
 #pragma once
 #include "export.h"
 #include "Token.hpp"
+#include <cstdint>
+#include <memory>
+#include <span>
 #include <vector>
 #include <string>
 #include <string_view>
@@ -18,19 +21,81 @@ public:
     Vocab(const Model& model);
     ~Vocab();
 
+    // if the model has a tokenization cache (Model::Params::tokenizeCacheSize), repeated texts (chat setups,
+    // system prompts, template fragments) are served from it
     std::vector<Token> tokenize(std::string_view text, bool addSpecial, bool parseSpecial) const;
 
+    // append the tokens of text to out, return their count
+    // doesn't use the tokenization cache, so that callers can reuse their buffers
+    size_t tokenizeAppend(std::string_view text, bool addSpecial, bool parseSpecial, std::vector<Token>& out) const;
+
+    struct TokenizeCacheStats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        size_t entries = 0;
+        size_t bytes = 0; // text and tokens of the entries
+    };
+    // all zeros if there is no cache
+    TokenizeCacheStats tokenizeCacheStats() const;
+
+    // tokens of many texts, back to back in a single buffer
+    struct TokenizedBatch {
+        std::vector<Token> tokens;
+        std::vector<size_t> offsets; // tokens of text i are [offsets[i], offsets[i + 1])
+
+        size_t size() const noexcept { return offsets.empty() ? 0 : offsets.size() - 1; }
+        std::span<const Token> operator[](size_t i) const noexcept {
+            return std::span(tokens).subspan(offsets[i], offsets[i + 1] - offsets[i]);
+        }
+    };
+
+    // tokenize the texts in parallel (numThreads = 0 means hardware concurrency)
+    // the texts are split in contiguous ranges of similar byte size, one per thread
+    // the threads are a pool kept by the vocab, so concurrent calls take turns
+    // the tokenization cache is not used, as batches are typically unique documents
+    TokenizedBatch tokenizeBatch(
+        std::span<const std::string_view> texts,
+        bool addSpecial,
+        bool parseSpecial,
+        uint32_t numThreads = 0
+    ) const;
+
     Token decoderStartToken() const noexcept; // fallback to bos if not available
 
     bool isEog(Token token) const noexcept;
+    bool isControl(Token token) const noexcept;
     int32_t nTokens() const noexcept;
 
     std::string tokenToString(Token token, bool special = true) const;
 
+    // text piece of the token (with special tokens rendered), empty for tokens outside of the vocabulary
+    // the pieces never change after load, so they're stored in a table built with the vocab
+    std::string_view tokenPiece(Token token) const noexcept {
+        if (token < 0 || size_t(token) + 1 >= m_pieceOffsets.size()) return {};
+        const auto begin = m_pieceOffsets[size_t(token)];
+        return std::string_view(m_pieces).substr(begin, m_pieceOffsets[size_t(token) + 1] - begin);
+    }
+
+    // append the pieces of the tokens to out
+    void detokenize(std::span<const Token> tokens, std::string& out) const;
+    std::string detokenize(std::span<const Token> tokens) const;
+
     const llama_vocab* lvocab() const { return m_lVocab; }
 private:
     const Model& m_model;
     const llama_vocab* m_lVocab;
+
+    // pieces of all tokens back to back, token t is at [m_pieceOffsets[t], m_pieceOffsets[t + 1])
+    std::string m_pieces;
+    std::vector<uint32_t> m_pieceOffsets;
+
+    // LRU cache of tokenized texts, thread safe
+    struct TokenizeCache;
+    std::unique_ptr<TokenizeCache> m_tokenizeCache;
+
+    struct TokenizePool;
+    std::unique_ptr<TokenizePool> m_tokenizePool;
 };
 
 } // namespace ac::llama
@@ -0,0 +1,126 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ac::llama {
+
+// Persistent worker threads for data parallel loops which run many times (every step of generation or every
+// batch of an evaluation), where spawning threads on every run would cost about as much as the work itself.
+//
+// Workers wait for a generation counter to change and then grab tasks through an atomic index until there are
+// none left, so slow tasks (rows with a grammar) don't hold up the others.
+class WorkerPool {
+public:
+    explicit WorkerPool(uint32_t numWorkers) {
+        m_workers.reserve(numWorkers);
+        for (uint32_t i = 0; i < numWorkers; ++i) {
+            m_workers.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (auto& w : m_workers) {
+            w.join();
+        }
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    uint32_t numWorkers() const noexcept { return uint32_t(m_workers.size()); }
+
+    // call task(i) for each i in [0, count) on the calling thread and up to numWorkers workers
+    template <typename Task>
+    void run(size_t count, uint32_t numWorkers, Task& task) {
+        {
+            std::lock_guard lock(m_mutex);
+            m_task = [](void* t, size_t i) { (*static_cast<Task*>(t))(i); };
+            m_taskObj = &task;
+            m_count = count;
+            m_next = 0;
+            m_wanted = m_busy = std::min(numWorkers, this->numWorkers());
+            m_error = nullptr;
+            ++m_generation;
+        }
+        m_wake.notify_all();
+
+        work();
+
+        std::unique_lock lock(m_mutex);
+        m_done.wait(lock, [this] { return m_busy == 0; });
+
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+    }
+
+private:
+    void workerLoop() {
+        uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock lock(m_mutex);
+                m_wake.wait(lock, [&] { return m_stop || seen != m_generation; });
+                if (m_stop) return;
+                seen = m_generation;
+                if (m_wanted == 0) continue;
+                --m_wanted;
+            }
+
+            work();
+
+            std::lock_guard lock(m_mutex);
+            if (--m_busy == 0) {
+                m_done.notify_one();
+            }
+        }
+    }
+
+    void work() {
+        for (size_t i = m_next++; i < m_count; i = m_next++) {
+            try {
+                m_task(m_taskObj, i);
+            }
+            catch (...) {
+                std::lock_guard lock(m_mutex);
+                if (!m_error) {
+                    m_error = std::current_exception();
+                }
+            }
+        }
+    }
+
+    std::vector<std::thread> m_workers;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+
+    // current run (changed only while no workers are busy)
+    void (*m_task)(void*, size_t) = nullptr;
+    void* m_taskObj = nullptr;
+    size_t m_count = 0;
+    std::atomic_size_t m_next = 0;
+    uint32_t m_wanted = 0; // workers which still have to join the run
+    uint32_t m_busy = 0; // workers which haven't finished the run
+    std::exception_ptr m_error;
+
+    uint64_t m_generation = 0;
+    bool m_stop = false;
+};
+
+} // namespace ac::llama
@@ -0,0 +1,137 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+
+// benchmark of grammar-constrained generation with typical JSON grammars
+//
+// usage: example-ac-llama-grammar-bench [model.gguf]
+// for each grammar reports the generation speed and the average time of a grammar-first sample
+// (which masks the entire vocabulary) compared to unconstrained generation
+
+// llama
+#include <ac/llama/Init.hpp>
+#include <ac/llama/Model.hpp>
+#include <ac/llama/Instance.hpp>
+#include <ac/llama/Session.hpp>
+#include <ac/llama/ResourceCache.hpp>
+
+// logging
+#include <ac/jalog/Instance.hpp>
+#include <ac/jalog/sinks/ColorSink.hpp>
+
+// model source directory
+#include "ac-test-data-llama-dir.h"
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+double usSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+struct Case {
+    const char* name;
+    const char* grammar;
+};
+
+// generic JSON value
+const char* Grammar_Json = R"(
+root   ::= object
+value  ::= object | array | string | number | ("true" | "false" | "null") ws
+object ::= "{" ws ( string ":" ws value ("," ws string ":" ws value)* )? "}" ws
+array  ::= "[" ws ( value ("," ws value)* )? "]" ws
+string ::= "\"" ( [^"\\\x7F\x00-\x1F] | "\\" (["\\bfnrt] | "u" [0-9a-fA-F]{4}) )* "\"" ws
+number ::= ("-"? ([0-9] | [1-9] [0-9]{0,15})) ("." [0-9]+)? ([eE] [-+]? [0-9] [1-9]{0,15})? ws
+ws     ::= | " " | "\n" [ \t]{0,20}
+)";
+
+// object with fixed keys, as generated from a schema for structured extraction
+const char* Grammar_Person = R"(
+root   ::= "{" ws "\"name\":" ws string "," ws "\"age\":" ws number "," ws "\"tags\":" ws tags "}" ws
+tags   ::= "[" ws ( string ("," ws string)* )? "]" ws
+string ::= "\"" ( [^"\\\x7F\x00-\x1F] | "\\" (["\\bfnrt] | "u" [0-9a-fA-F]{4}) )* "\"" ws
+number ::= [0-9]{1,3} ws
+ws     ::= | " "
+)";
+
+// enumeration
+const char* Grammar_Enum = R"(
+root ::= "{" ws "\"sentiment\":" ws ("\"positive\"" | "\"negative\"" | "\"neutral\"") ws "}"
+ws   ::= | " "
+)";
+} // namespace
+
+int main(int argc, char* argv[]) try {
+    ac::jalog::Instance jl;
+    jl.setup().add<ac::jalog::sinks::ColorSink>();
+
+    const std::string modelGguf = argc > 1 ? argv[1] : AC_TEST_DATA_LLAMA_DIR "/gpt2-117m-q6_k.gguf";
+
+    ac::llama::initLibrary();
+
+    ac::local::ResourceManager rm;
+    ac::llama::ResourceCache cache(rm);
+    auto model = cache.getModel({.gguf = modelGguf, .params = {}});
+
+    {
+        const auto start = Clock::now();
+        model->tokenTrie();
+        std::cout << "token trie built in " << usSince(start) / 1000 << " ms\n\n";
+    }
+
+    const Case cases[] = {
+        {"free", ""},
+        {"json", Grammar_Json},
+        {"person", Grammar_Person},
+        {"enum", Grammar_Enum},
+    };
+
+    const auto prompt = model->vocab().tokenize("Output JSON describing a person:\n", true, true);
+    constexpr int numTokens = 64;
+
+    std::cout << std::left << std::setw(10) << "grammar"
+        << std::right << std::setw(12) << "tokens/s"
+        << std::setw(24) << "grammar-first us/token" << "\n";
+
+    for (auto& c : cases) {
+        ac::llama::Instance instance(*model, {.grammar = c.grammar});
+        auto& session = instance.startSession({});
+        session.setInitialPrompt(prompt);
+
+        double genUs = 0;
+        double maskUs = 0;
+        int generated = 0;
+        for (; generated < numTokens; ++generated) {
+            auto start = Clock::now();
+            auto token = session.getToken();
+            genUs += usSince(start);
+            if (token == ac::llama::Token_Invalid) break;
+
+            // sample again from the same state with the grammar applied to the entire vocabulary first
+            start = Clock::now();
+            instance.sampler().sample(instance.lctx(), -1, true);
+            maskUs += usSince(start);
+        }
+        instance.stopSession();
+
+        if (generated == 0) {
+            std::cout << c.name << ": no tokens generated\n";
+            continue;
+        }
+
+        std::cout << std::left << std::setw(10) << c.name
+            << std::right << std::setw(12) << std::fixed << std::setprecision(1) << generated * 1e6 / genUs
+            << std::setw(24) << maskUs / generated << "\n";
+    }
+
+    return 0;
+}
+catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+}
@@ -0,0 +1,110 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+
+// perplexity and KL-divergence evaluation of a model over a text file
+//
+// usage: example-ac-llama-perplexity <text-file> [model.gguf] [reference-model.gguf]
+// if a reference model is provided, the model is verified against it and a divergence report is printed
+
+// llama
+#include <ac/llama/Init.hpp>
+#include <ac/llama/Model.hpp>
+#include <ac/llama/Instance.hpp>
+#include <ac/llama/Evaluator.hpp>
+#include <ac/llama/ModelVerifier.hpp>
+#include <ac/llama/ResourceCache.hpp>
+
+// logging
+#include <ac/jalog/Instance.hpp>
+#include <ac/jalog/sinks/ColorSink.hpp>
+
+// model source directory
+#include "ac-test-data-llama-dir.h"
+
+#include <iostream>
+#include <string>
+#include <memory>
+#include <optional>
+#include <chrono>
+
+int main(int argc, char* argv[]) try {
+    ac::jalog::Instance jl;
+    jl.setup().add<ac::jalog::sinks::ColorSink>();
+
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <text-file> [model.gguf] [reference-model.gguf]\n";
+        return 1;
+    }
+
+    const std::string textFile = argv[1];
+    const std::string modelGguf = argc > 2 ? argv[2] : AC_TEST_DATA_LLAMA_DIR "/gpt2-117m-q6_k.gguf";
+    const std::string refGguf = argc > 3 ? argv[3] : "";
+
+    // initialize the library
+    ac::llama::initLibrary();
+
+    ac::local::ResourceManager rm;
+    ac::llama::ResourceCache cache(rm);
+
+    // four windows of 256 tokens per batch
+    const ac::llama::Instance::InitParams iparams = {
+        .ctxSize = 1024,
+        .batchSize = 1024,
+        .maxSequences = 4,
+    };
+
+    auto model = cache.getModel({.gguf = modelGguf, .params = {}});
+    ac::llama::Instance instance(*model, iparams);
+
+    std::optional<ac::llama::ResourceCache::ModelLock> refModel;
+    std::unique_ptr<ac::llama::Instance> refInstance;
+    if (!refGguf.empty()) {
+        refModel.emplace(cache.getModel({.gguf = refGguf, .params = {}}));
+        refInstance = std::make_unique<ac::llama::Instance>(**refModel, iparams);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&] {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    auto progress = [&](const ac::llama::Evaluator::Result& r) {
+        std::cout << "\r[" << r.numTokens << " tokens] ppl: " << r.perplexity();
+        if (refInstance) {
+            std::cout << ", mean KL: " << r.klMean();
+        }
+        std::cout << std::flush;
+    };
+
+    std::cout << "Evaluating " << textFile << "\n";
+
+    if (refInstance) {
+        ac::llama::ModelVerifier verifier(instance, *refInstance, {});
+        auto report = verifier.verifyFile(textFile, progress);
+        const auto seconds = elapsed();
+        std::cout << "\n\n"
+            << "time: " << seconds << " s (" << double(report.totals.numTokens) / seconds << " tokens/s)\n"
+            << report.summary();
+        return report.passed ? 0 : 2;
+    }
+
+    ac::llama::Evaluator evaluator(instance, {});
+    std::cout << "window: " << evaluator.windowSize()
+        << ", stride: " << evaluator.stride()
+        << ", parallel windows: " << evaluator.numParallel() << "\n";
+
+    auto res = evaluator.evaluateFile(textFile, progress);
+    const auto seconds = elapsed();
+
+    std::cout << "\n\n"
+        << "scored tokens: " << res.numTokens << " in " << res.numWindows << " windows\n"
+        << "time: " << seconds << " s (" << double(res.numTokens) / seconds << " tokens/s)\n"
+        << "perplexity: " << res.perplexity() << "\n";
+
+    return 0;
+}
+catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+}
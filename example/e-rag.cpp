@@ -239,8 +239,14 @@ std::string generateResponse(ac::llama::Session& session, const std::string& pro
 }
 
 void fillDatabase(VectorDatabase<Document>& vdb) {
+    std::vector<std::string_view> texts;
+    for (auto& r : g_recipes) {
+        texts.push_back(r.first);
+    }
+    auto tokens = g_embeddingInstance->model().vocab().tokenizeBatch(texts, true, true);
+
     for (size_t i = 0; i < g_recipes.size(); i++) {
-        std::vector<float> embedding = g_embeddingInstance->getEmbeddingVector(g_embeddingInstance->model().vocab().tokenize(g_recipes[i].first , true, true));
+        std::vector<float> embedding = g_embeddingInstance->getEmbeddingVector(tokens[i]);
         vdb.addEntry(embedding, i, Document{.content = g_recipes[i].second});
     }
 }
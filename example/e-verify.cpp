@@ -252,28 +252,27 @@ Model::GenerationResult deserialize(std::string_view filename) {
 }
 
 void runCompare(Model::GenerationResult& r1, Model::GenerationResult& r2) {
-    std::vector<float> jsdResults;
-    std::vector<float> similarityResults;
-
+    std::vector<ac::llama::TokenDataVector> trace1, trace2;
+    trace1.reserve(r1.steps.size());
+    trace2.reserve(r2.steps.size());
     for (size_t i = 0; i < r1.steps.size(); i++) {
-        auto& step1 = r1.steps[i];
-        auto& step2 = r2.steps[i];
+        trace1.push_back(r1.steps[i].data);
+        trace2.push_back(r2.steps[i].data);
+    }
 
-        // Calculate similarity
-        float similarity = ac::llama::LogitComparer::logitSimilarity(step1.data, step2.data);
-        similarityResults.push_back(similarity);
+    // Calculate similarity of all steps in parallel
+    auto results = ac::llama::LogitComparer::compareTraces(trace1, trace2);
 
-        std::cout << "Token: " << step1.tokenStr
-                << ", Similarity: " << similarity
+    float similaritySum = 0.0f;
+    for (size_t i = 0; i < results.size(); i++) {
+        std::cout << "Token: " << r1.steps[i].tokenStr
+                << ", Similarity: " << results[i].similarity
                 << "\n";
+        similaritySum += results[i].similarity;
     }
 
     {
-        float similaritySum = 0.0f;
-        for (const auto& similarity : similarityResults) {
-            similaritySum += similarity;
-        }
-        float similarityAvg = similaritySum / similarityResults.size();
+        float similarityAvg = similaritySum / results.size();
         std::cout << "Average similarity score: " << similarityAvg << "\n";
     }
 }
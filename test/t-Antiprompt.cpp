@@ -45,6 +45,16 @@ TEST_CASE("incremental finder - case sensitivity") {
     CHECK_FALSE(f.feedText("the") == 3);
 }
 
+TEST_CASE("incremental finder - overlap") {
+    ac::llama::IncrementalStringFinder f("aab");
+    CHECK(f.feedText("aaab") == 4);
+    CHECK(f.feedText("aa") == -1);
+    CHECK(f.feedText("ab") == 2);
+
+    f = ac::llama::IncrementalStringFinder("abab");
+    CHECK(f.feedText("abaabab") == 7);
+}
+
 TEST_CASE("antiprompt manager - empty") {
     ac::llama::AntipromptManager am;
     am.addAntiprompt("");
@@ -100,3 +110,50 @@ TEST_CASE("antiprompt manager - reset/clear") {
     auto s = am.feedGeneratedText(":");
     CHECK(s == "\nUser:");
 }
+
+TEST_CASE("antiprompt manager - overlap") {
+    ac::llama::AntipromptManager am;
+    am.addAntiprompt("aab");
+    CHECK(am.feedGeneratedText("aaab") == "aab");
+
+    CHECK(am.feedGeneratedText("a").empty());
+    CHECK(am.hasRunningAntiprompts());
+    CHECK(am.feedGeneratedText("aaa").empty());
+    CHECK(am.feedGeneratedText("b!") == "aab!");
+    CHECK_FALSE(am.hasRunningAntiprompts());
+}
+
+TEST_CASE("antiprompt manager - match position") {
+    ac::llama::AntipromptManager am;
+    am.addAntiprompt("User:");
+    am.addAntiprompt("\nUser:");
+    am.addAntiprompt("</s>");
+
+    auto m = am.feed("hello</s> world");
+    REQUIRE(m);
+    CHECK(m.antiprompt == 2);
+    CHECK(m.endPos == 9);
+    CHECK(am.antiprompt(2) == "</s>");
+
+    // the earliest match wins, and of those which end at the same position the longest
+    m = am.feed("ok\nUser: hi </s>");
+    REQUIRE(m);
+    CHECK(m.antiprompt == 1);
+    CHECK(m.endPos == 8);
+
+    CHECK_FALSE(am.feed("nothing to see"));
+}
+
+TEST_CASE("antiprompt manager - many") {
+    ac::llama::AntipromptManager am;
+    for (int i = 0; i < 500; ++i) {
+        am.addAntiprompt("stop" + std::to_string(i) + "!");
+    }
+
+    CHECK(am.feedGeneratedText("nonstop1 stop42 stop4").empty());
+    CHECK(am.hasRunningAntiprompts());
+    auto m = am.feed("99!...");
+    REQUIRE(m);
+    CHECK(am.antiprompt(size_t(m.antiprompt)) == "stop499!");
+    CHECK(m.endPos == 3);
+}
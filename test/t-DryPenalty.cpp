@@ -0,0 +1,178 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include <doctest/doctest.h>
+
+#include "ac/llama/DryPenalty.hpp"
+
+#include <cmath>
+#include <random>
+
+using ac::llama::DryPenalty;
+using ac::llama::Token;
+using ac::llama::TokenDataVector;
+
+namespace {
+// breaker token for the tests
+constexpr Token Breaker = 0;
+
+// longest n such that the last n tokens of the history occur earlier followed by the token
+// (without crossing breakers)
+uint32_t bruteRepetitionLength(const std::vector<Token>& history, Token token) {
+    uint32_t best = 0;
+    for (size_t end = 0; end < history.size(); ++end) {
+        if (history[end] != token) continue;
+        uint32_t n = 0;
+        while (n < end && history[end - 1 - n] == history[history.size() - 1 - n] && history[end - 1 - n] != Breaker) {
+            ++n;
+        }
+        best = std::max(best, n);
+    }
+    return best;
+}
+} // namespace
+
+TEST_CASE("repetition length") {
+    DryPenalty dry({});
+    for (Token t : {1, 2, 3, 4, 1, 2, 3}) {
+        dry.accept(t, false);
+    }
+    CHECK(dry.repetitionLength(4) == 3); // 1 2 3 -> 4
+    CHECK(dry.repetitionLength(2) == 0); // 1 -> 2, but the history doesn't end with 1
+    CHECK(dry.repetitionLength(1) == 0); // 3 is never followed by 1
+    CHECK(dry.repetitionLength(5) == 0);
+
+    TokenDataVector p;
+    dry.penalties(p);
+    REQUIRE(p.size() == 1);
+    CHECK(p[0].token == 4);
+    CHECK(p[0].logit == doctest::Approx(0.8f * 1.75f));
+
+    dry.reset();
+    CHECK(dry.historySize() == 0);
+    CHECK(dry.repetitionLength(4) == 0);
+}
+
+TEST_CASE("breakers") {
+    DryPenalty dry({});
+    for (Token t : {1, 2, 3, Breaker, 1, 2}) {
+        dry.accept(t, t == Breaker);
+    }
+    CHECK(dry.repetitionLength(3) == 2);
+
+    dry.accept(3, false);
+    // the repetition doesn't continue over the breaker
+    CHECK(dry.repetitionLength(Breaker) == 0);
+    TokenDataVector p;
+    dry.penalties(p);
+    CHECK(p.empty());
+}
+
+TEST_CASE("penalties") {
+    DryPenalty dry({.multiplier = 1.f, .base = 2.f, .allowedLength = 2});
+
+    // a loop of 3 tokens
+    for (int i = 0; i < 4; ++i) {
+        for (Token t : {5, 6, 7}) {
+            dry.accept(t, false);
+        }
+    }
+    // 12 tokens: the last 9 repeat and 5 would continue them
+    TokenDataVector p;
+    dry.penalties(p);
+    REQUIRE(p.size() == 1);
+    CHECK(p[0].token == 5);
+    CHECK(p[0].logit == doctest::Approx(std::pow(2.f, 9 - 2)));
+
+    // short repetitions are allowed
+    DryPenalty dry2({.multiplier = 1.f, .base = 2.f, .allowedLength = 2});
+    for (Token t : {5, 6, 7, 5}) {
+        dry2.accept(t, false);
+    }
+    dry2.penalties(p);
+    CHECK(p.empty());
+    dry2.accept(6, false);
+    dry2.penalties(p);
+    REQUIRE(p.size() == 1);
+    CHECK(p[0].token == 7);
+    CHECK(p[0].logit == doctest::Approx(1.f));
+}
+
+TEST_CASE("random") {
+    std::minstd_rand rng(42);
+    std::uniform_int_distribution<Token> dist(0, 4);
+
+    DryPenalty dry({.allowedLength = 1});
+    std::vector<Token> history;
+    for (int i = 0; i < 500; ++i) {
+        const Token t = dist(rng);
+        dry.accept(t, t == Breaker);
+        history.push_back(t);
+
+        for (Token c = 1; c <= 4; ++c) {
+            CHECK(dry.repetitionLength(c) == bruteRepetitionLength(history, c));
+        }
+    }
+}
+
+TEST_CASE("max history") {
+    std::minstd_rand rng(7);
+    std::uniform_int_distribution<Token> dist(1, 3);
+
+    DryPenalty dry({.allowedLength = 1, .maxHistory = 16});
+    std::vector<Token> history;
+    for (int i = 0; i < 200; ++i) {
+        const Token t = dist(rng);
+        dry.accept(t, false);
+        history.push_back(t);
+
+        CHECK(dry.historySize() >= std::min(history.size(), size_t(16)));
+        CHECK(dry.historySize() < 32);
+
+        // the same as a brute force check of the kept tail
+        std::vector<Token> tail(history.end() - dry.historySize(), history.end());
+        for (Token c = 1; c <= 3; ++c) {
+            CHECK(dry.repetitionLength(c) == bruteRepetitionLength(tail, c));
+        }
+    }
+}
+
+TEST_CASE("max suffixes") {
+    // in a loop the suffix link path is long, but all of it continues with the same token
+    DryPenalty capped({.multiplier = 1.f, .base = 1.01f, .allowedLength = 2, .maxSuffixes = 4});
+    DryPenalty all({.multiplier = 1.f, .base = 1.01f, .allowedLength = 2, .maxSuffixes = 0});
+    for (int i = 0; i < 1000; ++i) {
+        for (Token t : {5, 6, 7}) {
+            capped.accept(t, false);
+            all.accept(t, false);
+        }
+    }
+    TokenDataVector p, q;
+    capped.penalties(p);
+    all.penalties(q);
+    REQUIRE(p.size() == 1);
+    REQUIRE(q.size() == 1);
+    CHECK(p[0].token == q[0].token);
+    CHECK(p[0].logit == q[0].logit);
+
+    // shorter repetitions beyond the cap are not checked
+    DryPenalty one({.multiplier = 1.f, .base = 2.f, .allowedLength = 1, .maxSuffixes = 1});
+    for (Token t : {1, 2, 9, 3, 1, 2, 8, 3, 1, 2}) {
+        one.accept(t, false);
+    }
+    // 3 1 2 -> 8 is the longest, 1 2 -> 9 is shorter
+    one.penalties(p);
+    REQUIRE(p.size() == 1);
+    CHECK(p[0].token == 8);
+
+    DryPenalty two({.multiplier = 1.f, .base = 2.f, .allowedLength = 1, .maxSuffixes = 2});
+    for (Token t : {1, 2, 9, 3, 1, 2, 8, 3, 1, 2}) {
+        two.accept(t, false);
+    }
+    two.penalties(p);
+    REQUIRE(p.size() == 2);
+    CHECK(p[0].token == 8);
+    CHECK(p[0].logit == doctest::Approx(4.f));
+    CHECK(p[1].token == 9);
+    CHECK(p[1].logit == doctest::Approx(2.f));
+}
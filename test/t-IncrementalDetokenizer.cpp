@@ -0,0 +1,64 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include <doctest/doctest.h>
+
+#include "ac/llama/IncrementalDetokenizer.hpp"
+
+#include <string>
+
+using ac::llama::IncrementalDetokenizer;
+
+TEST_CASE("complete length") {
+    CHECK(IncrementalDetokenizer::completeLength("") == 0);
+    CHECK(IncrementalDetokenizer::completeLength("abc") == 3);
+    CHECK(IncrementalDetokenizer::completeLength("a\xd0\xb4") == 3);
+    CHECK(IncrementalDetokenizer::completeLength("a\xd0") == 1);
+    CHECK(IncrementalDetokenizer::completeLength("\xe2\x82\xac") == 3); // euro sign
+    CHECK(IncrementalDetokenizer::completeLength("x\xe2\x82") == 1);
+    CHECK(IncrementalDetokenizer::completeLength("\xf0\x9f\x98\x80") == 4); // emoji
+    CHECK(IncrementalDetokenizer::completeLength("\xf0\x9f\x98") == 0);
+
+    // invalid bytes are not held back
+    CHECK(IncrementalDetokenizer::completeLength("a\x80") == 2);
+    CHECK(IncrementalDetokenizer::completeLength("\x80\x80\x80\x80\x80") == 5);
+    CHECK(IncrementalDetokenizer::completeLength("a\xff") == 2);
+}
+
+TEST_CASE("feed") {
+    IncrementalDetokenizer d;
+    CHECK(d.feed("hello") == "hello");
+    CHECK(d.pending().empty());
+
+    // emoji split in three pieces
+    CHECK(d.feed(" \xf0\x9f") == " ");
+    CHECK(d.pending() == "\xf0\x9f");
+    CHECK(d.feed("\x98") == "");
+    CHECK(d.feed("\x80!") == "\xf0\x9f\x98\x80!");
+    CHECK(d.pending().empty());
+
+    // a piece which ends one character and starts another
+    CHECK(d.feed("\xd0") == "");
+    CHECK(d.feed("\xb4\xe2\x82") == "\xd0\xb4");
+    CHECK(d.feed("\xac") == "\xe2\x82\xac");
+
+    d.feed("\xd0");
+    CHECK(d.pending() == "\xd0");
+    d.reset();
+    CHECK(d.pending().empty());
+    CHECK(d.feed("abc") == "abc");
+
+    // the concatenation of the output is the input text
+    const std::string text = "\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82, \xe4\xb8\x96\xe7\x95\x8c \xf0\x9f\x98\x80!";
+    for (size_t step = 1; step <= 5; ++step) {
+        d.reset();
+        std::string out;
+        for (size_t i = 0; i < text.size(); i += step) {
+            auto chunk = d.feed(std::string_view(text).substr(i, step));
+            CHECK(IncrementalDetokenizer::completeLength(chunk) == chunk.size());
+            out += chunk;
+        }
+        CHECK(d.pending().empty());
+        CHECK(out == text);
+    }
+}
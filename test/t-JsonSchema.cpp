@@ -0,0 +1,110 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include <doctest/doctest.h>
+
+#include "ac/llama/JsonSchema.hpp"
+
+#include <string>
+
+using ac::llama::jsonSchemaToGrammar;
+
+namespace {
+size_t count(const std::string& str, const std::string& sub) {
+    size_t ret = 0;
+    for (auto pos = str.find(sub); pos != std::string::npos; pos = str.find(sub, pos + 1)) {
+        ++ret;
+    }
+    return ret;
+}
+}
+
+TEST_CASE("json schema - primitives") {
+    CHECK(jsonSchemaToGrammar("{}").starts_with("root ::= value\n"));
+    CHECK(jsonSchemaToGrammar("true").starts_with("root ::= value\n"));
+    CHECK(jsonSchemaToGrammar(R"({"type": "string"})").starts_with("root ::= string\n"));
+    CHECK(jsonSchemaToGrammar(R"({"type": "integer"})").starts_with("root ::= integer\n"));
+
+    // only the used rules are added
+    auto g = jsonSchemaToGrammar(R"({"type": "boolean"})");
+    CHECK(g == "root ::= boolean\nboolean ::= (\"true\" | \"false\") space\nspace ::= | \" \" | \"\\n\"{1,2} [ \\t]{0,20}\n");
+}
+
+TEST_CASE("json schema - object") {
+    auto g = jsonSchemaToGrammar(R"({
+        "type": "object",
+        "properties": {
+            "tags": {"type": "array", "items": {"type": "string"}},
+            "name": {"type": "string"},
+            "age": {"type": "integer"}
+        },
+        "required": ["name", "age"]
+    })");
+
+    // required properties come first
+    CHECK(g.starts_with(
+        R"(root ::= "{" space "\"name\"" space ":" space string "," space "\"age\"" space ":" space integer )"
+        R"(( "," space "\"tags\"" space ":" space root-tags )? "}" space)"
+    ));
+    CHECK(g.find(R"(root-tags ::= "[" space ( string ( "," space string )* )? "]" space)") != std::string::npos);
+
+    // optional properties only
+    g = jsonSchemaToGrammar(R"({"properties": {"a": {"type": "null"}, "b": {"type": "null"}, "c": {"type": "null"}}})");
+    CHECK(g.find(R"(root ::= "{" space ( "\"a\"" space ":" space null root-tail-1 | )") == 0);
+    CHECK(count(g, "::=") == 5); // root, 2 tails, null, space
+}
+
+TEST_CASE("json schema - structural reuse") {
+    // subschemas which differ only by annotations compile to the same rule
+    auto g = jsonSchemaToGrammar(R"({
+        "type": "object",
+        "properties": {
+            "from": {"type": "object", "properties": {"x": {"type": "number"}}, "required": ["x"], "title": "Point"},
+            "to": {"type": "object", "properties": {"x": {"type": "number"}}, "required": ["x"]}
+        },
+        "required": ["from", "to"]
+    })");
+    CHECK(g.find("root-from ::=") != std::string::npos);
+    CHECK(g.find("root-to ::=") == std::string::npos);
+    CHECK(count(g, "root-from") == 3); // definition and two uses
+}
+
+TEST_CASE("json schema - refs") {
+    auto g = jsonSchemaToGrammar(R"({
+        "$defs": {
+            "node": {
+                "type": "object",
+                "properties": {
+                    "value": {"type": "integer"},
+                    "next": {"anyOf": [{"$ref": "#/$defs/node"}, {"type": "null"}]}
+                },
+                "required": ["value", "next"]
+            }
+        },
+        "$ref": "#/$defs/node"
+    })");
+    CHECK(g.starts_with("root ::= node\n"));
+    CHECK(g.find("node-next ::= node | null\n") != std::string::npos);
+}
+
+TEST_CASE("json schema - arrays and strings") {
+    auto g = jsonSchemaToGrammar(R"({"type": "array", "items": {"type": "integer"}, "minItems": 1, "maxItems": 3})");
+    CHECK(g.starts_with(R"(root ::= "[" space integer ( "," space integer ){0,2} "]" space)"));
+
+    g = jsonSchemaToGrammar(R"({"type": "string", "minLength": 2, "maxLength": 4})");
+    CHECK(g.starts_with(R"(root ::= "\"" char{2,4} "\"" space)"));
+
+    g = jsonSchemaToGrammar(R"({"enum": ["a\"b", 1, null]})");
+    CHECK(g.starts_with(R"(root ::= ("\"a\\\"b\"" | "1" | "null") space)"));
+
+    g = jsonSchemaToGrammar(R"({"type": "string", "format": "date-time"})");
+    CHECK(g.starts_with("root ::= date-time-string\n"));
+}
+
+TEST_CASE("json schema - errors") {
+    CHECK_THROWS_WITH(jsonSchemaToGrammar("{"), "Invalid JSON schema: not a valid JSON");
+    CHECK_THROWS_WITH(jsonSchemaToGrammar(R"({"type": "foo"})"), "Unsupported JSON schema type: foo");
+    CHECK_THROWS_WITH(jsonSchemaToGrammar(R"({"$ref": "#/nope"})"), "Unresolved JSON schema $ref: #/nope");
+    CHECK_THROWS(jsonSchemaToGrammar(R"({"$ref": "https://example.com/schema.json"})"));
+    CHECK_THROWS(jsonSchemaToGrammar("false"));
+}
@@ -0,0 +1,72 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include <doctest/doctest.h>
+
+#include "ac/llama/LogitComparer.hpp"
+
+using ac::llama::LogitComparer;
+using ac::llama::TokenDataVector;
+
+TEST_CASE("compare - equal") {
+    TokenDataVector data = {{5, 20.f}, {3, 18.5f}, {100, 17.f}, {7, 12.f}, {42, 11.9f}};
+    CHECK(LogitComparer::compare(data, data));
+    CHECK(LogitComparer::logitSimilarity(data, data) == doctest::Approx(1.f));
+
+    // order of tokens doesn't matter
+    TokenDataVector shuffled = {{42, 11.9f}, {100, 17.f}, {5, 20.f}, {7, 12.f}, {3, 18.5f}};
+    CHECK(LogitComparer::compare(data, shuffled));
+    CHECK(LogitComparer::logitSimilarity(data, shuffled) == doctest::Approx(1.f));
+
+    CHECK(LogitComparer::compare({}, {}));
+}
+
+TEST_CASE("compare - small differences") {
+    TokenDataVector data1 = {{5, 20.f}, {3, 18.5f}, {100, 17.f}, {7, 12.f}, {42, 11.9f}};
+    TokenDataVector data2 = {{5, 20.05f}, {3, 18.45f}, {100, 17.02f}, {7, 12.f}, {42, 11.85f}};
+    CHECK(LogitComparer::compare(data1, data2));
+
+    auto sim = LogitComparer::logitSimilarity(data1, data2);
+    CHECK(sim < 1.f);
+    CHECK(sim > 0.99f);
+}
+
+TEST_CASE("compare - different") {
+    TokenDataVector data1 = {{5, 20.f}, {3, 18.5f}, {100, 17.f}, {7, 12.f}, {42, 11.9f}};
+
+    // distance
+    TokenDataVector scaled = {{5, 25.f}, {3, 18.5f}, {100, 17.f}, {7, 12.f}, {42, 11.9f}};
+    CHECK_FALSE(LogitComparer::compare(data1, scaled));
+
+    // different tokens
+    TokenDataVector otherTokens = {{5, 20.f}, {3, 18.5f}, {101, 17.f}, {8, 12.f}, {42, 11.9f}};
+    CHECK_FALSE(LogitComparer::compare(data1, otherTokens));
+    CHECK(LogitComparer::logitSimilarity(data1, otherTokens) < 0.7f);
+
+    // same distance, but different distribution
+    TokenDataVector swapped = {{3, 20.f}, {5, 18.5f}, {100, 17.f}, {7, 12.f}, {42, 11.9f}};
+    CHECK_FALSE(LogitComparer::compare(data1, swapped));
+}
+
+TEST_CASE("compare traces") {
+    std::vector<TokenDataVector> trace1, trace2;
+    for (int i = 0; i < 100; ++i) {
+        TokenDataVector step = {{i, 20.f}, {i + 1, 18.5f}, {i + 2, 17.f}, {i + 3, 12.f}};
+        trace1.push_back(step);
+        if (i % 10 == 0) {
+            step[0].logit = 30.f;
+        }
+        trace2.push_back(step);
+    }
+
+    auto res = LogitComparer::compareTraces(trace1, trace2, 4);
+    REQUIRE(res.size() == trace1.size());
+    for (size_t i = 0; i < res.size(); ++i) {
+        CHECK(res[i].equal == LogitComparer::compare(trace1[i], trace2[i]));
+        CHECK(res[i].similarity == LogitComparer::logitSimilarity(trace1[i], trace2[i]));
+        CHECK(res[i].equal == (i % 10 != 0));
+    }
+
+    CHECK_THROWS_WITH(LogitComparer::compareTraces(trace1, {trace2.data(), 5}),
+        "LogitComparer: traces have different lengths: 100 vs 5");
+}
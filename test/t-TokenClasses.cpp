@@ -0,0 +1,30 @@
+// Copyright (c) Alpaca Core
+// SPDX-License-Identifier: MIT
+//
+#include <doctest/doctest.h>
+
+#include "ac/llama/TokenClasses.hpp"
+
+using ac::llama::TokenClasses;
+
+TEST_CASE("classify") {
+    CHECK(TokenClasses::classify("") == 0);
+    CHECK(TokenClasses::classify("abc") == TokenClasses::Letter);
+    CHECK(TokenClasses::classify(" le") == (TokenClasses::Space | TokenClasses::Letter));
+    CHECK(TokenClasses::classify("\n\n") == TokenClasses::Newline);
+    CHECK(TokenClasses::classify("\r") == TokenClasses::Newline);
+    CHECK(TokenClasses::classify("\t") == TokenClasses::Space);
+    CHECK(TokenClasses::classify("2024") == TokenClasses::Digit);
+    CHECK(TokenClasses::classify("x1,") == (TokenClasses::Letter | TokenClasses::Digit | TokenClasses::Punct));
+    CHECK(TokenClasses::classify("\x01") == TokenClasses::Control);
+    CHECK(TokenClasses::classify("\x7f") == TokenClasses::Control);
+    CHECK(TokenClasses::classify("\xd0\xb4a") == (TokenClasses::NonAscii | TokenClasses::Letter));
+    CHECK(TokenClasses::classify("\xe2\x80") == TokenClasses::NonAscii); // incomplete character
+}
+
+TEST_CASE("names") {
+    CHECK(TokenClasses::fromName("newline") == TokenClasses::Newline);
+    CHECK(TokenClasses::fromName("non_ascii") == TokenClasses::NonAscii);
+    CHECK(TokenClasses::fromName("special") == TokenClasses::Special);
+    CHECK_THROWS_WITH(TokenClasses::fromName("digits"), "Unknown token class: digits");
+}
@@ -6,11 +6,23 @@
 #include <ac/llama/Instance.hpp>
 #include <ac/llama/InstanceEmbedding.hpp>
 #include <ac/llama/Session.hpp>
+#include <ac/llama/StreamingTokenizer.hpp>
+#include <ac/llama/BatchSampler.hpp>
+#include <ac/llama/TokenTrie.hpp>
+#include <ac/llama/TokenClasses.hpp>
 #include <ac/llama/ControlVector.hpp>
+#include <ac/llama/Evaluator.hpp>
+#include <ac/llama/ChoiceScorer.hpp>
+#include <ac/llama/ModelVerifier.hpp>
 #include <ac/llama/ResourceCache.hpp>
 
+#include <llama.h> // for reference results
+
 #include <doctest/doctest.h>
 
+#include <filesystem>
+#include <fstream>
+
 #include "ac-test-data-llama-dir.h"
 
 struct GlobalFixture {
@@ -44,6 +56,129 @@ TEST_CASE("vocab only") {
     auto& vocab = model->vocab();
     CHECK(vocab.tokenToString(443) == " le");
     CHECK(vocab.tokenize("hello world", true, true) == std::vector<ac::llama::Token>{31373, 995});
+
+    CHECK(vocab.tokenPiece(443) == " le");
+    CHECK(vocab.tokenPiece(-1).empty());
+    CHECK(vocab.tokenPiece(vocab.nTokens()).empty());
+    auto tokens = vocab.tokenize("hello world, pieces", false, false);
+    CHECK(vocab.detokenize(tokens) == "hello world, pieces");
+    std::string out = ">";
+    vocab.detokenize(tokens, out);
+    CHECK(out == ">hello world, pieces");
+}
+
+TEST_CASE("tokenize cache") {
+    auto model = resourceCache.getModel({
+        .gguf = Model_117m_q6_k,
+        .params = {.vocabOnly = true, .tokenizeCacheSize = 1024}
+    });
+    auto& vocab = model->vocab();
+
+    auto tokens = vocab.tokenize("You are a helpful assistant.", true, true);
+    CHECK(vocab.tokenize("You are a helpful assistant.", true, true) == tokens);
+    vocab.tokenize("You are a helpful assistant.", false, false); // flags are part of the key
+
+    auto stats = vocab.tokenizeCacheStats();
+    CHECK(stats.hits == 1);
+    CHECK(stats.misses == 2);
+    CHECK(stats.entries == 2);
+
+    // the budget is respected
+    for (int i = 0; i < 100; ++i) {
+        vocab.tokenize("message " + std::to_string(i), false, false);
+    }
+    stats = vocab.tokenizeCacheStats();
+    CHECK(stats.evictions > 0);
+    CHECK(stats.bytes <= 1024);
+
+    // no cache
+    CHECK(resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {.vocabOnly = true}})
+        ->vocab().tokenizeCacheStats().misses == 0);
+}
+
+TEST_CASE("tokenize batch") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {.vocabOnly = true}});
+    auto& vocab = model->vocab();
+
+    std::vector<std::string> docs;
+    for (int i = 0; i < 200; ++i) {
+        std::string doc;
+        for (int j = 0; j < i % 50; ++j) {
+            doc += "Document " + std::to_string(i) + " line " + std::to_string(j) + ": the quick brown fox.\n";
+        }
+        docs.push_back(std::move(doc));
+    }
+    std::vector<std::string_view> texts(docs.begin(), docs.end());
+
+    for (uint32_t numThreads : {1u, 4u}) {
+        auto batch = vocab.tokenizeBatch(texts, true, true, numThreads);
+        REQUIRE(batch.size() == docs.size());
+        CHECK(batch.offsets.back() == batch.tokens.size());
+        for (size_t i = 0; i < docs.size(); ++i) {
+            auto expected = vocab.tokenize(docs[i], true, true);
+            auto tokens = batch[i];
+            CHECK(std::vector<ac::llama::Token>(tokens.begin(), tokens.end()) == expected);
+        }
+    }
+
+    CHECK(vocab.tokenizeBatch({}, false, false).size() == 0);
+}
+
+TEST_CASE("streaming tokenizer") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {.vocabOnly = true}});
+    auto& vocab = model->vocab();
+
+    std::string text;
+    for (int i = 0; i < 300; ++i) {
+        text += "Paragraph " + std::to_string(i) + ":  the quick brown fox\tjumps over the lazy dog.\n\n";
+    }
+
+    std::vector<ac::llama::Token> tokens;
+    size_t maxBuffered = 0;
+    ac::llama::StreamingTokenizer st(vocab, {.chunkSize = 256}, [&](std::span<const ac::llama::Token> chunk) {
+        tokens.insert(tokens.end(), chunk.begin(), chunk.end());
+    });
+
+    // feed in pieces which don't match the word boundaries
+    for (size_t i = 0; i < text.size(); i += 37) {
+        st.feed(std::string_view(text).substr(i, 37));
+        maxBuffered = std::max(maxBuffered, st.bufferedBytes());
+    }
+    st.finish();
+    CHECK(st.bufferedBytes() == 0);
+    CHECK(maxBuffered < 512);
+    CHECK(tokens == vocab.tokenize(text, true, false));
+
+    CHECK(ac::llama::StreamingTokenizer::splitPoint("hello world") == 5);
+    CHECK(ac::llama::StreamingTokenizer::splitPoint("hello  world") == 0);
+    CHECK(ac::llama::StreamingTokenizer::splitPoint("hello world", 6) == 0);
+}
+
+TEST_CASE("streaming tokenizer wpm") {
+    auto model = resourceCache.getModel({
+        .gguf = AC_TEST_DATA_LLAMA_DIR "/bge-small-en-v1.5-f16.gguf",
+        .params = {.vocabOnly = true}
+    });
+    auto& vocab = model->vocab();
+
+    std::string text;
+    for (int i = 0; i < 300; ++i) {
+        text += "Section " + std::to_string(i) + ": The quick-brown fox's\tjumps, over (the) lazy dogs!\n\n";
+    }
+
+    std::vector<ac::llama::Token> tokens;
+    size_t maxBuffered = 0;
+    ac::llama::StreamingTokenizer st(vocab, {.chunkSize = 256}, [&](std::span<const ac::llama::Token> chunk) {
+        tokens.insert(tokens.end(), chunk.begin(), chunk.end());
+    });
+
+    for (size_t i = 0; i < text.size(); i += 37) {
+        st.feed(std::string_view(text).substr(i, 37));
+        maxBuffered = std::max(maxBuffered, st.bufferedBytes());
+    }
+    st.finish();
+    CHECK(maxBuffered < 512); // the text is not buffered until finish
+    CHECK(tokens == vocab.tokenize(text, true, false));
 }
 
 TEST_CASE("inference") {
@@ -183,6 +318,672 @@ TEST_CASE("session") {
     }
 }
 
+TEST_CASE("choose") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {}});
+    auto& vocab = model->vocab();
+    ac::llama::Instance inst(*model, {});
+
+    auto& s = inst.startSession({});
+    s.setInitialPrompt(vocab.tokenize("President George W.", true, true));
+
+    std::vector<std::string> options = {" Washington", " Bush", " Obama"};
+    auto choice = s.choose(options);
+    CHECK(choice.index == 1);
+    CHECK(choice.probability > 0.5f);
+    CHECK(choice.probability <= 1.f);
+
+    // the context continues from the choice
+    auto t = s.getToken();
+    CHECK(vocab.tokenToString(t) != " Bush");
+
+    // a single (or the same) option needs no decision
+    choice = s.choose(std::vector<std::string>{" and", " and"});
+    CHECK(choice.index == 0);
+    CHECK(choice.probability == 1.f);
+
+    CHECK_THROWS_WITH(s.choose({}), "No options to choose from");
+    inst.stopSession();
+
+    // an option which is a prefix of another
+    const auto prompt = vocab.tokenize("Is the sky blue? Answer:", true, true);
+    const std::vector<std::string> prefixOptions = {" yes please", " yes"};
+    ac::llama::Token chosenNext;
+    {
+        auto& ps = inst.startSession({});
+        ps.setInitialPrompt(prompt);
+        choice = ps.choose(prefixOptions);
+        CHECK(choice.index < 2);
+        CHECK(choice.probability > 0.f);
+        CHECK(choice.probability < 1.f);
+        chosenNext = ps.getSampledTokenData(1).front().token;
+        inst.stopSession();
+    }
+
+    // the context continues from the chosen option, as if it were in the prompt
+    auto full = prompt;
+    auto chosen = vocab.tokenize(prefixOptions[choice.index], false, false);
+    full.insert(full.end(), chosen.begin(), chosen.end());
+    auto& ref = inst.startSession({});
+    ref.setInitialPrompt(full);
+    CHECK(ref.getSampledTokenData(1).front().token == chosenNext);
+    inst.stopSession();
+}
+
+TEST_CASE("grammar cache") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {}});
+    auto& cache = model->grammarCache();
+
+    const std::string grammar = R"(root ::= "yes" | "no")";
+
+    const auto before = cache.stats();
+    auto g1 = cache.get(grammar);
+    auto g2 = cache.get(grammar);
+    CHECK(g1 == g2);
+    CHECK(cache.stats().misses == before.misses + 1);
+    CHECK(cache.stats().hits == before.hits + 1);
+
+    // samplers of new instances reuse the parsed grammar
+    ac::llama::Instance inst1(*model, {.grammar = grammar});
+    ac::llama::Instance inst2(*model, {.grammar = grammar});
+    CHECK(cache.stats().misses == before.misses + 1);
+    CHECK(cache.stats().hits == before.hits + 3);
+
+    CHECK_THROWS_WITH(cache.get("root ::= ("), "Failed to parse grammar");
+
+    // schemas are compiled once
+    const std::string schema = R"({"type": "object", "properties": {"answer": {"enum": ["yes", "no"]}}, "required": ["answer"]})";
+    ac::llama::Instance inst3(*model, {.jsonSchema = schema});
+    ac::llama::Instance inst4(*model, {.jsonSchema = schema});
+    CHECK(cache.stats().schemaMisses == before.schemaMisses + 1);
+    CHECK(cache.stats().schemaHits == before.schemaHits + 1);
+
+    auto& s = inst3.startSession({});
+    s.setInitialPrompt(model->vocab().tokenize("Is the sky blue?", true, true));
+    std::string result;
+    for (int i = 0; i < 32; ++i) {
+        auto t = s.getToken();
+        if (t == ac::llama::Token_Invalid) break;
+        result += model->vocab().tokenToString(t);
+    }
+    CHECK(result.starts_with("{"));
+    CHECK((result.find("\"answer\"") != std::string::npos));
+}
+
+TEST_CASE("jump forward") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {}});
+    auto& vocab = model->vocab();
+    ac::llama::Instance inst(*model, {.grammar = R"(root ::= "{\"answer\": \"" ("yes" | "no") "\"}")"});
+
+    auto generate = [&](bool jumpForward) {
+        auto& s = inst.startSession({.jumpForward = jumpForward});
+        s.setInitialPrompt(vocab.tokenize("Is the sky blue?", true, true));
+        std::string result;
+        for (int i = 0; i < 32; ++i) {
+            auto t = s.getToken();
+            if (t == ac::llama::Token_Invalid) break;
+            result += vocab.tokenToString(t);
+        }
+        inst.stopSession();
+        return result;
+    };
+
+    for (bool jf : {false, true}) {
+        auto result = generate(jf);
+        CHECK((result == R"({"answer": "yes"})" || result == R"({"answer": "no"})"));
+    }
+
+    // nothing is forced without a grammar
+    CHECK(ac::llama::Instance(*model, {}).sampler().forcedText().empty());
+
+    auto& s = inst.startSession({});
+    s.setInitialPrompt(vocab.tokenize("Is the sky blue?", true, true));
+    CHECK(inst.sampler().forcedText() == R"({"answer": ")");
+    inst.stopSession();
+
+    // the interaction continues from what getToken returned, not from the rest of the forced tokens
+    const auto prompt = vocab.tokenize("Is the sky blue?", true, true);
+    const auto next = vocab.tokenize(" Is the grass green?", false, false);
+    auto& js = inst.startSession({.jumpForward = true});
+    js.setInitialPrompt(prompt);
+    const auto first = js.getToken(); // the rest of the forced tokens are in the context, but not returned
+    js.pushPrompt(next);
+    const auto jumped = js.getSampledTokenData(1);
+    inst.stopSession();
+    REQUIRE(jumped.size() == 1);
+
+    auto& ref = inst.startSession({});
+    auto refPrompt = prompt;
+    refPrompt.push_back(first);
+    ref.setInitialPrompt(refPrompt);
+    ref.pushPrompt(next);
+    auto refData = ref.getSampledTokenData(1);
+    inst.stopSession();
+    REQUIRE(refData.size() == 1);
+    CHECK(jumped[0].token == refData[0].token);
+    CHECK(jumped[0].logit == doctest::Approx(refData[0].logit).epsilon(0.01));
+}
+
+TEST_CASE("lazy grammar") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {}});
+    auto& vocab = model->vocab();
+    ac::llama::Instance inst(*model, {
+        .grammar = R"(root ::= " Bush" "!!!")",
+        .grammarTriggerWords = {" Bush"},
+    });
+    auto& sampler = inst.sampler();
+
+    // the grammar is dormant until triggered
+    CHECK_FALSE(sampler.grammarActive());
+    CHECK(sampler.forcedText().empty());
+
+    for (auto t : vocab.tokenize("President George W.", false, false)) {
+        sampler.accept(t, true);
+    }
+    CHECK_FALSE(sampler.grammarActive());
+
+    // the trigger is fed to the grammar, so only the rest is left
+    sampler.accept(vocab.tokenize(" Bush", false, false).front(), true);
+    CHECK(sampler.grammarActive());
+    CHECK(sampler.forcedText() == "!!!");
+
+    sampler.reset();
+    CHECK_FALSE(sampler.grammarActive());
+}
+
+TEST_CASE("adaptive grammar first") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {}});
+    auto& vocab = model->vocab();
+    ac::llama::Instance inst(*model, {});
+
+    // the model is unlikely to produce this on its own, so most verifications fail
+    ac::llama::Sampler::Params params;
+    params.grammar = R"(root ::= "x"{40})";
+
+    auto generate = [&](bool adaptive) {
+        params.adaptiveGrammarFirst = adaptive;
+        inst.resetSampler(params);
+        auto& s = inst.startSession({});
+        s.setInitialPrompt(vocab.tokenize("Is the sky blue?", true, true));
+        uint64_t numTokens = 0;
+        for (int i = 0; i < 64; ++i) {
+            auto t = s.getToken();
+            if (t == ac::llama::Token_Invalid) break;
+            ++numTokens;
+        }
+        auto stats = inst.sampler().grammarStats();
+        inst.stopSession();
+
+        // the final sample is the end of generation
+        CHECK(stats.verified + stats.grammarFirst == numTokens + 1);
+        CHECK(stats.rejected <= stats.verified);
+        return stats;
+    };
+
+    auto fixed = generate(false);
+    CHECK(fixed.grammarFirst == 0);
+    CHECK(fixed.switches == 0);
+    CHECK(fixed.rejected > 0);
+
+    auto adaptive = generate(true);
+    CHECK(adaptive.switches > 0);
+    CHECK(adaptive.grammarFirst > 0);
+}
+
+TEST_CASE("sampler params") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {}});
+    auto& vocab = model->vocab();
+    ac::llama::Instance inst(*model, {});
+    auto* sampler = &inst.sampler();
+
+    auto generate = [&] {
+        auto& s = inst.startSession({});
+        s.setInitialPrompt(vocab.tokenize("President George W.", true, true));
+        std::string result;
+        for (int i = 0; i < 8; ++i) {
+            auto t = s.getToken();
+            if (t == ac::llama::Token_Invalid) break;
+            result += vocab.tokenToString(t);
+        }
+        inst.stopSession();
+        return result;
+    };
+
+    ac::llama::Sampler::Params greedy;
+    greedy.temp = 0;
+    inst.resetSampler(greedy);
+    CHECK(&inst.sampler() == sampler); // reconfigured in place
+    const auto text = generate();
+    CHECK(text.starts_with(" Bush"));
+
+    // the llama.cpp chain
+    auto params = greedy;
+    params.fusedChain = false;
+    inst.resetSampler(params);
+    CHECK(generate() == text);
+
+    params = greedy;
+    params.grammar = R"(root ::= " Obama")";
+    inst.resetSampler(params);
+    CHECK(generate() == " Obama");
+
+    inst.resetSampler(greedy);
+    CHECK(generate() == text);
+    CHECK(&inst.sampler() == sampler);
+}
+
+TEST_CASE("dry penalty") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {}});
+    auto& vocab = model->vocab();
+    ac::llama::Instance inst(*model, {});
+
+    auto next = [&](const ac::llama::Sampler::Params& params) {
+        inst.resetSampler(params);
+        auto& s = inst.startSession({});
+        s.setInitialPrompt(vocab.tokenize("one two three one two three one two", true, true));
+        auto t = s.getToken();
+        inst.stopSession();
+        return vocab.tokenToString(t);
+    };
+
+    ac::llama::Sampler::Params params;
+    params.temp = 0;
+    CHECK(next(params) == " three");
+
+    // the prompt is accepted in bulk and counts as history
+    params.dry.multiplier = 10;
+    CHECK(next(params) != " three");
+
+    // same with the llama.cpp chain
+    params.fusedChain = false;
+    CHECK(next(params) != " three");
+}
+
+TEST_CASE("sampler metrics") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {}});
+    auto& vocab = model->vocab();
+    ac::llama::Instance inst(*model, {.samplerMetrics = true});
+
+    auto generate = [&](int n) {
+        auto& s = inst.startSession({});
+        s.setInitialPrompt(vocab.tokenize("President George W.", true, true));
+        for (int i = 0; i < n; ++i) {
+            s.getToken();
+        }
+        inst.stopSession();
+    };
+
+    auto findStage = [&](std::string_view name) -> const ac::llama::Sampler::StageMetrics* {
+        for (auto& s : inst.sampler().metrics().stages) {
+            if (s.name == name) return &s;
+        }
+        return nullptr;
+    };
+
+    generate(5);
+    auto& metrics = inst.sampler().metrics();
+    CHECK(metrics.samples == 5);
+    CHECK(metrics.timeNs > 0);
+
+    auto topK = findStage("top-k");
+    REQUIRE(topK);
+    CHECK(topK->calls == 5);
+    CHECK(topK->candidatesIn == 5 * uint64_t(vocab.nTokens()));
+    CHECK(topK->candidatesOut == 5 * 40);
+    CHECK(findStage("dist"));
+
+    // the llama.cpp chain reports each sampler
+    ac::llama::Sampler::Params params;
+    params.collectMetrics = true;
+    params.fusedChain = false;
+    params.samplerSequence = {
+        ac::llama::Sampler::SamplingType::Top_K,
+        ac::llama::Sampler::SamplingType::Temperature,
+    };
+    inst.resetSampler(params);
+    inst.sampler().perfReset();
+    CHECK(metrics.stages.empty());
+    generate(3);
+    CHECK(metrics.samples == 3);
+    topK = findStage("top-k");
+    REQUIRE(topK);
+    CHECK(topK->calls == 3);
+    CHECK(topK->candidatesOut == 3 * 40);
+
+    // with a grammar which the model doesn't follow, the grammar stage is first reached from within the top-k one
+    // (which selects the candidates again after the sampled token is rejected)
+    params = {};
+    params.collectMetrics = true;
+    params.grammar = R"(root ::= "x"{40})";
+    inst.resetSampler(params);
+    inst.sampler().perfReset();
+    generate(5);
+    CHECK(metrics.samples == 5);
+    topK = findStage("top-k");
+    REQUIRE(topK);
+    CHECK(topK->calls > 0);
+    CHECK(topK->candidatesOut <= topK->calls * 40);
+    auto grammar = findStage("grammar");
+    REQUIRE(grammar);
+    CHECK(grammar->calls > 0);
+    CHECK(grammar->candidatesOut < grammar->candidatesIn);
+
+    params.collectMetrics = false;
+    inst.resetSampler(params);
+    inst.sampler().perfReset();
+    generate(3);
+    CHECK(metrics.samples == 0);
+    CHECK(metrics.stages.empty());
+}
+
+TEST_CASE("token classes") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {}});
+    auto& vocab = model->vocab();
+    using TokenClasses = ac::llama::TokenClasses;
+
+    auto& classes = model->tokenClasses();
+    CHECK(&classes == &model->tokenClasses()); // cached
+    CHECK(classes.masks().size() == size_t(vocab.nTokens()));
+    CHECK(classes.of(443) == (TokenClasses::Space | TokenClasses::Letter)); // " le"
+    CHECK(classes.of(vocab.tokenize("2024", false, false).front()) == TokenClasses::Digit);
+
+    ac::llama::Instance inst(*model, {});
+
+    auto generate = [&](const ac::llama::Sampler::Params& params) {
+        inst.resetSampler(params);
+        auto& s = inst.startSession({});
+        s.setInitialPrompt(vocab.tokenize("1, 2, 3, 4, 5, 6,", true, true));
+        std::string result;
+        for (int i = 0; i < 4; ++i) {
+            result += vocab.tokenToString(s.getToken());
+        }
+        inst.stopSession();
+        return result;
+    };
+
+    ac::llama::Sampler::Params params;
+    params.temp = 0;
+    CHECK(generate(params).starts_with(" 7"));
+
+    params.bannedClasses = TokenClasses::Digit;
+    auto text = generate(params);
+    CHECK(text.find_first_of("0123456789") == std::string::npos);
+
+    // same with the llama.cpp chain
+    params.fusedChain = false;
+    CHECK(generate(params) == text);
+
+    // a large enough bias is the same as a ban
+    params.bannedClasses = 0;
+    params.classBias = {{.classes = TokenClasses::Digit, .bias = -1000}};
+    CHECK(generate(params) == text);
+}
+
+TEST_CASE("batch sampler") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {}});
+    auto& vocab = model->vocab();
+    ac::llama::Instance inst(*model, {});
+    auto& s = inst.startSession({});
+    s.setInitialPrompt(vocab.tokenize("My favorite animal is the", true, true));
+
+    // all sequences sample from the same logits, but have their own state
+    // the result must be the same as sampling each sequence separately
+    constexpr size_t numSeqs = 6;
+    std::vector<std::unique_ptr<ac::llama::Sampler>> batched, serial;
+    for (size_t i = 0; i < numSeqs; ++i) {
+        ac::llama::Sampler::Params params;
+        params.rngSeed = uint32_t(i);
+        params.temp = 1.5f;
+        if (i % 2) {
+            params.grammar = R"(root ::= " cat" | " dog" | " horse")";
+        }
+        batched.push_back(std::make_unique<ac::llama::Sampler>(*model, params));
+        serial.push_back(std::make_unique<ac::llama::Sampler>(*model, params));
+    }
+
+    std::vector<ac::llama::Sampler*> samplers;
+    for (auto& b : batched) samplers.push_back(b.get());
+    const std::vector<int32_t> idxs(numSeqs, -1);
+
+    ac::llama::BatchSampler bs({.numThreads = 3});
+    for (int step = 0; step < 4; ++step) {
+        auto tokens = bs.sample(inst.lctx(), samplers, idxs);
+        REQUIRE(tokens.size() == numSeqs);
+        for (size_t i = 0; i < numSeqs; ++i) {
+            auto t = serial[i]->sample(inst.lctx());
+            CHECK(tokens[i] == t);
+            batched[i]->accept(tokens[i], true);
+            serial[i]->accept(t, true);
+        }
+    }
+
+    CHECK_THROWS_WITH(bs.sample(inst.lctx(), samplers, std::span(idxs).subspan(1)),
+        "BatchSampler: 6 samplers for 5 outputs");
+    inst.stopSession();
+}
+
+TEST_CASE("token trie") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {}});
+    auto& vocab = model->vocab();
+    auto& trie = model->tokenTrie();
+    CHECK(&trie == &model->tokenTrie());
+
+    CHECK(trie.subtreeTokens(trie.root()).size() + trie.eogTokens().size() == size_t(vocab.nTokens()));
+
+    for (auto t : {vocab.tokenize("hello", false, false)[0], vocab.tokenize(" world", false, false)[0]}) {
+        auto node = trie.find(vocab.tokenToString(t));
+        REQUIRE(node);
+        auto tokens = trie.tokens(*node);
+        CHECK(std::find(tokens.begin(), tokens.end(), t) != tokens.end());
+
+        // every token in the subtree starts with the prefix
+        for (auto st : trie.subtreeTokens(*node)) {
+            CHECK(vocab.tokenToString(st).starts_with(vocab.tokenToString(t)));
+        }
+    }
+
+    CHECK_FALSE(trie.find("\xff\xff\xff\xff"));
+}
+
+TEST_CASE("grammar mask") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {}});
+    auto& vocab = model->vocab();
+    using Token = ac::llama::Token;
+
+    const std::string grammar = R"(
+root   ::= object
+value  ::= object | array | string | number | ("true" | "false" | "null") ws
+object ::= "{" ws ( string ":" ws value ("," ws string ":" ws value)* )? "}" ws
+array  ::= "[" ws ( value ("," ws value)* )? "]" ws
+string ::= "\"" ( [^"\\\x7F\x00-\x1F] | "\\" (["\\bfnrt] | "u" [0-9a-fA-F]{4}) )* "\"" ws
+number ::= ("-"? ([0-9] | [1-9] [0-9]{0,15})) ("." [0-9]+)? ([eE] [-+]? [0-9] [1-9]{0,15})? ws
+ws     ::= | " " | "\n" [ \t]{0,20}
+)";
+
+    ac::llama::Sampler::Params params;
+    params.grammar = grammar;
+    ac::llama::Sampler sampler(*model, params);
+
+    // the trie walk must give the same mask as the grammar applied to the whole vocabulary
+    std::unique_ptr<llama_sampler, decltype(&llama_sampler_free)> ref(
+        llama_sampler_init_grammar(vocab.lvocab(), grammar.c_str(), "root"), llama_sampler_free);
+    REQUIRE(ref);
+
+    std::vector<llama_token_data> cur;
+    auto numAllowed = [&] {
+        auto allowed = sampler.allowedTokens();
+        REQUIRE(allowed.size() == size_t(vocab.nTokens()));
+
+        cur.clear();
+        for (Token t = 0; t < vocab.nTokens(); ++t) {
+            cur.push_back({t, 0.f, 0.f});
+        }
+        llama_token_data_array arr = {cur.data(), cur.size(), -1, false};
+        llama_sampler_apply(ref.get(), &arr);
+
+        size_t mismatches = 0;
+        size_t ret = 0;
+        for (size_t i = 0; i < cur.size(); ++i) {
+            const bool fits = cur[i].logit != -INFINITY;
+            mismatches += fits != bool(allowed[i]);
+            ret += fits;
+        }
+        CHECK(mismatches == 0);
+        return ret;
+    };
+
+    auto accept = [&](std::span<const Token> tokens) {
+        for (auto t : tokens) {
+            sampler.accept(t, true);
+            llama_sampler_accept(ref.get(), t);
+        }
+    };
+    auto acceptText = [&](std::string_view text) {
+        accept(vocab.tokenize(text, false, false));
+    };
+
+    // the token of a single byte (which isn't valid UTF-8 on its own)
+    auto byteToken = [&](char byte) {
+        for (Token t = 0; t < vocab.nTokens(); ++t) {
+            if (vocab.tokenPiece(t) == std::string_view(&byte, 1)) return t;
+        }
+        return ac::llama::Token_Invalid;
+    };
+
+    auto n = numAllowed(); // the start of an object
+    CHECK(n > 0);
+    CHECK(n < 1000);
+
+    acceptText("{\"name\": \"");
+    const auto freeText = numAllowed(); // free text in a string
+    CHECK(freeText > size_t(vocab.nTokens()) / 2);
+
+    // partial UTF-8: an em dash (E2 80 94) one byte at a time
+    for (char byte : {'\xe2', '\x80', '\x94'}) {
+        n = numAllowed();
+        CHECK(n > 0);
+        CHECK(n <= freeText);
+        const Token t[] = {byteToken(byte)};
+        REQUIRE(t[0] != ac::llama::Token_Invalid);
+        accept(t);
+    }
+
+    acceptText("\", \"age\": 4");
+    n = numAllowed(); // more digits, a fraction, the end of the object...
+    CHECK(n > 0);
+    CHECK(n < freeText);
+
+    acceptText("2}");
+    n = numAllowed(); // white space and the end of generation
+    CHECK(n > 0);
+    for (auto t : model->tokenTrie().eogTokens()) {
+        CHECK(sampler.allowedTokens()[size_t(t)]);
+    }
+}
+
+TEST_CASE("fused sampler") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {}});
+    ac::llama::Instance inst(*model, {});
+
+    auto prompt = model->vocab().tokenize("The best thing about the city is", true, true);
+
+    auto generate = [&](const ac::llama::Sampler::Params& params) {
+        inst.resetSampler(params);
+        auto& s = inst.startSession({});
+        s.setInitialPrompt(prompt);
+        std::vector<ac::llama::Token> ret;
+        for (int i = 0; i < 16; ++i) {
+            ret.push_back(s.getToken());
+        }
+        inst.stopSession();
+        return ret;
+    };
+
+    using SamplingType = ac::llama::Sampler::SamplingType;
+
+    // greedy sampling with penalties and bias must give the same results on the fused and the llama.cpp chain
+    ac::llama::Sampler::Params greedy;
+    greedy.temp = 0;
+    greedy.repetitionPenalty.repeat = 1.3f;
+    greedy.logitBias[model->vocab().tokenize(" the", false, false).front()] = -5;
+    greedy.samplerSequence = {SamplingType::Top_K, SamplingType::Temperature};
+    auto fused = generate(greedy);
+
+    greedy.fusedChain = false;
+    auto general = generate(greedy);
+    CHECK(fused == general);
+    greedy.fusedChain = true;
+
+    // the same seed gives the same results
+    ac::llama::Sampler::Params seeded;
+    seeded.rngSeed = 42;
+    const auto seededFused = generate(seeded);
+    CHECK(generate(seeded) == seededFused);
+
+    // ... on both paths, as the random choice is made with the same distribution and generator as in llama.cpp
+    seeded.fusedChain = false;
+    CHECK(generate(seeded) == seededFused);
+
+    seeded.rngSeed = 7;
+    seeded.temp = 1.5f;
+    seeded.repetitionPenalty.repeat = 1.2f;
+    const auto seededGeneral = generate(seeded);
+    seeded.fusedChain = true;
+    CHECK(generate(seeded) == seededGeneral);
+
+    // without top-k all tokens are candidates
+    greedy.topK = 0;
+    CHECK(generate(greedy) == fused);
+}
+
+TEST_CASE("sort-free sampling") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {}});
+    ac::llama::Instance inst(*model, {});
+
+    auto prompt = model->vocab().tokenize("The best thing about the city is", true, true);
+
+    using SamplingType = ac::llama::Sampler::SamplingType;
+
+    // the stages keep the same candidates as the llama.cpp ones, which we see in the metrics of a single token
+    auto kept = [&](ac::llama::Sampler::Params params) {
+        params.collectMetrics = true;
+        inst.resetSampler(params);
+        inst.sampler().perfReset();
+        auto& s = inst.startSession({});
+        s.setInitialPrompt(prompt);
+        s.getToken();
+        inst.stopSession();
+
+        std::vector<uint64_t> ret;
+        for (auto& stage : inst.sampler().metrics().stages) {
+            if (stage.name == "typical" || stage.name == "top-p" || stage.name == "min-p") {
+                ret.push_back(stage.candidatesOut);
+            }
+        }
+        return ret;
+    };
+
+    ac::llama::Sampler::Params params;
+    params.topK = 0;
+    params.temp = 1.5f;
+    params.typicalP = 0.98f;
+    params.topP = 0.9f;
+    params.minP = 0.001f;
+    params.samplerSequence = {SamplingType::Typical_P, SamplingType::Top_P, SamplingType::Min_P, SamplingType::Temperature};
+    const auto fused = kept(params);
+    REQUIRE(fused.size() == 3);
+    CHECK(fused[0] > 1024); // large enough not to be sorted
+
+    // the llama.cpp chain
+    params.fusedChain = false;
+    const auto general = kept(params);
+
+    // the probabilities are summed in a different order, so the cut may differ by rounding
+    REQUIRE(general.size() == 3);
+    for (size_t i = 0; i < 3; ++i) {
+        CHECK(double(fused[i]) == doctest::Approx(double(general[i])).epsilon(0.01));
+    }
+}
+
 // commented out because it relies on specific calc
 //TEST_CASE("session states") {
 //    ac::llama::Model::Params iParams = {};
@@ -459,3 +1260,149 @@ TEST_CASE("embedding") {
         REQUIRE(embeddings[i] == doctest::Approx(expected[i]).epsilon(0.001));
     }
 }
+
+TEST_CASE("evaluator") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {}});
+
+    std::string text;
+    for (int i = 0; i < 8; ++i) {
+        text += "The quick brown fox jumps over the lazy dog. "
+            "A journey of a thousand miles begins with a single step. ";
+    }
+    auto tokens = model->vocab().tokenize(text, false, false);
+    REQUIRE(tokens.size() > 100);
+
+    ac::llama::Instance inst(*model, {.ctxSize = 512, .maxSequences = 4});
+    ac::llama::Instance ref(*model, {.ctxSize = 512, .maxSequences = 4});
+
+    ac::llama::Evaluator eval(inst, ref, {.windowSize = 64, .stride = 32});
+    CHECK(eval.numParallel() == 4);
+
+    auto res = eval.evaluate(tokens);
+    CHECK(res.numTokens == tokens.size() - 1); // all but the first token are scored exactly once
+    CHECK(res.perplexity() > 1);
+    CHECK(res.perplexity() == doctest::Approx(res.referencePerplexity()));
+    CHECK(res.klMax < 1e-3); // same model
+
+    // parallel decoding doesn't change the results
+    ac::llama::Evaluator serial(inst, {.windowSize = 64, .stride = 32, .numParallel = 1});
+    auto serialRes = serial.evaluate(tokens);
+    CHECK(serialRes.numTokens == res.numTokens);
+    CHECK(serialRes.numWindows == res.numWindows);
+    CHECK(serialRes.perplexity() == doctest::Approx(res.perplexity()).epsilon(0.01));
+
+    CHECK_THROWS_WITH(ac::llama::Evaluator(inst, {.windowSize = 64, .stride = 64}),
+        "Evaluator: stride 64 must be less than the window size 64");
+
+    // files are read in chunks and give the same results as the whole text
+    const auto path = (std::filesystem::temp_directory_path() / "ac-llama-evaluator-test.txt").string();
+    auto evalFile = [&](const std::string& content, uint32_t chunkSize) {
+        std::ofstream(path, std::ios::binary) << content;
+        ac::llama::Evaluator fileEval(inst, {.windowSize = 64, .stride = 32, .fileChunkSize = chunkSize});
+        auto fileRes = fileEval.evaluateFile(path);
+        std::filesystem::remove(path);
+        return fileRes;
+    };
+
+    std::string paragraphs;
+    for (int i = 0; i < 8; ++i) {
+        paragraphs += "The quick brown fox jumps over the lazy dog.\n\n\n"
+            "A journey of a thousand miles begins with a single step.  \n";
+    }
+    auto paragraphTokens = model->vocab().tokenize(paragraphs, false, false);
+    auto wholeRes = serial.evaluate(paragraphTokens);
+    auto fileRes = evalFile(paragraphs, 50);
+    CHECK(fileRes.numTokens == paragraphTokens.size() - 1);
+    CHECK(fileRes.numWindows == wholeRes.numWindows);
+    CHECK(fileRes.perplexity() == doctest::Approx(wholeRes.perplexity()).epsilon(0.01));
+
+    // shorter than the stride
+    fileRes = evalFile("The quick brown fox.", 1024);
+    CHECK(fileRes.numTokens == model->vocab().tokenize("The quick brown fox.", false, false).size() - 1);
+    CHECK(fileRes.numWindows == 1);
+
+    const auto openError = "Evaluator: failed to open " + path;
+    CHECK_THROWS_WITH(serial.evaluateFile(path), openError.c_str());
+}
+
+TEST_CASE("choice scorer") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {}});
+    auto& vocab = model->vocab();
+
+    auto prefix = vocab.tokenize("President George W.", true, true);
+    std::vector<std::vector<ac::llama::Token>> candidates = {
+        vocab.tokenize(" Washington", false, false),
+        vocab.tokenize(" Bush", false, false),
+        vocab.tokenize(" Bush was the president", false, false),
+        vocab.tokenize(" xylophone quantum", false, false),
+    };
+
+    ac::llama::Instance inst(*model, {.maxSequences = 4});
+    ac::llama::ChoiceScorer scorer(inst);
+    auto scores = scorer.score(prefix, candidates);
+    REQUIRE(scores.size() == candidates.size());
+    for (size_t i = 0; i < scores.size(); ++i) {
+        CHECK(scores[i].numTokens == candidates[i].size());
+        CHECK(scores[i].logLikelihood < 0);
+    }
+    CHECK(scores[1].normalized() > scores[0].normalized());
+    CHECK(scores[1].normalized() > scores[3].normalized());
+    CHECK(scores[2].normalized() > scores[3].normalized());
+
+    // scoring in several groups (one sequence) gives the same results
+    ac::llama::Instance serial(*model, {.maxSequences = 1});
+    auto serialScores = ac::llama::ChoiceScorer(serial).score(prefix, candidates);
+    REQUIRE(serialScores.size() == scores.size());
+    for (size_t i = 0; i < scores.size(); ++i) {
+        CHECK(serialScores[i].logLikelihood == doctest::Approx(scores[i].logLikelihood).epsilon(0.01));
+    }
+
+    // as does scoring each candidate on its own
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        auto single = scorer.score(prefix, std::span(candidates).subspan(i, 1));
+        REQUIRE(single.size() == 1);
+        CHECK(single[0].numTokens == scores[i].numTokens);
+        CHECK(single[0].logLikelihood == doctest::Approx(scores[i].logLikelihood).epsilon(0.01));
+    }
+
+    CHECK_THROWS_WITH(scorer.score({}, candidates), "ChoiceScorer: empty prefix");
+    inst.startSession({});
+    CHECK_THROWS_WITH(scorer.score(prefix, candidates), "ChoiceScorer: instance has an active session");
+    inst.stopSession();
+}
+
+TEST_CASE("verifier") {
+    auto model = resourceCache.getModel({.gguf = Model_117m_q6_k, .params = {}});
+
+    std::string text;
+    for (int i = 0; i < 8; ++i) {
+        text += "The quick brown fox jumps over the lazy dog. "
+            "A journey of a thousand miles begins with a single step. ";
+    }
+    auto tokens = model->vocab().tokenize(text, false, false);
+
+    ac::llama::Instance inst(*model, {.ctxSize = 512, .maxSequences = 4});
+    ac::llama::Instance ref(*model, {.ctxSize = 512, .maxSequences = 4});
+
+    ac::llama::ModelVerifier verifier(inst, ref, {.eval = {.windowSize = 64, .stride = 32, .numThreads = 4}});
+
+    std::vector<uint64_t> indices;
+    ac::llama::Evaluator eval(inst, ref, {.windowSize = 64, .stride = 32});
+    auto res = eval.evaluate(tokens, {}, [&](const ac::llama::Evaluator::TokenStats& ts) {
+        indices.push_back(ts.index);
+        CHECK(ts.token == tokens[ts.index]);
+    });
+    REQUIRE(indices.size() == tokens.size() - 1);
+    CHECK(indices.front() == 1);
+    CHECK(indices.back() == tokens.size() - 1);
+    CHECK(res.top1Matches == res.numTokens);
+    CHECK(res.jsdMax < 1e-3);
+
+    // same model must pass
+    auto report = verifier.verify(tokens);
+    CHECK(report.passed);
+    CHECK(report.totals.numTokens == tokens.size() - 1);
+    CHECK(report.totals.top1Agreement() == 1);
+    CHECK(report.klP99 < 1e-3);
+    CHECK(report.summary().find("PASSED") != std::string::npos);
+}